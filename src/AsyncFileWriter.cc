@@ -0,0 +1,143 @@
+#include "AsyncFileWriter.hh"
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+
+
+AsyncFileWriter::File::File(
+    shared_ptr<AsyncFileWriter> writer,
+    uint64_t id,
+    const string& filename,
+    shared_ptr<Account> account)
+  : writer(writer),
+    id(id),
+    filename(filename),
+    account(account) { }
+
+AsyncFileWriter::File::~File() {
+  this->writer->enqueue(OperationType::CLOSE, this->id, "", this->account);
+}
+
+void AsyncFileWriter::File::write(const void* data, size_t size) {
+  this->write(string(reinterpret_cast<const char*>(data), size));
+}
+
+void AsyncFileWriter::File::write(string&& data) {
+  this->writer->enqueue(OperationType::WRITE, this->id, move(data), this->account);
+}
+
+
+
+AsyncFileWriter::AsyncFileWriter(
+    size_t max_pending_bytes_per_account, size_t max_pending_bytes)
+  : max_pending_bytes_per_account(max_pending_bytes_per_account),
+    max_pending_bytes(max_pending_bytes),
+    pending_bytes(0),
+    next_file_id(1),
+    should_exit(false),
+    t(&AsyncFileWriter::thread_fn, this) { }
+
+AsyncFileWriter::~AsyncFileWriter() {
+  {
+    lock_guard<mutex> g(this->queue_lock);
+    this->should_exit = true;
+  }
+  this->queue_cv.notify_one();
+  this->t.join();
+}
+
+shared_ptr<AsyncFileWriter::File> AsyncFileWriter::open(
+    const string& filename, shared_ptr<Account> account) {
+  uint64_t id = this->next_file_id++;
+  this->enqueue(OperationType::OPEN, id, string(filename), account);
+  return shared_ptr<File>(new File(this->shared_from_this(), id, filename, account));
+}
+
+void AsyncFileWriter::write_file(
+    const string& filename, string&& data, shared_ptr<Account> account) {
+  this->open(filename, account)->write(move(data));
+}
+
+bool AsyncFileWriter::should_throttle(const Account& account) const {
+  return (account.pending_bytes >= this->max_pending_bytes_per_account) ||
+      (this->pending_bytes >= this->max_pending_bytes);
+}
+
+void AsyncFileWriter::enqueue(OperationType type, uint64_t file_id,
+    string&& data, shared_ptr<Account> account) {
+  if (type == OperationType::WRITE) {
+    this->pending_bytes += data.size();
+    if (account) {
+      account->pending_bytes += data.size();
+    }
+  }
+  {
+    lock_guard<mutex> g(this->queue_lock);
+    this->queue.emplace_back(Operation{type, file_id, move(data), account});
+  }
+  this->queue_cv.notify_one();
+}
+
+void AsyncFileWriter::thread_fn() {
+  for (;;) {
+    deque<Operation> ops;
+    {
+      unique_lock<mutex> g(this->queue_lock);
+      this->queue_cv.wait(g, [&]() {
+        return this->should_exit || !this->queue.empty();
+      });
+      if (this->queue.empty()) {
+        break; // should_exit is set and there's nothing left to write
+      }
+      ops.swap(this->queue);
+    }
+
+    for (auto& op : ops) {
+      this->execute(op);
+    }
+  }
+}
+
+void AsyncFileWriter::execute(Operation& op) {
+  switch (op.type) {
+    case OperationType::OPEN:
+      try {
+        this->id_to_open_file.emplace(op.file_id, OpenFile{
+            op.data, fopen_unique(op.data, "wb"), 0});
+      } catch (const exception& e) {
+        log(WARNING, "[AsyncFileWriter] Cannot open %s: %s", op.data.c_str(), e.what());
+      }
+      break;
+
+    case OperationType::WRITE: {
+      auto it = this->id_to_open_file.find(op.file_id);
+      if (it != this->id_to_open_file.end()) {
+        try {
+          fwritex(it->second.f.get(), op.data);
+          it->second.bytes_written += op.data.size();
+        } catch (const exception& e) {
+          log(WARNING, "[AsyncFileWriter] Cannot write to %s: %s",
+              it->second.filename.c_str(), e.what());
+        }
+      }
+      this->pending_bytes -= op.data.size();
+      if (op.account) {
+        op.account->pending_bytes -= op.data.size();
+      }
+      break;
+    }
+
+    case OperationType::CLOSE: {
+      auto it = this->id_to_open_file.find(op.file_id);
+      if (it != this->id_to_open_file.end()) {
+        log(INFO, "[AsyncFileWriter] Finished writing %s (%zu bytes)",
+            it->second.filename.c_str(), it->second.bytes_written);
+        this->id_to_open_file.erase(it);
+      }
+      break;
+    }
+  }
+}
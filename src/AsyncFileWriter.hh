@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+
+
+// Writes files on a separate thread, so that threads running event loops don't
+// have to wait for the disk. Each writer of data (e.g. a proxy session) has an
+// Account, which tracks how much of its data is queued but not yet written;
+// callers should stop producing data while should_throttle() returns true for
+// their account. Data is always queued even if the limits are exceeded; the
+// limits only determine when should_throttle() returns true. A message is
+// logged when each file is complete. The destructor writes all queued data
+// before returning.
+class AsyncFileWriter : public std::enable_shared_from_this<AsyncFileWriter> {
+public:
+  struct Account {
+    std::atomic<size_t> pending_bytes;
+    Account() : pending_bytes(0) { }
+  };
+
+  // A file that's open for writing. The file is closed after the last
+  // reference to this object is destroyed and all data written to it has been
+  // written to disk.
+  class File {
+  public:
+    File(const File&) = delete;
+    File(File&&) = delete;
+    File& operator=(const File&) = delete;
+    File& operator=(File&&) = delete;
+    ~File();
+
+    void write(const void* data, size_t size);
+    void write(std::string&& data);
+
+    inline const std::string& get_filename() const {
+      return this->filename;
+    }
+
+  private:
+    File(std::shared_ptr<AsyncFileWriter> writer, uint64_t id,
+        const std::string& filename, std::shared_ptr<Account> account);
+
+    std::shared_ptr<AsyncFileWriter> writer;
+    uint64_t id;
+    std::string filename;
+    std::shared_ptr<Account> account;
+
+    friend class AsyncFileWriter;
+  };
+
+  AsyncFileWriter(
+      size_t max_pending_bytes_per_account = 4 * 1024 * 1024,
+      size_t max_pending_bytes = 64 * 1024 * 1024);
+  AsyncFileWriter(const AsyncFileWriter&) = delete;
+  AsyncFileWriter(AsyncFileWriter&&) = delete;
+  AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+  AsyncFileWriter& operator=(AsyncFileWriter&&) = delete;
+  ~AsyncFileWriter();
+
+  std::shared_ptr<File> open(
+      const std::string& filename, std::shared_ptr<Account> account);
+  // Writes an entire file at once
+  void write_file(const std::string& filename, std::string&& data,
+      std::shared_ptr<Account> account);
+
+  bool should_throttle(const Account& account) const;
+
+private:
+  enum class OperationType {
+    OPEN = 0,
+    WRITE,
+    CLOSE,
+  };
+  struct Operation {
+    OperationType type;
+    uint64_t file_id;
+    std::string data; // Filename for OPEN; contents for WRITE
+    std::shared_ptr<Account> account;
+  };
+
+  size_t max_pending_bytes_per_account;
+  size_t max_pending_bytes;
+  std::atomic<size_t> pending_bytes;
+  std::atomic<uint64_t> next_file_id;
+
+  std::mutex queue_lock;
+  std::condition_variable queue_cv;
+  std::deque<Operation> queue;
+  bool should_exit;
+
+  // These are only used by the writer thread
+  struct OpenFile {
+    std::string filename;
+    std::unique_ptr<FILE, void(*)(FILE*)> f;
+    size_t bytes_written;
+  };
+  std::unordered_map<uint64_t, OpenFile> id_to_open_file;
+
+  std::thread t;
+
+  void enqueue(OperationType type, uint64_t file_id, std::string&& data,
+      std::shared_ptr<Account> account);
+  void thread_fn();
+  void execute(Operation& op);
+};
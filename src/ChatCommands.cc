@@ -248,7 +248,7 @@ static void command_secid(shared_ptr<ServerState>, shared_ptr<Lobby> l,
   }
 }
 
-static void command_password(shared_ptr<ServerState>, shared_ptr<Lobby> l,
+static void command_password(shared_ptr<ServerState> s, shared_ptr<Lobby> l,
     shared_ptr<Client> c, const std::u16string& args) {
   check_is_game(l, true);
   check_is_leader(l, c);
@@ -263,6 +263,7 @@ static void command_password(shared_ptr<ServerState>, shared_ptr<Lobby> l,
     send_text_message_printf(l, "$C6Game password:\n%s",
         encoded.c_str());
   }
+  s->invalidate_game_menu(l);
 }
 
 static void command_min_level(shared_ptr<ServerState>, shared_ptr<Lobby> l,
@@ -374,6 +375,7 @@ static void command_edit(shared_ptr<ServerState> s, shared_ptr<Lobby> l,
     send_text_message(c, u"$C6Unknown field.");
     return;
   }
+  s->update_client_indexes(c);
 
   // reload the client in the lobby/game
   send_player_leave_notification(l, c->lobby_client_id);
@@ -443,6 +445,10 @@ static void command_silence(shared_ptr<ServerState> s, shared_ptr<Lobby> l,
   check_privileges(c, Privilege::SILENCE_USER);
 
   auto target = s->find_client(&args);
+  if (!target) {
+    send_text_message(c, u"$C6Player not found");
+    return;
+  }
   if (!target->license) {
     // this should be impossible, but I'll bet it's not actually
     send_text_message(c, u"$C6Client not logged in");
@@ -465,6 +471,10 @@ static void command_kick(shared_ptr<ServerState> s, shared_ptr<Lobby> l,
   check_privileges(c, Privilege::KICK_USER);
 
   auto target = s->find_client(&args);
+  if (!target) {
+    send_text_message(c, u"$C6Player not found");
+    return;
+  }
   if (!target->license) {
     // This should be impossible, but I'll bet it's not actually
     send_text_message(c, u"$C6Client not logged in");
@@ -495,6 +505,10 @@ static void command_ban(shared_ptr<ServerState> s, shared_ptr<Lobby> l,
 
   u16string identifier = args_str.substr(space_pos + 1);
   auto target = s->find_client(&identifier);
+  if (!target) {
+    send_text_message(c, u"$C6Player not found");
+    return;
+  }
   if (!target->license) {
     // This should be impossible, but I'll bet it's not actually
     send_text_message(c, u"$C6Client not logged in");
@@ -591,26 +605,11 @@ static void command_what(shared_ptr<ServerState>, shared_ptr<Lobby> l,
     return;
   }
 
-  float min_dist2 = 0.0f;
-  uint32_t nearest_item_id = 0xFFFFFFFF;
-  for (const auto& it : l->item_id_to_floor_item) {
-    if (it.second.area != c->area) {
-      continue;
-    }
-    float dx = it.second.x - c->x;
-    float dz = it.second.z - c->z;
-    float dist2 = (dx * dx) + (dz * dz);
-    if ((nearest_item_id == 0xFFFFFFFF) || (dist2 < min_dist2)) {
-      nearest_item_id = it.first;
-      min_dist2 = dist2;
-    }
-  }
-
-  if (nearest_item_id == 0xFFFFFFFF) {
+  const auto* item = l->floor_items.find_nearest(c->area, c->x, c->z);
+  if (!item) {
     send_text_message(c, u"No items are near you");
   } else {
-    const auto& item = l->item_id_to_floor_item.at(nearest_item_id);
-    string name = name_for_item(item.inv_item.data, true);
+    string name = name_for_item(item->inv_item.data, true);
     send_text_message(c, decode_sjis(name));
   }
 }
@@ -0,0 +1,180 @@
+#include "ChoiceSearch.hh"
+
+#include <string.h>
+
+#include <phosg/Strings.hh>
+
+#include "StaticGameData.hh"
+
+using namespace std;
+
+
+
+// Players are grouped into brackets of this many levels
+static const size_t LEVELS_PER_BRACKET = 20;
+static const size_t NUM_LEVEL_BRACKETS = 10;
+
+const vector<ChoiceSearchCategoryDefinition>& choice_search_categories() {
+  static vector<ChoiceSearchCategoryDefinition> categories;
+  if (categories.empty()) {
+    auto& level = categories.emplace_back(
+        ChoiceSearchCategoryDefinition{0x0001, "Level", {}});
+    for (size_t x = 0; x < NUM_LEVEL_BRACKETS; x++) {
+      level.choice_names.emplace_back(string_printf("Lv%zu-%zu",
+          x * LEVELS_PER_BRACKET + 1, (x + 1) * LEVELS_PER_BRACKET));
+    }
+
+    auto& char_class = categories.emplace_back(
+        ChoiceSearchCategoryDefinition{0x0002, "Class", {}});
+    for (size_t x = 0; x < 12; x++) {
+      char_class.choice_names.emplace_back(name_for_char_class(x));
+    }
+
+    auto& section_id = categories.emplace_back(
+        ChoiceSearchCategoryDefinition{0x0003, "Section ID", {}});
+    for (size_t x = 0; x < 10; x++) {
+      section_id.choice_names.emplace_back(name_for_section_id(x));
+    }
+
+    categories.emplace_back(ChoiceSearchCategoryDefinition{
+        0x0004, "Location", {"Lobby", "Game"}});
+  }
+  return categories;
+}
+
+
+
+ChoiceSearchIndex::Query::Query() {
+  for (size_t x = 0; x < ChoiceSearchIndex::NUM_CATEGORIES; x++) {
+    this->values[x] = -1;
+  }
+}
+
+ChoiceSearchIndex::Query::Query(
+    const C_ExecuteChoiceSearch_C3::Entry* entries, size_t count) : Query() {
+  const auto& categories = choice_search_categories();
+  for (size_t x = 0; x < count; x++) {
+    for (size_t z = 0; z < ChoiceSearchIndex::NUM_CATEGORIES; z++) {
+      if (categories[z].category_id != entries[x].parent_category_id) {
+        continue;
+      }
+      // Choice 1 is "any", which is the same as not constraining the category
+      size_t choice_id = entries[x].category_id;
+      if ((choice_id >= 2) && (choice_id - 2 < categories[z].choice_names.size())) {
+        this->values[z] = choice_id - 2;
+      }
+      break;
+    }
+  }
+}
+
+
+
+void ChoiceSearchIndex::add_entry(const Entry* e) {
+  auto& partition = this->partitions[static_cast<size_t>(e->version)][e->is_ep3];
+  partition.all_entries.emplace(e);
+  for (size_t x = 0; x < NUM_CATEGORIES; x++) {
+    auto& value_to_entries = partition.value_to_entries[x];
+    if (value_to_entries.size() <= e->values[x]) {
+      value_to_entries.resize(e->values[x] + 1);
+    }
+    value_to_entries[e->values[x]].emplace(e);
+  }
+}
+
+void ChoiceSearchIndex::remove_entry(const Entry* e) {
+  auto& partition = this->partitions[static_cast<size_t>(e->version)][e->is_ep3];
+  partition.all_entries.erase(e);
+  for (size_t x = 0; x < NUM_CATEGORIES; x++) {
+    partition.value_to_entries[x][e->values[x]].erase(e);
+  }
+}
+
+void ChoiceSearchIndex::update(shared_ptr<Client> c, bool in_game) {
+  auto player = c->game_data.player(false);
+  if (!c->lobby_id || c->choice_search_disabled || !c->license || !player ||
+      (c->version > GameVersion::BB)) {
+    this->remove(c);
+    return;
+  }
+
+  Entry new_entry;
+  new_entry.c = c;
+  new_entry.version = c->version;
+  new_entry.is_ep3 = (c->flags & Client::Flag::EPISODE_3);
+  new_entry.values[LEVEL] = min<size_t>(
+      player->disp.level / LEVELS_PER_BRACKET, NUM_LEVEL_BRACKETS - 1);
+  new_entry.values[CHAR_CLASS] = player->disp.char_class;
+  new_entry.values[SECTION_ID] = player->disp.section_id;
+  new_entry.values[LOCATION] = in_game ? 1 : 0;
+
+  auto emplace_ret = this->client_to_entry.emplace(c.get(), new_entry);
+  Entry& e = emplace_ret.first->second;
+  if (!emplace_ret.second) {
+    if ((e.version == new_entry.version) &&
+        (e.is_ep3 == new_entry.is_ep3) &&
+        !memcmp(e.values, new_entry.values, sizeof(e.values))) {
+      return; // Nothing changed
+    }
+    this->remove_entry(&e);
+    e = new_entry;
+  }
+  this->add_entry(&e);
+}
+
+void ChoiceSearchIndex::remove(shared_ptr<Client> c) {
+  auto it = this->client_to_entry.find(c.get());
+  if (it != this->client_to_entry.end()) {
+    this->remove_entry(&it->second);
+    this->client_to_entry.erase(it);
+  }
+}
+
+vector<shared_ptr<Client>> ChoiceSearchIndex::find(
+    GameVersion version,
+    bool is_ep3,
+    const Query& q,
+    const Client* exclude_c,
+    size_t max_results) const {
+  vector<shared_ptr<Client>> ret;
+  if (version > GameVersion::BB) {
+    return ret;
+  }
+  const auto& partition = this->partitions[static_cast<size_t>(version)][is_ep3];
+
+  // Start from the smallest set of players that satisfies one of the
+  // constrained categories
+  static const unordered_set<const Entry*> empty_set;
+  const unordered_set<const Entry*>* candidates = &partition.all_entries;
+  for (size_t x = 0; x < NUM_CATEGORIES; x++) {
+    if (q.values[x] < 0) {
+      continue;
+    }
+    const auto& value_to_entries = partition.value_to_entries[x];
+    const auto* entries = (static_cast<size_t>(q.values[x]) < value_to_entries.size())
+        ? &value_to_entries[q.values[x]] : &empty_set;
+    if (entries->size() < candidates->size()) {
+      candidates = entries;
+    }
+  }
+
+  for (const Entry* e : *candidates) {
+    if (ret.size() >= max_results) {
+      break;
+    }
+    if (e->c.get() == exclude_c) {
+      continue;
+    }
+    bool matches = true;
+    for (size_t x = 0; x < NUM_CATEGORIES; x++) {
+      if ((q.values[x] >= 0) && (e->values[x] != q.values[x])) {
+        matches = false;
+        break;
+      }
+    }
+    if (matches) {
+      ret.emplace_back(e->c);
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Client.hh"
+#include "CommandFormats.hh"
+#include "Version.hh"
+
+
+
+// Choice Search categories, in the order of ChoiceSearchIndex::Category. All
+// of these are derived from the player's current state, so the high byte of
+// each category ID is zero (the client doesn't let the player set them).
+// Within each category, choice ID 1 means "any"; choice ID 2 and up correspond
+// to attribute values 0 and up.
+struct ChoiceSearchCategoryDefinition {
+  uint16_t category_id;
+  const char* name;
+  std::vector<std::string> choice_names; // Not including "Any"
+};
+
+const std::vector<ChoiceSearchCategoryDefinition>& choice_search_categories();
+
+// Players who can be found with Choice Search, indexed by version (Episode 3
+// players are indexed separately from other GC players, since neither can
+// join the other's games) and by each category's attribute value. A query
+// starts from the smallest set among the categories it constrains and checks
+// the remaining attributes of each player in that set, so queries don't have
+// to look at every connected player. Players are only indexed while they're
+// in a lobby or game and haven't disabled Choice Search; update() must be
+// called whenever a player's level, class, section ID, or lobby changes, and
+// remove() must be called when a player disconnects.
+class ChoiceSearchIndex {
+public:
+  enum Category {
+    LEVEL = 0,
+    CHAR_CLASS,
+    SECTION_ID,
+    LOCATION,
+    NUM_CATEGORIES, // Must be last
+  };
+
+  // Attribute value for each category, or -1 if the category isn't constrained
+  struct Query {
+    int16_t values[NUM_CATEGORIES];
+
+    Query();
+    Query(const C_ExecuteChoiceSearch_C3::Entry* entries, size_t count);
+  };
+
+  ChoiceSearchIndex() = default;
+  ChoiceSearchIndex(const ChoiceSearchIndex&) = delete;
+  ChoiceSearchIndex(ChoiceSearchIndex&&) = delete;
+  ChoiceSearchIndex& operator=(const ChoiceSearchIndex&) = delete;
+  ChoiceSearchIndex& operator=(ChoiceSearchIndex&&) = delete;
+  ~ChoiceSearchIndex() = default;
+
+  void update(std::shared_ptr<Client> c, bool in_game);
+  void remove(std::shared_ptr<Client> c);
+
+  // Returns up to max_results players on the given version who match the
+  // query, not including exclude_c
+  std::vector<std::shared_ptr<Client>> find(
+      GameVersion version,
+      bool is_ep3,
+      const Query& q,
+      const Client* exclude_c,
+      size_t max_results) const;
+
+  inline size_t size() const {
+    return this->client_to_entry.size();
+  }
+
+private:
+  struct Entry {
+    std::shared_ptr<Client> c;
+    GameVersion version;
+    bool is_ep3;
+    uint8_t values[NUM_CATEGORIES];
+  };
+  struct Partition {
+    std::unordered_set<const Entry*> all_entries;
+    std::vector<std::unordered_set<const Entry*>> value_to_entries[NUM_CATEGORIES];
+  };
+
+  std::unordered_map<const Client*, Entry> client_to_entry;
+  // Indexed by [version][is_ep3]
+  Partition partitions[static_cast<size_t>(GameVersion::BB) + 1][2];
+
+  void add_entry(const Entry* e);
+  void remove_entry(const Entry* e);
+};
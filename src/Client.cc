@@ -29,6 +29,12 @@ Client::Client(
     server_behavior(server_behavior),
     should_disconnect(false),
     should_send_to_lobby_server(false),
+    has_deferred_input(false),
+    output_high_watermark(0),
+    output_low_watermark(0),
+    output_congested_since(0),
+    max_output_buffer_bytes(0),
+    dropped_command_count(0),
     proxy_destination_address(0),
     proxy_destination_port(0),
     play_time_begin(now()),
@@ -47,8 +53,12 @@ Client::Client(
     infinite_tp(false),
     switch_assist(false),
     can_chat(true),
+    choice_search_disabled(false),
     pending_bb_save_player_index(0),
-    dol_base_addr(0) {
+    dol_base_addr(0),
+    dol_next_chunk_index(0),
+    dol_chunks_written(0),
+    dol_load_start_time(0) {
   this->last_switch_enabled_command.subcommand = 0;
   int fd = bufferevent_getfd(this->bev);
   if (fd < 0) {
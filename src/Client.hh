@@ -2,7 +2,10 @@
 
 #include <netinet/in.h>
 
+#include <deque>
+#include <map>
 #include <memory>
+#include <string>
 
 #include "CommandFormats.hh"
 #include "FunctionCompiler.hh"
@@ -79,6 +82,31 @@ struct Client {
   bool is_virtual_connection;
   bool should_disconnect;
   bool should_send_to_lobby_server;
+  // True if Server has stopped processing this client's input for now to give
+  // other clients a turn; the remaining input is processed on a later loop
+  // iteration
+  bool has_deferred_input;
+  // Commands that haven't been sent yet because a large transfer is being
+  // paced (see send_command_paced). While this isn't empty, all commands sent
+  // to the client are added here instead, so they're sent in order.
+  struct QueuedCommand {
+    uint16_t command;
+    uint32_t flag;
+    std::string data;
+  };
+  std::deque<QueuedCommand> queued_commands;
+  // Output back-pressure. Server sets the watermarks when the client connects.
+  // While the output buffer is congested (it has grown beyond the high
+  // watermark and hasn't yet drained below the low watermark), droppable
+  // commands aren't sent; only the latest one with each coalescing key is kept
+  // in coalesced_commands, and these are sent when the congestion ends (see
+  // send_command_droppable).
+  size_t output_high_watermark;
+  size_t output_low_watermark;
+  uint64_t output_congested_since; // 0 if not congested
+  std::map<uint16_t, QueuedCommand> coalesced_commands;
+  size_t max_output_buffer_bytes;
+  size_t dropped_command_count;
   uint32_t proxy_destination_address;
   uint16_t proxy_destination_port;
 
@@ -105,12 +133,16 @@ struct Client {
   bool switch_assist; // cheats enabled
   G_SwitchStateChanged_6x05 last_switch_enabled_command;
   bool can_chat;
+  bool choice_search_disabled; // Set by the client with a C2 command
   std::string pending_bb_save_username;
   uint8_t pending_bb_save_player_index;
 
   // DOL file loading state
   uint32_t dol_base_addr;
   std::shared_ptr<DOLFileIndex::DOLFile> loading_dol_file;
+  size_t dol_next_chunk_index; // Next chunk to send
+  size_t dol_chunks_written; // Chunks the client has returned a result for
+  uint64_t dol_load_start_time;
 
   Client(struct bufferevent* bev, GameVersion version,
       ServerBehavior server_behavior);
@@ -0,0 +1,115 @@
+#include "ClientDirectory.hh"
+
+#include "Text.hh"
+
+using namespace std;
+
+
+
+u16string ClientDirectory::normalize_name(const u16string& name) {
+  return remove_language_marker(name);
+}
+
+template <typename KeyT>
+void ClientDirectory::erase_entry(
+    unordered_multimap<KeyT, shared_ptr<Client>>& m,
+    const KeyT& key,
+    const Client* c) {
+  auto its = m.equal_range(key);
+  for (auto it = its.first; it != its.second; it++) {
+    if (it->second.get() == c) {
+      m.erase(it);
+      return;
+    }
+  }
+}
+
+template <typename KeyT>
+void ClientDirectory::find_in_range(
+    const unordered_multimap<KeyT, shared_ptr<Client>>& m,
+    const KeyT& key,
+    uint32_t preferred_lobby_id,
+    shared_ptr<Client>& result) {
+  auto its = m.equal_range(key);
+  for (auto it = its.first; it != its.second; it++) {
+    const auto& c = it->second;
+    if (!c->lobby_id) {
+      continue;
+    }
+    if (preferred_lobby_id && (c->lobby_id == preferred_lobby_id)) {
+      result = c;
+      return;
+    }
+    if (!result) {
+      result = c;
+    }
+  }
+}
+
+void ClientDirectory::update(shared_ptr<Client> c) {
+  Keys new_keys;
+  new_keys.serial_number = c->license ? c->license->serial_number : 0;
+  auto player = c->game_data.player(false);
+  if (player) {
+    new_keys.name = ClientDirectory::normalize_name(player->disp.name);
+  }
+
+  auto& keys = this->client_to_keys[c.get()];
+  if (keys.serial_number != new_keys.serial_number) {
+    if (keys.serial_number) {
+      this->erase_entry(this->serial_number_to_client, keys.serial_number, c.get());
+    }
+    if (new_keys.serial_number) {
+      this->serial_number_to_client.emplace(new_keys.serial_number, c);
+    }
+    keys.serial_number = new_keys.serial_number;
+  }
+  if (keys.name != new_keys.name) {
+    if (!keys.name.empty()) {
+      this->erase_entry(this->name_to_client, keys.name, c.get());
+    }
+    if (!new_keys.name.empty()) {
+      this->name_to_client.emplace(new_keys.name, c);
+    }
+    keys.name = move(new_keys.name);
+  }
+}
+
+void ClientDirectory::remove(shared_ptr<Client> c) {
+  auto it = this->client_to_keys.find(c.get());
+  if (it == this->client_to_keys.end()) {
+    return;
+  }
+  if (it->second.serial_number) {
+    this->erase_entry(this->serial_number_to_client, it->second.serial_number, c.get());
+  }
+  if (!it->second.name.empty()) {
+    this->erase_entry(this->name_to_client, it->second.name, c.get());
+  }
+  this->client_to_keys.erase(it);
+}
+
+shared_ptr<Client> ClientDirectory::find(
+    uint32_t serial_number,
+    const u16string* name,
+    uint32_t preferred_lobby_id) const {
+  shared_ptr<Client> result;
+  if (serial_number) {
+    this->find_in_range(this->serial_number_to_client, serial_number,
+        preferred_lobby_id, result);
+    if (result && (!preferred_lobby_id || (result->lobby_id == preferred_lobby_id))) {
+      return result;
+    }
+  }
+  if (name) {
+    shared_ptr<Client> name_result;
+    this->find_in_range(this->name_to_client,
+        ClientDirectory::normalize_name(*name), preferred_lobby_id,
+        name_result);
+    if (name_result && (!result ||
+        (preferred_lobby_id && (name_result->lobby_id == preferred_lobby_id)))) {
+      return name_result;
+    }
+  }
+  return result;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "Client.hh"
+
+
+
+// Indexes connected clients by serial number and by player name, so that
+// commands that refer to another player (guild card search, simple mail, and
+// moderation commands) don't have to search every lobby. Names are compared
+// without their language markers. The index doesn't track changes to clients
+// by itself; update() must be called whenever a client's license or player
+// name may have changed, and remove() must be called when a client
+// disconnects.
+class ClientDirectory {
+public:
+  ClientDirectory() = default;
+  ClientDirectory(const ClientDirectory&) = delete;
+  ClientDirectory(ClientDirectory&&) = delete;
+  ClientDirectory& operator=(const ClientDirectory&) = delete;
+  ClientDirectory& operator=(ClientDirectory&&) = delete;
+  ~ClientDirectory() = default;
+
+  void update(std::shared_ptr<Client> c);
+  void remove(std::shared_ptr<Client> c);
+
+  // Returns a client in any lobby whose serial number is serial_number (if
+  // nonzero) or whose name is *name (if name is not null). If multiple clients
+  // match, a client in preferred_lobby_id is returned if there is one. Returns
+  // nullptr if no client matches.
+  std::shared_ptr<Client> find(
+      uint32_t serial_number,
+      const std::u16string* name,
+      uint32_t preferred_lobby_id = 0) const;
+
+  inline size_t size() const {
+    return this->client_to_keys.size();
+  }
+
+  static std::u16string normalize_name(const std::u16string& name);
+
+private:
+  struct Keys {
+    uint32_t serial_number; // 0 if not indexed by serial number
+    std::u16string name; // Empty if not indexed by name
+  };
+  std::unordered_map<const Client*, Keys> client_to_keys;
+  std::unordered_multimap<uint32_t, std::shared_ptr<Client>> serial_number_to_client;
+  std::unordered_multimap<std::u16string, std::shared_ptr<Client>> name_to_client;
+
+  template <typename KeyT>
+  static void erase_entry(
+      std::unordered_multimap<KeyT, std::shared_ptr<Client>>& m,
+      const KeyT& key,
+      const Client* c);
+  template <typename KeyT>
+  static void find_in_range(
+      const std::unordered_multimap<KeyT, std::shared_ptr<Client>>& m,
+      const KeyT& key,
+      uint32_t preferred_lobby_id,
+      std::shared_ptr<Client>& result);
+};
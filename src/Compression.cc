@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <vector>
 #include <phosg/Strings.hh>
 
 using namespace std;
@@ -19,6 +20,10 @@ struct prs_compress_ctx {
 
   prs_compress_ctx() : bitpos(0), forward_log("\0", 1) { }
 
+  size_t size() const {
+    return this->output.size() + this->forward_log.size();
+  }
+
   string finish() {
     this->put_control_bit(0);
     this->put_control_bit(1);
@@ -96,37 +101,74 @@ struct prs_compress_ctx {
   }
 };
 
-string prs_compress(const void* vdata, size_t size) {
+// Matches are found by following a chain of all previous offsets in the window
+// whose first 3 bytes have the same hash as the data at the current offset,
+// from nearest to farthest. Offsets whose first 3 bytes differ can't produce a
+// usable match, so this finds the same matches as checking every offset in the
+// window, but much faster.
+static const size_t PRS_HASH_BITS = 15;
+static const ssize_t PRS_WINDOW_SIZE = 0x1FF0; // max offset is -0x1FF0
+static const size_t PRS_CHAIN_SIZE = 0x2000; // must be larger than the window
+
+static inline size_t prs_hash(const uint8_t* data) {
+  uint32_t v = (data[0] << 16) | (data[1] << 8) | data[2];
+  return (v * 0x9E3779B1) >> (32 - PRS_HASH_BITS);
+}
+
+string prs_compress_bounded(const void* vdata, size_t size,
+    size_t max_output_size, size_t* input_bytes_consumed) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
   prs_compress_ctx pc;
 
+  // hash_head[h] is the most recent offset whose first 3 bytes have hash h, and
+  // hash_chain[offset % PRS_CHAIN_SIZE] is the previous offset with the same
+  // hash as offset (or -1 for either if there is none)
+  vector<ssize_t> hash_head(1 << PRS_HASH_BITS, -1);
+  vector<ssize_t> hash_chain(PRS_CHAIN_SIZE, -1);
   ssize_t data_ssize = static_cast<ssize_t>(size);
+  ssize_t hashed_offset = 0;
+  auto hash_through = [&](ssize_t end_offset) {
+    for (; (hashed_offset < end_offset) && (hashed_offset + 3 <= data_ssize);
+         hashed_offset++) {
+      size_t h = prs_hash(data + hashed_offset);
+      hash_chain[hashed_offset % PRS_CHAIN_SIZE] = hash_head[h];
+      hash_head[h] = hashed_offset;
+    }
+  };
+
   ssize_t read_offset = 0;
   while (read_offset < data_ssize) {
+    // Each command adds at most 4 bytes to the output (including a new control
+    // byte), and finish() adds at most 3 more
+    if (max_output_size && (pc.size() + 7 > max_output_size)) {
+      break;
+    }
 
     // look for a chunk of data in history matching what's at the current offset
     ssize_t best_offset = 0;
     ssize_t best_size = 0;
-    for (ssize_t this_offset = -3; // min copy size is 3 bytes
-         (this_offset + read_offset >= 0) && // don't go before the beginning
-         (this_offset > -0x1FF0) && // max offset is -0x1FF0
-         (best_size < 255); // max size is 0xFF bytes
-         this_offset--) {
-
-      // for this offset, expand the match as much as possible
-      ssize_t this_size = 1;
-      while ((this_size < 0x100) && // max copy size is 255 bytes
-             ((this_offset + this_size) < 0) && // don't copy past the read offset
-             (this_size <= data_ssize - read_offset) && // don't copy past the end
-             !memcmp(data + read_offset + this_offset, data + read_offset,
-                     this_size)) {
-        this_size++;
-      }
-      this_size--;
+    if (read_offset + 3 <= data_ssize) {
+      for (ssize_t match_offset = hash_head[prs_hash(data + read_offset)];
+           (match_offset >= 0) && // don't go before the beginning
+           (read_offset - match_offset < PRS_WINDOW_SIZE) &&
+           (best_size < 255); // max size is 0xFF bytes
+           match_offset = hash_chain[match_offset % PRS_CHAIN_SIZE]) {
+
+        // for this offset, expand the match as much as possible, without
+        // copying past the read offset or past the end of the data
+        ssize_t this_offset = match_offset - read_offset;
+        ssize_t max_size = min<ssize_t>(
+            min<ssize_t>(255, -this_offset - 1), data_ssize - read_offset);
+        ssize_t this_size = 0;
+        while ((this_size < max_size) &&
+               (data[match_offset + this_size] == data[read_offset + this_size])) {
+          this_size++;
+        }
 
-      if (this_size > best_size) {
-        best_offset = this_offset;
-        best_size = this_size;
+        if (this_size > best_size) {
+          best_offset = this_offset;
+          best_size = this_size;
+        }
       }
     }
 
@@ -139,11 +181,19 @@ string prs_compress(const void* vdata, size_t size) {
       pc.copy(best_offset, best_size);
       read_offset += best_size;
     }
+    hash_through(read_offset);
   }
 
+  if (input_bytes_consumed) {
+    *input_bytes_consumed = read_offset;
+  }
   return pc.finish();
 }
 
+string prs_compress(const void* vdata, size_t size) {
+  return prs_compress_bounded(vdata, size, 0, nullptr);
+}
+
 string prs_compress(const string& data) {
   return prs_compress(data.data(), data.size());
 }
@@ -8,6 +8,12 @@
 
 std::string prs_compress(const void* vdata, size_t size);
 std::string prs_compress(const std::string& data);
+// Compresses as much of the data as possible without the output exceeding
+// max_output_size bytes, and returns the number of input bytes represented by
+// the output in *input_bytes_consumed. The output can be decompressed on its
+// own (it doesn't refer to any data before vdata).
+std::string prs_compress_bounded(const void* vdata, size_t size,
+    size_t max_output_size, size_t* input_bytes_consumed);
 
 std::string prs_decompress(const std::string& data, size_t max_size = 0);
 size_t prs_decompress_size(const std::string& data, size_t max_size = 0);
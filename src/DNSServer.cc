@@ -7,6 +7,7 @@
 #include <netinet/in.h>
 
 #include <phosg/Encoding.hh>
+#include <phosg/Hash.hh>
 #include <phosg/Network.hh>
 #include <phosg/Strings.hh>
 #include <vector>
@@ -20,8 +21,12 @@ using namespace std;
 
 DNSServer::DNSServer(shared_ptr<struct event_base> base,
     uint32_t local_connect_address, uint32_t external_connect_address) :
-    base(base), local_connect_address(local_connect_address),
-    external_connect_address(external_connect_address) { }
+    base(base),
+    connect_addresses((static_cast<uint64_t>(local_connect_address) << 32) |
+        external_connect_address),
+    query_buffers(BATCH_SIZE * MAX_QUERY_SIZE),
+    response_buffers(BATCH_SIZE * MAX_RESPONSE_SIZE),
+    remote_addrs(BATCH_SIZE) { }
 
 DNSServer::~DNSServer() {
   for (const auto& it : this->fd_to_receive_event) {
@@ -49,28 +54,112 @@ void DNSServer::add_socket(int fd) {
   this->fd_to_receive_event.emplace(fd, move(e));
 }
 
+void DNSServer::set_connect_addresses(
+    uint32_t local_connect_address, uint32_t external_connect_address) {
+  this->connect_addresses = (static_cast<uint64_t>(local_connect_address) << 32) |
+      external_connect_address;
+}
+
 void DNSServer::dispatch_on_receive_message(evutil_socket_t fd,
     short events, void* ctx) {
   reinterpret_cast<DNSServer*>(ctx)->on_receive_message(fd, events);
 }
 
-string DNSServer::response_for_query(
+static const size_t MAX_QUESTIONS_PER_QUERY = 0x10;
+static const size_t MAX_CACHED_RESPONSES = 0x400;
+
+// Returns the offset of the first byte after the question section, or 0 if the
+// question section is malformed. The offset of each question's name is written
+// to name_offsets.
+static size_t parse_question_section(const uint8_t* data, size_t size,
+    size_t question_count, size_t* name_offsets) {
+  size_t offset = 0x0C;
+  for (size_t z = 0; z < question_count; z++) {
+    name_offsets[z] = offset;
+    for (;;) {
+      if (offset >= size) {
+        return 0;
+      }
+      uint8_t label_size = data[offset];
+      if (label_size == 0) {
+        offset++;
+        break;
+      } else if ((label_size & 0xC0) == 0xC0) {
+        // Compression pointer; this is always the end of the name
+        offset += 2;
+        break;
+      } else if (label_size & 0xC0) {
+        return 0;
+      }
+      offset += label_size + 1;
+    }
+    offset += 4; // qtype and qclass
+    if (offset > size) {
+      return 0;
+    }
+  }
+  return offset;
+}
+
+size_t DNSServer::write_response_for_query(void* vout, size_t out_size,
     const void* vdata, size_t size, uint32_t resolved_address) {
   if (size < 0x0C) {
-    throw invalid_argument("query too small");
+    return 0;
   }
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  uint8_t* out = reinterpret_cast<uint8_t*>(vout);
 
-  const char* data = reinterpret_cast<const char*>(vdata);
-  size_t name_len = strlen(&data[12]) + 1;
+  size_t question_count = *reinterpret_cast<const be_uint16_t*>(data + 4);
+  if (question_count == 0 || question_count > MAX_QUESTIONS_PER_QUERY) {
+    return 0;
+  }
+  size_t name_offsets[MAX_QUESTIONS_PER_QUERY];
+  size_t questions_end = parse_question_section(
+      data, size, question_count, name_offsets);
+  if (questions_end == 0) {
+    return 0;
+  }
+
+  size_t response_size = questions_end + 0x10 * question_count;
+  if (response_size > out_size) {
+    return 0;
+  }
 
+  // Header: same ID as the query, standard response with recursion
+  // available, no error, one answer per question, no authority or additional
+  // records
+  memcpy(out, data, 2);
+  memcpy(out + 2, "\x81\x80", 2);
+  *reinterpret_cast<be_uint16_t*>(out + 4) = question_count;
+  *reinterpret_cast<be_uint16_t*>(out + 6) = question_count;
+  memset(out + 8, 0, 4);
+
+  // The question section is echoed verbatim
+  memcpy(out + 0x0C, data + 0x0C, questions_end - 0x0C);
+
+  // Each answer refers to its question's name with a compression pointer
   be_uint32_t be_resolved_address = resolved_address;
+  uint8_t* answer = out + questions_end;
+  for (size_t z = 0; z < question_count; z++) {
+    answer[0] = 0xC0 | ((name_offsets[z] >> 8) & 0x3F);
+    answer[1] = name_offsets[z] & 0xFF;
+    memcpy(answer + 2, "\x00\x01\x00\x01\x00\x00\x00\x3C\x00\x04", 10);
+    memcpy(answer + 12, &be_resolved_address, 4);
+    answer += 0x10;
+  }
 
-  string response;
-  response.append(data, 2);
-  response.append("\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00", 10);
-  response.append(&data[12], name_len);
-  response.append("\x00\x01\x00\x01\xC0\x0C\x00\x01\x00\x01\x00\x00\x00\x3C\x00\x04", 16);
-  response.append(reinterpret_cast<const char*>(&be_resolved_address), 4);
+  return response_size;
+}
+
+string DNSServer::response_for_query(
+    const void* vdata, size_t size, uint32_t resolved_address) {
+  string response(MAX_RESPONSE_SIZE, '\0');
+  size_t response_size = DNSServer::write_response_for_query(
+      response.data(), response.size(), vdata, size, resolved_address);
+  if (response_size == 0) {
+    throw invalid_argument("malformed query");
+  }
+  response.resize(response_size);
   return response;
 }
 
@@ -79,15 +168,143 @@ string DNSServer::response_for_query(
   return DNSServer::response_for_query(query.data(), query.size(), resolved_address);
 }
 
+size_t DNSServer::respond(void* out, const void* vquery, size_t query_size,
+    const struct sockaddr_storage& remote) {
+  const uint8_t* query = reinterpret_cast<const uint8_t*>(vquery);
+  bool is_local = is_local_address(remote);
+  uint64_t connect_addresses = this->connect_addresses.load(memory_order_relaxed);
+  uint32_t resolved_address = is_local
+      ? (connect_addresses >> 32) : (connect_addresses & 0xFFFFFFFF);
+
+  // Find the end of the question section, which is the cache key along with
+  // the question count and whether the client is local
+  size_t question_count = *reinterpret_cast<const be_uint16_t*>(query + 4);
+  if (question_count == 0 || question_count > MAX_QUESTIONS_PER_QUERY) {
+    return 0;
+  }
+  size_t name_offsets[MAX_QUESTIONS_PER_QUERY];
+  size_t questions_end = parse_question_section(
+      query, query_size, question_count, name_offsets);
+  if (questions_end == 0) {
+    return 0;
+  }
+  uint8_t key_prefix[3] = {query[4], query[5], is_local};
+  uint64_t key = fnv1a64(query + 0x0C, questions_end - 0x0C,
+      fnv1a64(key_prefix, sizeof(key_prefix)));
+
+  auto it = this->response_cache.find(key);
+  if ((it != this->response_cache.end()) &&
+      (it->second.is_local == is_local) &&
+      (it->second.resolved_address == resolved_address) &&
+      (it->second.questions.size() == questions_end - 0x0A) &&
+      !memcmp(it->second.questions.data(), query + 4, 2) &&
+      !memcmp(it->second.questions.data() + 2, query + 0x0C, questions_end - 0x0C)) {
+    const string& response = it->second.response;
+    memcpy(out, response.data(), response.size());
+    memcpy(out, query, 2);
+    return response.size();
+  }
+
+  size_t response_size = this->write_response_for_query(
+      out, MAX_RESPONSE_SIZE, query, query_size, resolved_address);
+  if (response_size) {
+    if (this->response_cache.size() >= MAX_CACHED_RESPONSES) {
+      this->response_cache.clear();
+    }
+    auto& entry = this->response_cache[key];
+    entry.questions.assign(reinterpret_cast<const char*>(query + 4), 2);
+    entry.questions.append(reinterpret_cast<const char*>(query + 0x0C), questions_end - 0x0C);
+    entry.is_local = is_local;
+    entry.resolved_address = resolved_address;
+    entry.response.assign(reinterpret_cast<const char*>(out), response_size);
+  }
+  return response_size;
+}
+
 void DNSServer::on_receive_message(int fd, short) {
+#ifdef __linux__
+  // Receive and answer up to BATCH_SIZE queries per system call. The sockets
+  // are nonblocking, so this returns as soon as there's nothing more to read.
+  struct mmsghdr in_msgs[BATCH_SIZE];
+  struct iovec in_iovs[BATCH_SIZE];
+  struct mmsghdr out_msgs[BATCH_SIZE];
+  struct iovec out_iovs[BATCH_SIZE];
+  for (;;) {
+    memset(in_msgs, 0, sizeof(in_msgs));
+    for (size_t z = 0; z < BATCH_SIZE; z++) {
+      in_iovs[z].iov_base = &this->query_buffers[z * MAX_QUERY_SIZE];
+      in_iovs[z].iov_len = MAX_QUERY_SIZE;
+      in_msgs[z].msg_hdr.msg_name = &this->remote_addrs[z];
+      in_msgs[z].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+      in_msgs[z].msg_hdr.msg_iov = &in_iovs[z];
+      in_msgs[z].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = recvmmsg(fd, in_msgs, BATCH_SIZE, 0, nullptr);
+    if (count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log(INFO, "[DNSServer] input error %d", errno);
+        throw runtime_error("cannot read from udp socket");
+      }
+      break;
+    }
+
+    size_t num_responses = 0;
+    for (size_t z = 0; z < static_cast<size_t>(count); z++) {
+      const uint8_t* query = &this->query_buffers[z * MAX_QUERY_SIZE];
+      size_t query_size = in_msgs[z].msg_len;
+      if (query_size < 0x0C) {
+        log(WARNING, "[DNSServer] input query too small");
+        print_data(stderr, query, query_size);
+        continue;
+      }
+      if (in_msgs[z].msg_hdr.msg_flags & MSG_TRUNC) {
+        continue;
+      }
+
+      uint8_t* response = &this->response_buffers[num_responses * MAX_RESPONSE_SIZE];
+      size_t response_size = this->respond(
+          response, query, query_size, this->remote_addrs[z]);
+      if (!response_size) {
+        continue;
+      }
+
+      out_iovs[num_responses].iov_base = response;
+      out_iovs[num_responses].iov_len = response_size;
+      auto& hdr = out_msgs[num_responses].msg_hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_name = &this->remote_addrs[z];
+      hdr.msg_namelen = in_msgs[z].msg_hdr.msg_namelen;
+      hdr.msg_iov = &out_iovs[num_responses];
+      hdr.msg_iovlen = 1;
+      num_responses++;
+    }
+
+    // If the socket's send buffer is full, the remaining responses are
+    // dropped, just as they would be anywhere else along the way; the client
+    // will retry the query
+    for (size_t sent = 0; sent < num_responses;) {
+      int ret = sendmmsg(fd, &out_msgs[sent], num_responses - sent, 0);
+      if (ret <= 0) {
+        break;
+      }
+      sent += ret;
+    }
+
+    if (static_cast<size_t>(count) < BATCH_SIZE) {
+      break;
+    }
+  }
+
+#else
   for (;;) {
-    sockaddr_in remote;
-    socklen_t remote_size = sizeof(sockaddr_in);
+    struct sockaddr_storage& remote = this->remote_addrs[0];
+    socklen_t remote_size = sizeof(struct sockaddr_storage);
     memset(&remote, 0, remote_size);
 
-    string input(2048, 0);
-    ssize_t bytes = recvfrom(fd, const_cast<char*>(input.data()), input.size(),
-        0, reinterpret_cast<sockaddr*>(&remote), &remote_size);
+    uint8_t* query = this->query_buffers.data();
+    ssize_t bytes = recvfrom(fd, query, MAX_QUERY_SIZE, 0,
+        reinterpret_cast<sockaddr*>(&remote), &remote_size);
 
     if (bytes < 0) {
       if (errno != EAGAIN) {
@@ -101,17 +318,16 @@ void DNSServer::on_receive_message(int fd, short) {
 
     } else if (bytes < 0x0C) {
       log(WARNING, "[DNSServer] input query too small");
-      print_data(stderr, input);
+      print_data(stderr, query, bytes);
 
     } else {
-      input.resize(bytes);
-      uint32_t remote_address = ntohl(remote.sin_addr.s_addr);
-      uint32_t connect_address = is_local_address(remote_address)
-          ? this->local_connect_address
-          : this->external_connect_address;
-      string response = this->response_for_query(input, connect_address);
-      sendto(fd, response.data(), response.size(), 0,
-          reinterpret_cast<const sockaddr*>(&remote), remote_size);
+      uint8_t* response = this->response_buffers.data();
+      size_t response_size = this->respond(response, query, bytes, remote);
+      if (response_size) {
+        sendto(fd, response, response_size, 0,
+            reinterpret_cast<const sockaddr*>(&remote), remote_size);
+      }
     }
   }
+#endif
 }
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <event2/event.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
+#include <atomic>
 #include <memory>
 #include <unordered_map>
 #include <string>
 #include <set>
+#include <vector>
 
 
 class DNSServer {
@@ -21,6 +25,18 @@ public:
   void listen(int port);
   void add_socket(int fd);
 
+  // This may be called from any thread, even if the server is running on a
+  // different thread. Queries received after this returns are answered with
+  // the new addresses.
+  void set_connect_addresses(
+      uint32_t local_connect_address, uint32_t external_connect_address);
+
+  // Writes a response to the given query into out, and returns the size of
+  // the response. Returns 0 if the query is malformed or the response doesn't
+  // fit in out_size bytes. Every question in the query is answered with an A
+  // record pointing to resolved_address.
+  static size_t write_response_for_query(void* out, size_t out_size,
+      const void* vdata, size_t size, uint32_t resolved_address);
   static std::string response_for_query(
       const void* vdata, size_t size, uint32_t resolved_address);
   static std::string response_for_query(
@@ -28,11 +44,37 @@ public:
 
 private:
   std::shared_ptr<struct event_base> base;
-  std::unordered_map<int, std::unique_ptr<struct event, void(*)(struct event*)>> fd_to_receive_event;
-  uint32_t local_connect_address;
-  uint32_t external_connect_address;
+  std::unordered_map<int, std::unique_ptr<struct event, void(*)(struct event*)>>
+      fd_to_receive_event;
+  // The local address is in the high 32 bits and the external address is in
+  // the low 32 bits, so both are always updated together
+  std::atomic<uint64_t> connect_addresses;
+
+  // Prebuilt responses, keyed by a hash of the question section and whether
+  // the client is local. Entries built for a different address than the
+  // current one (after set_connect_addresses) are rebuilt. The response ID
+  // (first two bytes) is overwritten with the query's ID when a cached
+  // response is sent.
+  struct CachedResponse {
+    std::string questions;
+    bool is_local;
+    uint32_t resolved_address;
+    std::string response;
+  };
+  std::unordered_map<uint64_t, CachedResponse> response_cache;
+
+  // Datagram buffers, allocated once and reused for every batch of messages
+  static constexpr size_t BATCH_SIZE = 32;
+  static constexpr size_t MAX_QUERY_SIZE = 2048;
+  static constexpr size_t MAX_RESPONSE_SIZE = 4096;
+  std::vector<uint8_t> query_buffers;
+  std::vector<uint8_t> response_buffers;
+  std::vector<struct sockaddr_storage> remote_addrs;
 
   static void dispatch_on_receive_message(evutil_socket_t fd, short events,
       void* ctx);
   void on_receive_message(int fd, short event);
+
+  size_t respond(void* out, const void* query, size_t query_size,
+      const struct sockaddr_storage& remote);
 };
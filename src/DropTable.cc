@@ -0,0 +1,72 @@
+#include "DropTable.hh"
+
+#include <math.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+
+
+DropRNG::DropRNG(uint64_t seed) {
+  // splitmix64, so similar seeds don't produce similar sequences (and so the
+  // state is never zero, which xorshift can't escape from)
+  seed += 0x9E3779B97F4A7C15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+  this->state = seed ^ (seed >> 31);
+  if (this->state == 0) {
+    this->state = 0x9E3779B97F4A7C15ULL;
+  }
+}
+
+
+
+AliasTable::AliasTable(const vector<double>& weights) {
+  if (weights.empty()) {
+    throw invalid_argument("alias table must have at least one outcome");
+  }
+  double total = 0.0;
+  for (double w : weights) {
+    if (!(w >= 0.0) || isinf(w)) {
+      throw invalid_argument("alias table weights must be finite and nonnegative");
+    }
+    total += w;
+  }
+  if (total <= 0.0) {
+    throw invalid_argument("alias table weights must not all be zero");
+  }
+
+  // Vose's method: scale the weights so the average is 1, then repeatedly
+  // fill an underfull entry with part of an overfull one
+  size_t n = weights.size();
+  vector<double> scaled(n);
+  vector<size_t> small;
+  vector<size_t> large;
+  for (size_t x = 0; x < n; x++) {
+    scaled[x] = weights[x] * n / total;
+    (scaled[x] < 1.0 ? small : large).emplace_back(x);
+  }
+
+  this->entries.resize(n);
+  while (!small.empty() && !large.empty()) {
+    size_t s = small.back();
+    small.pop_back();
+    size_t l = large.back();
+    large.pop_back();
+
+    this->entries[s].threshold = llround(scaled[s] * 0x100000000);
+    this->entries[s].alias = l;
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    (scaled[l] < 1.0 ? small : large).emplace_back(l);
+  }
+  // Anything left over is full (or within rounding error of it)
+  for (size_t x : large) {
+    this->entries[x].threshold = 0x100000000;
+    this->entries[x].alias = x;
+  }
+  for (size_t x : small) {
+    this->entries[x].threshold = 0x100000000;
+    this->entries[x].alias = x;
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+
+
+// Fast, non-cryptographic random number generator (xorshift64*) used for item
+// drops. Each game has its own, seeded when the game is created, so drops
+// don't have to read from the system's random source.
+class DropRNG {
+public:
+  explicit DropRNG(uint64_t seed);
+
+  inline uint64_t next() {
+    this->state ^= this->state >> 12;
+    this->state ^= this->state << 25;
+    this->state ^= this->state >> 27;
+    return this->state * 0x2545F4914F6CDD1DULL;
+  }
+
+  // Returns a number in the range [low, high], like phosg's random_int. If
+  // high < low, returns low.
+  inline int64_t next_int(int64_t low, int64_t high) {
+    if (high <= low) {
+      return low;
+    }
+    uint64_t range = high - low + 1;
+    return low + static_cast<int64_t>(
+        (static_cast<unsigned __int128>(this->next()) * range) >> 64);
+  }
+
+private:
+  uint64_t state;
+};
+
+// Chooses one of a fixed set of outcomes with fixed probabilities in constant
+// time, using Walker's alias method. The table is built once from the
+// outcomes' weights; each sample then uses a single random number and one
+// table lookup, regardless of how many outcomes there are.
+class AliasTable {
+public:
+  AliasTable() = default;
+  // The weights don't have to add up to 1, but at least one must be positive
+  explicit AliasTable(const std::vector<double>& weights);
+
+  inline size_t sample(DropRNG& rng) const {
+    // The high 32 bits choose an entry; the low 32 bits choose between the
+    // entry and its alias
+    uint64_t r = rng.next();
+    size_t index = ((r >> 32) * this->entries.size()) >> 32;
+    const auto& e = this->entries[index];
+    return ((r & 0xFFFFFFFF) < e.threshold) ? index : e.alias;
+  }
+
+  inline size_t size() const {
+    return this->entries.size();
+  }
+
+private:
+  struct Entry {
+    uint64_t threshold; // Out of 0x100000000
+    size_t alias;
+  };
+  std::vector<Entry> entries;
+};
@@ -3,7 +3,10 @@
 #include <stdint.h>
 
 #include <array>
+#include <atomic>
+#include <thread>
 #include <phosg/Filesystem.hh>
+#include <phosg/Time.hh>
 
 #include "Compression.hh"
 #include "Text.hh"
@@ -662,7 +665,7 @@ string Ep3CardStats::str() const {
 
 
 
-Ep3DataIndex::Ep3DataIndex(const string& directory) {
+Ep3DataIndex::Ep3DataIndex(const string& directory) : num_cards(0) {
   static constexpr bool debug_enabled = false;
 
   unordered_map<uint32_t, vector<string>> card_tags;
@@ -737,28 +740,62 @@ Ep3DataIndex::Ep3DataIndex(const string& directory) {
     }
     const auto* stats = reinterpret_cast<const Ep3CardStats*>(data.data());
     size_t max_cards = data.size() / sizeof(Ep3CardStats);
+
+    // The last card entry has the build date and some other metadata (and
+    // isn't a real card, obviously), so skip it. Seems like the card ID is
+    // always a large number that won't fit in a uint16_t, so we use that to
+    // determine if the entry is a real card or not.
+    size_t card_id_limit = 0;
+    for (size_t x = 0; x < max_cards; x++) {
+      if (!(stats[x].card_id & 0xFFFF0000)) {
+        card_id_limit = max<size_t>(card_id_limit, stats[x].card_id + 1);
+      }
+    }
+    Ep3CardStats blank_stats{};
+    blank_stats.type = -1;
+    this->card_definitions.resize(card_id_limit, blank_stats);
+    auto& columns = this->card_stat_columns;
+    columns.type.resize(card_id_limit, -1);
+    columns.rarity.resize(card_id_limit, 0);
+    columns.self_cost.resize(card_id_limit, 0);
+    columns.ally_cost.resize(card_id_limit, 0);
+    columns.hp.resize(card_id_limit, 0);
+    columns.ap.resize(card_id_limit, 0);
+    columns.tp.resize(card_id_limit, 0);
+    columns.mv.resize(card_id_limit, 0);
+
     for (size_t x = 0; x < max_cards; x++) {
-      // The last card entry has the build date and some other metadata (and
-      // isn't a real card, obviously), so skip it. Seems like the card ID is
-      // always a large number that won't fit in a uint16_t, so we use that to
-      // determine if the entry is a real card or not.
-      if (stats[x].card_id & 0xFFFF0000) {
+      // A negative type marks the end of the card list; the columns use it to
+      // mean there is no card with that ID, so these entries are skipped
+      if ((stats[x].card_id & 0xFFFF0000) || (stats[x].type < 0)) {
         continue;
       }
-      shared_ptr<CardEntry> entry(new CardEntry({stats[x], {}}));
-      if (!this->card_definitions.emplace(entry->stats.card_id, entry).second) {
+      uint16_t card_id = stats[x].card_id;
+      if (columns.type[card_id] >= 0) {
         throw runtime_error(string_printf(
-            "duplicate card id: %08" PRIX32, entry->stats.card_id.load()));
+            "duplicate card id: %08" PRIX32, stats[x].card_id.load()));
       }
 
-      entry->stats.hp.decode_code();
-      entry->stats.ap.decode_code();
-      entry->stats.tp.decode_code();
-      entry->stats.mv.decode_code();
-      entry->stats.decode_range();
+      auto& card = this->card_definitions[card_id];
+      card = stats[x];
+      card.hp.decode_code();
+      card.ap.decode_code();
+      card.tp.decode_code();
+      card.mv.decode_code();
+      card.decode_range();
+      this->num_cards++;
+
+      columns.type[card_id] = card.type;
+      columns.rarity[card_id] = card.rarity;
+      columns.self_cost[card_id] = card.self_cost;
+      columns.ally_cost[card_id] = card.ally_cost;
+      columns.hp[card_id] = card.hp.stat;
+      columns.ap[card_id] = card.ap.stat;
+      columns.tp[card_id] = card.tp.stat;
+      columns.mv[card_id] = card.mv.stat;
 
       if (debug_enabled) {
-        string card_str = entry->stats.str();
+        string card_str = card.str();
         try {
           string tags_str = join(card_tags.at(stats[x].card_id), ", ");
           fprintf(stderr, "%s tags: [%s]\n", card_str.c_str(), tags_str.c_str());
@@ -768,7 +805,7 @@ Ep3DataIndex::Ep3DataIndex(const string& directory) {
       }
     }
 
-    log(INFO, "Indexed %zu Episode 3 card definitions", this->card_definitions.size());
+    log(INFO, "Indexed %zu Episode 3 card definitions", this->num_cards);
   } catch (const exception& e) {
     log(WARNING, "Failed to load Episode 3 card update: %s", e.what());
   }
@@ -797,6 +834,8 @@ Ep3DataIndex::Ep3DataIndex(const string& directory) {
           filename.c_str(), e.what());
     }
   }
+
+  this->compress_maps();
 }
 
 Ep3DataIndex::MapEntry::MapEntry(const Ep3Map& map) : map(map) { }
@@ -812,11 +851,22 @@ Ep3DataIndex::MapEntry::MapEntry(const string& compressed)
   this->map = *reinterpret_cast<const Ep3Map*>(decompressed.data());
 }
 
-string Ep3DataIndex::MapEntry::compressed() const {
+void Ep3DataIndex::MapEntry::generate_command_data() {
   if (this->compressed_data.empty()) {
     this->compressed_data = prs_compress(&this->map, sizeof(this->map));
   }
-  return this->compressed_data;
+
+  StringWriter w;
+  w.put_u32l(0x000000B6);
+  w.put_u32l((19 + this->compressed_data.size()) & 0xFFFFFFFC);
+  w.put_u32l(0x00000041);
+  w.put_u32l(this->map.map_number);
+  w.put_u32l(this->compressed_data.size());
+  w.write(this->compressed_data);
+  while (w.size() & 3) {
+    w.put_u8(0);
+  }
+  this->map_command_data = move(w.str());
 }
 
 const string& Ep3DataIndex::get_compressed_card_definitions() const {
@@ -826,67 +876,114 @@ const string& Ep3DataIndex::get_compressed_card_definitions() const {
   return this->compressed_card_definitions;
 }
 
-shared_ptr<const Ep3DataIndex::CardEntry> Ep3DataIndex::get_card_definition(
-    uint32_t id) const {
-  return this->card_definitions.at(id);
+void Ep3DataIndex::get_card_definitions(
+    const Ep3CardStats** out, const uint16_t* ids, size_t count) const {
+  for (size_t x = 0; x < count; x++) {
+    out[x] = this->get_card_definition(ids[x]);
+  }
 }
 
 const string& Ep3DataIndex::get_compressed_map_list() const {
-  if (this->compressed_map_list.empty()) {
-    // TODO: Write a version of prs_compress that takes iovecs (or something
-    // similar) so we can eliminate all this string copying here.
-    StringWriter entries_w;
-    StringWriter strings_w;
-
-    for (const auto& map_it : this->maps) {
-      Ep3MapList::Entry e;
-      const auto& map = map_it.second->map;
-      e.map_x = map.map_x;
-      e.map_y = map.map_y;
-      e.scene_data2 = map.scene_data2;
-      e.map_number = map.map_number.load();
-      e.width = map.width;
-      e.height = map.height;
-      e.map_tiles = map.map_tiles;
-      e.modification_tiles = map.modification_tiles;
-
-      e.name_offset = strings_w.size();
-      strings_w.write(map.name.data(), map.name.len());
-      strings_w.put_u8(0);
-      e.location_name_offset = strings_w.size();
-      strings_w.write(map.location_name.data(), map.location_name.len());
-      strings_w.put_u8(0);
-      e.quest_name_offset = strings_w.size();
-      strings_w.write(map.quest_name.data(), map.quest_name.len());
-      strings_w.put_u8(0);
-      e.description_offset = strings_w.size();
-      strings_w.write(map.description.data(), map.description.len());
-      strings_w.put_u8(0);
-
-      e.unknown_a2 = 0xFF000000;
-
-      entries_w.put(e);
+  return this->compressed_map_list;
+}
+
+string Ep3DataIndex::generate_map_list() const {
+  // The entries are written directly after the header; the strings are
+  // collected separately and appended after all the entries
+  Ep3MapList header;
+  header.num_maps = this->maps.size();
+  header.unknown_a1 = 0;
+  header.strings_offset = this->maps.size() * sizeof(Ep3MapList::Entry);
+  header.total_size = 0; // Filled in at the end
+  StringWriter w;
+  w.put(header);
+  StringWriter strings_w;
+
+  for (const auto& map_it : this->maps) {
+    Ep3MapList::Entry e;
+    const auto& map = map_it.second->map;
+    e.map_x = map.map_x;
+    e.map_y = map.map_y;
+    e.scene_data2 = map.scene_data2;
+    e.map_number = map.map_number.load();
+    e.width = map.width;
+    e.height = map.height;
+    e.map_tiles = map.map_tiles;
+    e.modification_tiles = map.modification_tiles;
+
+    e.name_offset = strings_w.size();
+    strings_w.write(map.name.data(), map.name.len());
+    strings_w.put_u8(0);
+    e.location_name_offset = strings_w.size();
+    strings_w.write(map.location_name.data(), map.location_name.len());
+    strings_w.put_u8(0);
+    e.quest_name_offset = strings_w.size();
+    strings_w.write(map.quest_name.data(), map.quest_name.len());
+    strings_w.put_u8(0);
+    e.description_offset = strings_w.size();
+    strings_w.write(map.description.data(), map.description.len());
+    strings_w.put_u8(0);
+
+    e.unknown_a2 = 0xFF000000;
+
+    w.put(e);
+  }
+  w.write(strings_w.str());
+
+  string ret = move(w.str());
+  reinterpret_cast<Ep3MapList*>(ret.data())->total_size = ret.size();
+  return ret;
+}
+
+void Ep3DataIndex::compress_maps() {
+  uint64_t start_time = now();
+  string map_list = this->generate_map_list();
+
+  // Job z compresses the z-th map; the last job compresses the map list
+  vector<MapEntry*> entries;
+  for (auto& it : this->maps) {
+    entries.emplace_back(it.second.get());
+  }
+  size_t num_jobs = entries.size() + 1;
+  atomic<size_t> next_job_index(0);
+  auto run_jobs = [&]() {
+    for (size_t z = next_job_index++; z < num_jobs; z = next_job_index++) {
+      if (z < entries.size()) {
+        entries[z]->generate_command_data();
+      } else {
+        StringWriter compressed_w;
+        compressed_w.put_u32b(map_list.size());
+        compressed_w.write(prs_compress(map_list));
+        this->compressed_map_list = move(compressed_w.str());
+      }
     }
+  };
+  size_t num_threads = min<size_t>(
+      max<size_t>(thread::hardware_concurrency(), 1), num_jobs);
+  vector<thread> threads;
+  for (size_t x = 1; x < num_threads; x++) {
+    threads.emplace_back(run_jobs);
+  }
+  run_jobs();
+  for (auto& t : threads) {
+    t.join();
+  }
 
-    Ep3MapList header;
-    header.num_maps = this->maps.size();
-    header.unknown_a1 = 0;
-    header.strings_offset = entries_w.size();
-    header.total_size = sizeof(Ep3MapList) + entries_w.size() + strings_w.size();
-
-    StringWriter w;
-    w.put(header);
-    w.write(entries_w.str());
-    w.write(strings_w.str());
-
-    StringWriter compressed_w;
-    compressed_w.put_u32b(w.str().size());
-    compressed_w.write(prs_compress(w.str()));
-    this->compressed_map_list = move(compressed_w.str());
-    log(INFO, "Generated Episode 3 compressed map list (%zu -> %zu bytes)",
-        w.size(), this->compressed_map_list.size());
+  StringWriter w;
+  w.put_u32l(0x000000B6);
+  w.put_u32l((this->compressed_map_list.size() + 0x14 + 3) & 0xFFFFFFFC);
+  w.put_u32l(0x00000040);
+  w.put_u32l(this->compressed_map_list.size());
+  w.write(this->compressed_map_list);
+  this->map_list_command_data = move(w.str());
+
+  size_t total_compressed_size = this->compressed_map_list.size();
+  for (const auto* entry : entries) {
+    total_compressed_size += entry->compressed_data.size();
   }
-  return this->compressed_map_list;
+  log(INFO, "Compressed %zu Episode 3 maps and map list (%zu -> %zu bytes) on %zu threads in %" PRIu64 "ms",
+      entries.size(), map_list.size() + entries.size() * sizeof(Ep3Map),
+      total_compressed_size, num_threads, (now() - start_time) / 1000);
 }
 
 shared_ptr<const Ep3DataIndex::MapEntry> Ep3DataIndex::get_map(uint32_t id) const {
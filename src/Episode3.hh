@@ -6,6 +6,7 @@
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 #include <phosg/Encoding.hh>
 
 #include "Text.hh"
@@ -314,9 +315,20 @@ class Ep3DataIndex {
 public:
   explicit Ep3DataIndex(const std::string& directory);
 
-  struct CardEntry {
-    Ep3CardStats stats;
-    std::vector<std::string> text;
+  // The stats that are used most often, decoded and stored in a separate array
+  // for each field. Each array is indexed by card ID and has card_id_limit()
+  // entries; for card IDs that don't exist, type is -1 and all other fields are
+  // zero. This layout makes it fast to scan the same field for many cards (for
+  // example, to check the costs or ranks of all cards in a deck).
+  struct CardStatColumns {
+    std::vector<int8_t> type; // Ep3CardStats::Type, or -1 if no card
+    std::vector<uint8_t> rarity; // Ep3CardStats::Rarity
+    std::vector<uint8_t> self_cost;
+    std::vector<uint8_t> ally_cost;
+    std::vector<int8_t> hp; // Decoded values (Ep3CardStats::Stat::stat)
+    std::vector<int8_t> ap;
+    std::vector<int8_t> tp;
+    std::vector<int8_t> mv;
   };
 
   class MapEntry {
@@ -326,26 +338,70 @@ public:
     MapEntry(const Ep3Map& map);
     MapEntry(const std::string& compressed_data);
 
-    std::string compressed() const;
+    inline const std::string& compressed() const {
+      return this->compressed_data;
+    }
+    // The body of the 6C command that sends this map to clients (subcommand
+    // B6 41), including the compressed map data
+    inline const std::string& command_data() const {
+      return this->map_command_data;
+    }
 
   private:
-    mutable std::string compressed_data;
+    friend class Ep3DataIndex;
+    std::string compressed_data;
+    std::string map_command_data;
+
+    // Compresses the map (if it wasn't loaded from a compressed file) and
+    // generates map_command_data. This is slow, so it's only done when the
+    // index is created.
+    void generate_command_data();
   };
 
   const std::string& get_compressed_card_definitions() const;
-  std::shared_ptr<const CardEntry> get_card_definition(uint32_t id) const;
+  // Returns nullptr if there is no card with the given ID. The stat codes and
+  // range in the returned definition have already been decoded.
+  inline const Ep3CardStats* get_card_definition(uint32_t id) const {
+    return ((id < this->card_definitions.size()) &&
+            (this->card_stat_columns.type[id] >= 0))
+        ? &this->card_definitions[id] : nullptr;
+  }
+  // Looks up count card IDs at once, writing nullptr for IDs that don't exist
+  void get_card_definitions(const Ep3CardStats** out, const uint16_t* ids,
+      size_t count) const;
+  // One more than the largest valid card ID
+  inline size_t card_id_limit() const {
+    return this->card_definitions.size();
+  }
+  inline size_t num_card_definitions() const {
+    return this->num_cards;
+  }
+  inline const CardStatColumns& get_card_stat_columns() const {
+    return this->card_stat_columns;
+  }
 
   const std::string& get_compressed_map_list() const;
+  // The body of the 6C command that sends the map list to clients (subcommand
+  // B6 40), including the compressed map list
+  inline const std::string& get_map_list_command_data() const {
+    return this->map_list_command_data;
+  }
   std::shared_ptr<const MapEntry> get_map(uint32_t id) const;
 
 private:
   std::string compressed_card_definitions;
-  std::unordered_map<uint32_t, std::shared_ptr<CardEntry>> card_definitions;
-
-  // The compressed map list is generated on demand from the maps map below.
-  // It's marked mutable because the logical consistency of the Ep3DataIndex
-  // object is not violated from the caller's perspective even if we don't
-  // generate the compressed map list at load time.
-  mutable std::string compressed_map_list;
+  // Indexed by card ID; entries for card IDs that don't exist are blank
+  std::vector<Ep3CardStats> card_definitions;
+  CardStatColumns card_stat_columns;
+  size_t num_cards;
+
+  // All maps and the map list are compressed when the index is created (in
+  // parallel, since there are many maps and compression is slow), so sending
+  // them to clients never has to wait for compression.
+  std::string compressed_map_list;
+  std::string map_list_command_data;
   std::map<uint32_t, std::shared_ptr<MapEntry>> maps;
+
+  std::string generate_map_list() const;
+  void compress_maps();
 };
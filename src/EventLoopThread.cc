@@ -0,0 +1,197 @@
+#include "EventLoopThread.hh"
+
+#include <future>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+using namespace std;
+
+
+
+EventLoopLagMonitor::EventLoopLagMonitor(
+    shared_ptr<struct event_base> base,
+    const string& name,
+    uint64_t interval_usecs)
+  : base(base),
+    name(name),
+    interval_usecs(interval_usecs),
+    next_expected_time(now() + interval_usecs),
+    timer_event(evtimer_new(this->base.get(),
+        &EventLoopLagMonitor::dispatch_on_timer, this), event_free),
+    sample_count(0),
+    last_lag_usecs(0),
+    max_lag_usecs(0),
+    total_lag_usecs(0) {
+  for (size_t x = 0; x < NUM_HISTOGRAM_BUCKETS; x++) {
+    this->histogram[x] = 0;
+  }
+  struct timeval tv = usecs_to_timeval(this->interval_usecs);
+  evtimer_add(this->timer_event.get(), &tv);
+}
+
+EventLoopLagMonitor::Stats EventLoopLagMonitor::get_stats(bool reset_max) {
+  Stats ret;
+  ret.sample_count = this->sample_count;
+  ret.last_lag_usecs = this->last_lag_usecs;
+  ret.max_lag_usecs = reset_max ? this->max_lag_usecs.exchange(0) : this->max_lag_usecs.load();
+  ret.total_lag_usecs = this->total_lag_usecs;
+
+  uint64_t histogram[NUM_HISTOGRAM_BUCKETS];
+  uint64_t histogram_count = 0;
+  for (size_t x = 0; x < NUM_HISTOGRAM_BUCKETS; x++) {
+    histogram[x] = reset_max ? this->histogram[x].exchange(0) : this->histogram[x].load();
+    histogram_count += histogram[x];
+  }
+  ret.p50_lag_usecs = this->percentile_from_histogram(histogram, histogram_count, 0.5);
+  ret.p99_lag_usecs = this->percentile_from_histogram(histogram, histogram_count, 0.99);
+  return ret;
+}
+
+uint64_t EventLoopLagMonitor::percentile_from_histogram(
+    const uint64_t* histogram, uint64_t count, double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t threshold = static_cast<uint64_t>(count * percentile);
+  uint64_t seen = 0;
+  for (size_t x = 0; x < NUM_HISTOGRAM_BUCKETS; x++) {
+    seen += histogram[x];
+    if (seen > threshold) {
+      return (1ULL << x);
+    }
+  }
+  return (1ULL << (NUM_HISTOGRAM_BUCKETS - 1));
+}
+
+void EventLoopLagMonitor::dispatch_on_timer(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<EventLoopLagMonitor*>(ctx)->on_timer();
+}
+
+void EventLoopLagMonitor::on_timer() {
+  uint64_t t = now();
+  uint64_t lag = (t > this->next_expected_time) ? (t - this->next_expected_time) : 0;
+
+  this->last_lag_usecs = lag;
+  this->total_lag_usecs += lag;
+  this->sample_count++;
+  size_t bucket = 0;
+  while ((bucket < NUM_HISTOGRAM_BUCKETS - 1) && (lag >= (1ULL << bucket))) {
+    bucket++;
+  }
+  this->histogram[bucket]++;
+  // Only this thread raises the max, but the shell may reset it concurrently
+  uint64_t prev_max = this->max_lag_usecs;
+  while ((lag > prev_max) && !this->max_lag_usecs.compare_exchange_weak(prev_max, lag)) { }
+
+  // The next interval is measured from now, so a single long stall is counted
+  // once instead of also delaying every later sample
+  this->next_expected_time = t + this->interval_usecs;
+  struct timeval tv = usecs_to_timeval(this->interval_usecs);
+  evtimer_add(this->timer_event.get(), &tv);
+}
+
+
+
+EventLoopThread::EventLoopThread(const string& name)
+  : name(name),
+    base(event_base_new(), event_base_free),
+    lag_monitor(new EventLoopLagMonitor(this->base, name)),
+    stopped(false),
+    posted_functions_event(event_new(this->base.get(), -1, 0,
+        &EventLoopThread::dispatch_run_posted_functions, this), event_free) { }
+
+EventLoopThread::~EventLoopThread() {
+  if (this->t.joinable()) {
+    // This requires libevent's thread support (evthread_use_pthreads), which
+    // main() enables before creating any event bases
+    event_base_loopbreak(this->base.get());
+    this->t.join();
+  }
+}
+
+void EventLoopThread::start() {
+  if (this->t.joinable()) {
+    throw logic_error("event loop thread is already running");
+  }
+  this->t = thread(&EventLoopThread::thread_fn, this);
+}
+
+void EventLoopThread::post(function<void()>&& fn) {
+  {
+    lock_guard<mutex> g(this->posted_functions_lock);
+    if (this->stopped) {
+      return;
+    }
+    this->posted_functions.emplace_back(move(fn));
+  }
+  // The event is never added, so this only schedules the callback once per
+  // loop iteration no matter how many functions are posted before it runs
+  event_active(this->posted_functions_event.get(), 0, 0);
+}
+
+void EventLoopThread::call(const function<void()>& fn) {
+  if (!this->t.joinable() || (this_thread::get_id() == this->t.get_id())) {
+    fn();
+    return;
+  }
+
+  // The promise is owned by the posted function, so if the function is
+  // discarded without running (because the thread stopped), the future
+  // reports a broken promise instead of blocking forever
+  auto p = make_shared<promise<void>>();
+  auto f = p->get_future();
+  this->post([p = move(p), &fn]() {
+    try {
+      fn();
+      p->set_value();
+    } catch (...) {
+      p->set_exception(current_exception());
+    }
+  });
+  try {
+    f.get();
+  } catch (const future_error& e) {
+    if (e.code() != future_errc::broken_promise) {
+      throw;
+    }
+    throw runtime_error(string_printf(
+        "event loop thread %s stopped before the call could run",
+        this->name.c_str()));
+  }
+}
+
+void EventLoopThread::dispatch_run_posted_functions(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<EventLoopThread*>(ctx)->run_posted_functions();
+}
+
+void EventLoopThread::run_posted_functions() {
+  vector<function<void()>> fns;
+  {
+    lock_guard<mutex> g(this->posted_functions_lock);
+    fns.swap(this->posted_functions);
+  }
+  for (const auto& fn : fns) {
+    try {
+      fn();
+    } catch (const exception& e) {
+      log(ERROR, "[EventLoopThread:%s] Posted function failed: %s",
+          this->name.c_str(), e.what());
+    }
+  }
+}
+
+void EventLoopThread::thread_fn() {
+  log(INFO, "[EventLoopThread:%s] Running", this->name.c_str());
+  event_base_loop(this->base.get(), EVLOOP_NO_EXIT_ON_EMPTY);
+
+  // Discard any functions that didn't run. This is done outside the lock,
+  // since destroying them may fail a call() that is waiting on them.
+  vector<function<void()>> fns;
+  {
+    lock_guard<mutex> g(this->posted_functions_lock);
+    this->stopped = true;
+    fns.swap(this->posted_functions);
+  }
+  fns.clear();
+  log(INFO, "[EventLoopThread:%s] Stopped", this->name.c_str());
+}
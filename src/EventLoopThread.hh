@@ -0,0 +1,131 @@
+#pragma once
+
+#include <event2/event.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Measures how late an event loop is in running its callbacks. A timer is
+// scheduled every interval_usecs; the lag is the difference between when it
+// was supposed to fire and when it actually fired, which is approximately how
+// long the loop was blocked by other callbacks. Samples are also counted in a
+// histogram with power-of-two buckets, from which percentiles are estimated
+// (each estimate is the upper bound of the bucket it falls in). The counters
+// are atomic so they can be read from any thread (e.g. the shell), but the
+// monitor itself must be created and destroyed on the thread that runs its
+// event loop, or before that loop starts running.
+class EventLoopLagMonitor {
+public:
+  struct Stats {
+    uint64_t sample_count;
+    uint64_t last_lag_usecs;
+    uint64_t max_lag_usecs;
+    uint64_t total_lag_usecs;
+    // Estimated from the histogram of samples since the last reset
+    uint64_t p50_lag_usecs;
+    uint64_t p99_lag_usecs;
+  };
+
+  EventLoopLagMonitor(
+      std::shared_ptr<struct event_base> base,
+      const std::string& name,
+      uint64_t interval_usecs = 100000);
+  EventLoopLagMonitor(const EventLoopLagMonitor&) = delete;
+  EventLoopLagMonitor(EventLoopLagMonitor&&) = delete;
+  EventLoopLagMonitor& operator=(const EventLoopLagMonitor&) = delete;
+  EventLoopLagMonitor& operator=(EventLoopLagMonitor&&) = delete;
+  ~EventLoopLagMonitor() = default;
+
+  inline const std::string& get_name() const {
+    return this->name;
+  }
+
+  // If reset_max is true, the maximum lag and the histogram are reset after
+  // they're read, so the next call reports the maximum and percentiles since
+  // this call
+  Stats get_stats(bool reset_max = false);
+
+private:
+  std::shared_ptr<struct event_base> base;
+  std::string name;
+  uint64_t interval_usecs;
+  uint64_t next_expected_time;
+  std::unique_ptr<struct event, void(*)(struct event*)> timer_event;
+
+  std::atomic<uint64_t> sample_count;
+  std::atomic<uint64_t> last_lag_usecs;
+  std::atomic<uint64_t> max_lag_usecs;
+  std::atomic<uint64_t> total_lag_usecs;
+  // Bucket x counts samples with lag < 2^x usecs (and >= 2^(x-1) usecs, except
+  // for bucket 0); the last bucket also counts all longer samples
+  static constexpr size_t NUM_HISTOGRAM_BUCKETS = 32;
+  std::atomic<uint64_t> histogram[NUM_HISTOGRAM_BUCKETS];
+
+  uint64_t percentile_from_histogram(
+      const uint64_t* histogram, uint64_t count, double percentile) const;
+
+  static void dispatch_on_timer(evutil_socket_t fd, short events, void* ctx);
+  void on_timer();
+};
+
+
+
+// Runs an event loop on a separate thread. Events can be added to this->base
+// before start() is called; after that, they should only be added or removed
+// from callbacks running on the thread itself (post() and call() can be used
+// to get there from other threads). The destructor stops the loop and joins
+// the thread, so any objects whose events are on this->base must be destroyed
+// after the EventLoopThread is. Functions that were posted but haven't run yet
+// when the thread is stopped are discarded, as are functions posted after it
+// has stopped.
+class EventLoopThread {
+public:
+  explicit EventLoopThread(const std::string& name);
+  EventLoopThread(const EventLoopThread&) = delete;
+  EventLoopThread(EventLoopThread&&) = delete;
+  EventLoopThread& operator=(const EventLoopThread&) = delete;
+  EventLoopThread& operator=(EventLoopThread&&) = delete;
+  ~EventLoopThread();
+
+  void start();
+
+  // Runs fn on the thread at some later time. This may be called from any
+  // thread, including the event loop thread itself.
+  void post(std::function<void()>&& fn);
+  // Runs fn on the thread and waits for it to return. If fn throws, the
+  // exception is rethrown in the calling thread. If this is called from the
+  // event loop thread, or if the thread hasn't been started yet, fn is called
+  // immediately instead. If the thread stops before fn runs, throws
+  // runtime_error instead of waiting forever.
+  void call(const std::function<void()>& fn);
+
+  inline std::shared_ptr<struct event_base> get_base() const {
+    return this->base;
+  }
+  inline std::shared_ptr<EventLoopLagMonitor> get_lag_monitor() const {
+    return this->lag_monitor;
+  }
+
+private:
+  std::string name;
+  std::shared_ptr<struct event_base> base;
+  std::shared_ptr<EventLoopLagMonitor> lag_monitor;
+  std::thread t;
+
+  std::mutex posted_functions_lock;
+  std::vector<std::function<void()>> posted_functions;
+  bool stopped; // Protected by posted_functions_lock
+  std::unique_ptr<struct event, void(*)(struct event*)> posted_functions_event;
+
+  void thread_fn();
+  static void dispatch_run_posted_functions(evutil_socket_t fd, short events, void* ctx);
+  void run_posted_functions();
+};
@@ -0,0 +1,137 @@
+#include "FloorItems.hh"
+
+#include <stdexcept>
+
+using namespace std;
+
+
+
+FloorItemSet::FloorItemSet()
+  : slots(16, Slot{EMPTY_SLOT, 0}), hash_shift(28), num_items(0) { }
+
+size_t FloorItemSet::find_slot(uint32_t item_id) const {
+  size_t mask = this->slots.size() - 1;
+  size_t index = this->home_slot(item_id);
+  while ((this->slots[index].item_id != EMPTY_SLOT) &&
+         (this->slots[index].item_id != item_id)) {
+    index = (index + 1) & mask;
+  }
+  return index;
+}
+
+void FloorItemSet::erase_slot(size_t slot_index) {
+  // Move later entries in the same probe sequence back, so lookups never stop
+  // early at the newly-empty slot
+  size_t mask = this->slots.size() - 1;
+  size_t hole = slot_index;
+  for (size_t index = (hole + 1) & mask;
+       this->slots[index].item_id != EMPTY_SLOT;
+       index = (index + 1) & mask) {
+    size_t home = this->home_slot(this->slots[index].item_id);
+    // The entry can fill the hole only if its home slot is not cyclically
+    // within (hole, index]
+    bool home_after_hole = (hole <= index)
+        ? ((home > hole) && (home <= index))
+        : ((home > hole) || (home <= index));
+    if (!home_after_hole) {
+      this->slots[hole] = this->slots[index];
+      hole = index;
+    }
+  }
+  this->slots[hole].item_id = EMPTY_SLOT;
+}
+
+void FloorItemSet::grow_slots() {
+  vector<Slot> old_slots(this->slots.size() * 2, Slot{EMPTY_SLOT, 0});
+  old_slots.swap(this->slots);
+  this->hash_shift--;
+  for (const auto& slot : old_slots) {
+    if (slot.item_id != EMPTY_SLOT) {
+      this->slots[this->find_slot(slot.item_id)] = slot;
+    }
+  }
+}
+
+
+
+void FloorItemSet::add(
+    const PlayerInventoryItem& item, uint8_t area, float x, float z) {
+  uint32_t item_id = item.data.id;
+  if (item_id == EMPTY_SLOT) {
+    throw invalid_argument("invalid item ID");
+  }
+
+  size_t slot_index = this->find_slot(item_id);
+  if (this->slots[slot_index].item_id == item_id) {
+    this->remove(item_id);
+    slot_index = this->find_slot(item_id);
+  }
+  // Keep the table at most half full
+  if ((this->num_items + 1) * 2 > this->slots.size()) {
+    this->grow_slots();
+    slot_index = this->find_slot(item_id);
+  }
+
+  if (this->area_items.size() <= area) {
+    this->area_items.resize(area + 1);
+  }
+  auto& items = this->area_items[area];
+  if (items.size() >= 0x01000000) {
+    throw runtime_error("too many items in area");
+  }
+  this->slots[slot_index].item_id = item_id;
+  this->slots[slot_index].location = (area << 24) | items.size();
+  auto& fi = items.emplace_back();
+  fi.inv_item = item;
+  fi.x = x;
+  fi.z = z;
+  fi.area = area;
+  this->num_items++;
+}
+
+PlayerInventoryItem FloorItemSet::remove(uint32_t item_id) {
+  size_t slot_index = this->find_slot(item_id);
+  if (this->slots[slot_index].item_id != item_id) {
+    throw out_of_range("item not present");
+  }
+  uint32_t location = this->slots[slot_index].location;
+  this->erase_slot(slot_index);
+  this->num_items--;
+
+  // Move the last item in the area into the removed item's place
+  auto& items = this->area_items[location >> 24];
+  size_t index = location & 0x00FFFFFF;
+  PlayerInventoryItem ret = move(items[index].inv_item);
+  if (index != items.size() - 1) {
+    items[index] = move(items.back());
+    this->slots[this->find_slot(items[index].inv_item.data.id)].location = location;
+  }
+  items.pop_back();
+  return ret;
+}
+
+const FloorItem* FloorItemSet::find(uint32_t item_id) const {
+  const auto& slot = this->slots[this->find_slot(item_id)];
+  if (slot.item_id != item_id) {
+    return nullptr;
+  }
+  return &this->area_items[slot.location >> 24][slot.location & 0x00FFFFFF];
+}
+
+const FloorItem* FloorItemSet::find_nearest(uint8_t area, float x, float z) const {
+  if (area >= this->area_items.size()) {
+    return nullptr;
+  }
+  const FloorItem* ret = nullptr;
+  float min_dist2 = 0.0f;
+  for (const auto& fi : this->area_items[area]) {
+    float dx = fi.x - x;
+    float dz = fi.z - z;
+    float dist2 = (dx * dx) + (dz * dz);
+    if (!ret || (dist2 < min_dist2)) {
+      ret = &fi;
+      min_dist2 = dist2;
+    }
+  }
+  return ret;
+}
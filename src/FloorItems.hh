@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "Player.hh"
+
+
+
+struct FloorItem {
+  PlayerInventoryItem inv_item;
+  float x;
+  float z;
+  uint8_t area;
+};
+
+// The items on the floor in a game. Items are stored in one contiguous array
+// per area, so finding items near a player only looks at items in the
+// player's area. Items are found by ID with an open-addressed hash table that
+// maps each ID to its area and position within that area's array, so adding,
+// finding, and removing items are all constant-time, and no memory is
+// allocated per item (the arrays and the table only grow when they're full).
+class FloorItemSet {
+public:
+  FloorItemSet();
+  FloorItemSet(const FloorItemSet&) = delete;
+  FloorItemSet(FloorItemSet&&) = delete;
+  FloorItemSet& operator=(const FloorItemSet&) = delete;
+  FloorItemSet& operator=(FloorItemSet&&) = delete;
+  ~FloorItemSet() = default;
+
+  // If an item with the same ID is already on the floor, it's replaced
+  void add(const PlayerInventoryItem& item, uint8_t area, float x, float z);
+  // Throws out_of_range if the item isn't on the floor
+  PlayerInventoryItem remove(uint32_t item_id);
+
+  // These return nullptr if there is no matching item
+  const FloorItem* find(uint32_t item_id) const;
+  const FloorItem* find_nearest(uint8_t area, float x, float z) const;
+
+  inline size_t size() const {
+    return this->num_items;
+  }
+
+private:
+  static constexpr uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+  // location is (area << 24) | index within area_items[area]
+  struct Slot {
+    uint32_t item_id;
+    uint32_t location;
+  };
+
+  std::vector<std::vector<FloorItem>> area_items;
+  std::vector<Slot> slots; // Size is always a power of 2
+  uint8_t hash_shift;
+  size_t num_items;
+
+  inline size_t home_slot(uint32_t item_id) const {
+    return static_cast<uint32_t>(item_id * 0x9E3779B1) >> this->hash_shift;
+  }
+  // Returns the slot containing item_id, or the empty slot where it would go
+  size_t find_slot(uint32_t item_id) const;
+  void erase_slot(size_t slot_index);
+  void grow_slots();
+};
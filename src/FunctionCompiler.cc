@@ -2,15 +2,22 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include <atomic>
 #include <stdexcept>
+#include <thread>
 #include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
 
 #ifdef HAVE_RESOURCE_FILE
 #include <resource_file/Emulators/PPC32Emulator.hh>
 #endif
 
 #include "CommandFormats.hh"
+#include "Compression.hh"
 
 using namespace std;
 
@@ -26,52 +33,121 @@ bool function_compiler_available() {
 
 
 
-string CompiledFunctionCode::generate_client_command(
-      const unordered_map<string, uint32_t>& label_writes,
-      const string& suffix) const {
+void CompiledFunctionCode::prepare_command_footer() {
   S_ExecuteCode_Footer_GC_B2 footer;
+  footer.relocations_offset = 0; // Written in generate_client_command
   footer.num_relocations = this->relocation_deltas.size();
   footer.unused1.clear();
   footer.entrypoint_addr_offset = this->entrypoint_offset_offset;
   footer.unused2.clear();
 
   StringWriter w;
-  if (!label_writes.empty()) {
-    string modified_code = this->code;
-    for (const auto& it : label_writes) {
-      size_t offset = this->label_offsets.at(it.first);
-      if (offset > modified_code.size() - 4) {
-        throw runtime_error("label out of range");
-      }
-      *reinterpret_cast<be_uint32_t*>(modified_code.data() + offset) = it.second;
-    }
-    w.write(modified_code);
-  } else {
-    w.write(this->code);
-  }
-  w.write(suffix);
-  while (w.size() & 3) {
-    w.put_u8(0);
-  }
-
-  footer.relocations_offset = w.size();
   for (uint16_t delta : this->relocation_deltas) {
     w.put_u16b(delta);
   }
   if (this->relocation_deltas.size() & 1) {
     w.put_u16(0);
   }
-
   w.put(footer);
-  return move(w.str());
+  this->command_footer = move(w.str());
+}
+
+vector<uint32_t> CompiledFunctionCode::label_write_offsets(
+    const vector<string>& labels) const {
+  vector<uint32_t> ret;
+  for (const auto& label : labels) {
+    size_t offset = this->label_offsets.at(label);
+    if ((this->code.size() < 4) || (offset > this->code.size() - 4)) {
+      throw runtime_error("label out of range");
+    }
+    ret.emplace_back(offset);
+  }
+  return ret;
+}
+
+// The relocation table must be 4-byte aligned, so the suffix is padded
+static inline size_t relocations_offset_for_suffix_size(
+    size_t code_size, size_t suffix_size) {
+  return (code_size + suffix_size + 3) & (~3);
+}
+
+size_t CompiledFunctionCode::client_command_size(size_t suffix_size) const {
+  return relocations_offset_for_suffix_size(this->code.size(), suffix_size) +
+      this->command_footer.size();
+}
+
+void CompiledFunctionCode::generate_client_command(
+    void* dest,
+    const uint32_t* label_offsets,
+    const uint32_t* values,
+    size_t num_label_writes,
+    const void* suffix,
+    size_t suffix_size) const {
+  uint8_t* dest_bytes = reinterpret_cast<uint8_t*>(dest);
+  memcpy(dest_bytes, this->code.data(), this->code.size());
+  for (size_t x = 0; x < num_label_writes; x++) {
+    *reinterpret_cast<be_uint32_t*>(dest_bytes + label_offsets[x]) = values[x];
+  }
+
+  memcpy(dest_bytes + this->code.size(), suffix, suffix_size);
+  size_t suffix_end_offset = this->code.size() + suffix_size;
+  size_t relocations_offset = relocations_offset_for_suffix_size(
+      this->code.size(), suffix_size);
+  memset(dest_bytes + suffix_end_offset, 0, relocations_offset - suffix_end_offset);
+
+  memcpy(dest_bytes + relocations_offset, this->command_footer.data(),
+      this->command_footer.size());
+  auto* footer = reinterpret_cast<S_ExecuteCode_Footer_GC_B2*>(
+      dest_bytes + relocations_offset + this->command_footer.size() -
+      sizeof(S_ExecuteCode_Footer_GC_B2));
+  footer->relocations_offset = relocations_offset;
+}
+
+string CompiledFunctionCode::generate_client_command(
+      const unordered_map<string, uint32_t>& label_writes,
+      const string& suffix) const {
+  vector<string> labels;
+  vector<uint32_t> values;
+  for (const auto& it : label_writes) {
+    labels.emplace_back(it.first);
+    values.emplace_back(it.second);
+  }
+  auto offsets = this->label_write_offsets(labels);
+
+  string ret(this->client_command_size(suffix.size()), '\0');
+  this->generate_client_command(ret.data(), offsets.data(), values.data(),
+      offsets.size(), suffix.data(), suffix.size());
+  return ret;
+}
+
+// Returns the file that an include refers to, or an empty string if there is
+// no such file
+static string filename_for_include(const string& directory, const string& name) {
+  string filename = directory + "/" + name + ".inc.s";
+  if (isfile(filename)) {
+    return filename;
+  }
+  filename = directory + "/" + name + ".inc.bin";
+  if (isfile(filename)) {
+    return filename;
+  }
+  return "";
+}
+
+// The hash covers the include's filename too, so a function is recompiled if
+// an include changes from a .inc.bin file to a .inc.s file or vice versa
+static uint64_t hash_include(const string& filename, const string& contents) {
+  return fnv1a64(contents, fnv1a64(filename));
 }
 
 shared_ptr<CompiledFunctionCode> compile_function_code(
-    const string& directory, const string& name, const string& text) {
+    const string& directory, const string& name, const string& text,
+    map<string, uint64_t>* include_hashes) {
 #ifndef HAVE_RESOURCE_FILE
   (void)directory;
   (void)name;
   (void)text;
+  (void)include_hashes;
   throw runtime_error("PowerPC assembler is not available");
 
 #else
@@ -81,15 +157,18 @@ shared_ptr<CompiledFunctionCode> compile_function_code(
       throw runtime_error("mutual recursion between includes");
     }
 
-    string filename = directory + "/" + name + ".inc.s";
-    if (isfile(filename)) {
-      return PPC32Emulator::assemble(load_file(filename), get_include).code;
+    string filename = filename_for_include(directory, name);
+    if (filename.empty()) {
+      throw runtime_error("data not found for include " + name);
+    }
+    string contents = load_file(filename);
+    if (include_hashes) {
+      include_hashes->emplace(name, hash_include(filename, contents));
     }
-    filename = directory + "/" + name + ".inc.bin";
-    if (isfile(filename)) {
-      return load_file(filename);
+    if (ends_with(filename, ".inc.s")) {
+      return PPC32Emulator::assemble(contents, get_include).code;
     }
-    throw runtime_error("data not found for include " + name);
+    return contents;
   };
 
   shared_ptr<CompiledFunctionCode> ret(new CompiledFunctionCode());
@@ -124,6 +203,7 @@ shared_ptr<CompiledFunctionCode> compile_function_code(
     ret->relocation_deltas.emplace_back(delta);
     prev_index = it;
   }
+  ret->prepare_command_footer();
 
   return ret;
 #endif
@@ -131,24 +211,221 @@ shared_ptr<CompiledFunctionCode> compile_function_code(
 
 
 
-FunctionCodeIndex::FunctionCodeIndex(const string& directory) {
+// Cache files contain the following, in little-endian byte order:
+//   u64 FUNCTION_CACHE_SIGNATURE
+//   u64 hash of the function's source
+//   u32 number of includes, followed by (for each include):
+//     u16 name size, name, u64 hash (from hash_include)
+//   u32 code size, code
+//   u32 number of relocation deltas, followed by u16 for each delta
+//   u32 number of labels, followed by (for each label):
+//     u16 name size, name, u32 offset
+//   u32 entrypoint_offset_offset
+//   u32 index
+// The signature should be changed if this format changes, or if the assembler
+// changes in a way that would produce different code.
+static const uint64_t FUNCTION_CACHE_SIGNATURE = 0x6E73667063616368; // "nsfpcach"
+
+struct FunctionCacheEntry {
+  uint64_t source_hash;
+  map<string, uint64_t> include_hashes;
+  shared_ptr<CompiledFunctionCode> code;
+};
+
+static string serialize_function_cache_entry(const FunctionCacheEntry& entry) {
+  StringWriter w;
+  w.put_u64l(FUNCTION_CACHE_SIGNATURE);
+  w.put_u64l(entry.source_hash);
+  w.put_u32l(entry.include_hashes.size());
+  for (const auto& it : entry.include_hashes) {
+    w.put_u16l(it.first.size());
+    w.write(it.first);
+    w.put_u64l(it.second);
+  }
+  w.put_u32l(entry.code->code.size());
+  w.write(entry.code->code);
+  w.put_u32l(entry.code->relocation_deltas.size());
+  for (uint16_t delta : entry.code->relocation_deltas) {
+    w.put_u16l(delta);
+  }
+  w.put_u32l(entry.code->label_offsets.size());
+  for (const auto& it : entry.code->label_offsets) {
+    w.put_u16l(it.first.size());
+    w.write(it.first);
+    w.put_u32l(it.second);
+  }
+  w.put_u32l(entry.code->entrypoint_offset_offset);
+  w.put_u32l(entry.code->index);
+  return move(w.str());
+}
+
+static FunctionCacheEntry parse_function_cache_entry(
+    const string& name, const string& data) {
+  StringReader r(data);
+  if (r.get_u64l() != FUNCTION_CACHE_SIGNATURE) {
+    throw runtime_error("incorrect cache file signature");
+  }
+
+  FunctionCacheEntry entry;
+  entry.source_hash = r.get_u64l();
+  uint32_t num_includes = r.get_u32l();
+  for (size_t x = 0; x < num_includes; x++) {
+    string include_name = r.readx(r.get_u16l());
+    entry.include_hashes.emplace(move(include_name), r.get_u64l());
+  }
+
+  entry.code.reset(new CompiledFunctionCode());
+  entry.code->name = name;
+  entry.code->code = r.readx(r.get_u32l());
+  uint32_t num_relocations = r.get_u32l();
+  for (size_t x = 0; x < num_relocations; x++) {
+    entry.code->relocation_deltas.emplace_back(r.get_u16l());
+  }
+  uint32_t num_labels = r.get_u32l();
+  for (size_t x = 0; x < num_labels; x++) {
+    string label = r.readx(r.get_u16l());
+    entry.code->label_offsets.emplace(move(label), r.get_u32l());
+  }
+  entry.code->entrypoint_offset_offset = r.get_u32l();
+  entry.code->index = r.get_u32l();
+  entry.code->menu_item_id = 0;
+  entry.code->prepare_command_footer();
+  return entry;
+}
+
+static bool function_cache_entry_is_current(const FunctionCacheEntry& entry,
+    const string& directory, uint64_t source_hash) {
+  if (entry.source_hash != source_hash) {
+    return false;
+  }
+  for (const auto& it : entry.include_hashes) {
+    string filename = filename_for_include(directory, it.first);
+    if (filename.empty() ||
+        (hash_include(filename, load_file(filename)) != it.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+FunctionCodeIndex::FunctionCodeIndex(
+    const string& directory, const string& cache_directory) {
   if (!function_compiler_available()) {
     log(INFO, "Function compiler is not available");
     return;
   }
 
-  uint32_t next_menu_item_id = 0;
+  struct SourceFile {
+    string filename;
+    string name;
+    bool is_patch;
+    string text;
+    uint64_t source_hash;
+    bool from_cache;
+    shared_ptr<CompiledFunctionCode> code;
+    map<string, uint64_t> include_hashes;
+    string error;
+  };
+
+  vector<SourceFile> files;
   for (const auto& filename : list_directory(directory)) {
     if (!ends_with(filename, ".s") || ends_with(filename, ".inc.s")) {
       continue;
     }
-    bool is_patch = ends_with(filename, ".patch.s");
-    string name = filename.substr(0, filename.size() - (is_patch ? 8 : 2));
+    auto& file = files.emplace_back();
+    file.filename = filename;
+    file.is_patch = ends_with(filename, ".patch.s");
+    file.from_cache = false;
+    file.name = filename.substr(0, filename.size() - (file.is_patch ? 8 : 2));
+    try {
+      file.text = load_file(directory + "/" + filename);
+    } catch (const exception& e) {
+      file.error = e.what();
+      continue;
+    }
+    file.source_hash = fnv1a64(file.text);
+
+    if (!cache_directory.empty()) {
+      string cache_filename = cache_directory + "/" + file.name + ".bin";
+      try {
+        if (isfile(cache_filename)) {
+          auto entry = parse_function_cache_entry(
+              file.name, load_file(cache_filename));
+          if (function_cache_entry_is_current(entry, directory, file.source_hash)) {
+            file.code = move(entry.code);
+            file.from_cache = true;
+          }
+        }
+      } catch (const exception& e) {
+        log(WARNING, "Cannot use cached function %s: %s", file.name.c_str(), e.what());
+      }
+    }
+  }
 
+  // Compile everything that wasn't in the cache, using multiple threads
+  vector<SourceFile*> files_to_compile;
+  for (auto& file : files) {
+    if (!file.code && file.error.empty()) {
+      files_to_compile.emplace_back(&file);
+    }
+  }
+  if (!files_to_compile.empty()) {
+    uint64_t start_time = now();
+    atomic<size_t> next_file_index(0);
+    auto compile_files = [&]() {
+      for (size_t z = next_file_index++; z < files_to_compile.size(); z = next_file_index++) {
+        auto& file = *files_to_compile[z];
+        try {
+          file.code = compile_function_code(
+              directory, file.name, file.text, &file.include_hashes);
+        } catch (const exception& e) {
+          file.error = e.what();
+        }
+      }
+    };
+    size_t num_threads = min<size_t>(
+        max<size_t>(thread::hardware_concurrency(), 1), files_to_compile.size());
+    vector<thread> threads;
+    for (size_t x = 1; x < num_threads; x++) {
+      threads.emplace_back(compile_files);
+    }
+    compile_files();
+    for (auto& t : threads) {
+      t.join();
+    }
+    log(INFO, "Compiled %zu functions on %zu threads in %" PRIu64 "ms",
+        files_to_compile.size(), num_threads, (now() - start_time) / 1000);
+
+    if (!cache_directory.empty()) {
+      if (!isdir(cache_directory) && (mkdir(cache_directory.c_str(), 0755) != 0)) {
+        log(WARNING, "Cannot create function cache directory %s", cache_directory.c_str());
+      } else {
+        for (const auto* file : files_to_compile) {
+          if (!file->code) {
+            continue;
+          }
+          try {
+            save_file(cache_directory + "/" + file->name + ".bin",
+                serialize_function_cache_entry(
+                    {file->source_hash, file->include_hashes, file->code}));
+          } catch (const exception& e) {
+            log(WARNING, "Cannot save compiled function %s: %s",
+                file->name.c_str(), e.what());
+          }
+        }
+      }
+    }
+  }
+
+  uint32_t next_menu_item_id = 0;
+  for (auto& file : files) {
+    const string& name = file.name;
+    bool is_patch = file.is_patch;
     try {
-      string path = directory + "/" + filename;
-      string text = load_file(path);
-      auto code = compile_function_code(directory, name, text);
+      if (!file.error.empty()) {
+        throw runtime_error(file.error);
+      }
+      auto code = file.code;
       if (code->index != 0) {
         if (!this->index_to_function.emplace(code->index, code).second) {
           throw runtime_error(string_printf(
@@ -160,10 +437,11 @@ FunctionCodeIndex::FunctionCodeIndex(const string& directory) {
         this->menu_item_id_to_patch_function.emplace(next_menu_item_id++, code);
         this->name_to_patch_function.emplace(name, code);
       }
+      const char* source_str = file.from_cache ? " (cached)" : "";
       if (code->index) {
-        log(INFO, "Compiled function %02X => %s", code->index, name.c_str());
+        log(INFO, "Compiled function %02X => %s%s", code->index, name.c_str(), source_str);
       } else {
-        log(INFO, "Compiled function %s", name.c_str());
+        log(INFO, "Compiled function %s%s", name.c_str(), source_str);
       }
 
     } catch (const exception& e) {
@@ -185,7 +463,57 @@ vector<MenuItem> FunctionCodeIndex::patch_menu() const {
 
 
 
-DOLFileIndex::DOLFileIndex(const string& directory) {
+// Each chunk's data (compressed or not) can be at most this large, so the
+// entire command fits in the client's receive buffer
+static const size_t MAX_DOL_CHUNK_DATA_SIZE = 0x7800;
+
+static void generate_dol_chunks(
+    DOLFileIndex::DOLFile& dol, const FunctionCodeIndex& function_code_index) {
+  if (dol.data.empty()) {
+    throw runtime_error("file is empty");
+  }
+  auto write_fn = function_code_index.name_to_function.at("WriteMemory");
+  shared_ptr<CompiledFunctionCode> write_compressed_fn;
+  try {
+    write_compressed_fn = function_code_index.name_to_function.at("WriteMemoryCompressed");
+  } catch (const out_of_range&) { }
+
+  dol.transfer_size = 0;
+  size_t offset = 0;
+  while (offset < dol.data.size()) {
+    auto& chunk = dol.chunks.emplace_back();
+    chunk.offset = offset;
+    size_t uncompressed_size = min<size_t>(
+        MAX_DOL_CHUNK_DATA_SIZE, dol.data.size() - offset);
+
+    string compressed;
+    size_t compressed_input_size = 0;
+    if (write_compressed_fn) {
+      compressed = prs_compress_bounded(dol.data.data() + offset,
+          dol.data.size() - offset, MAX_DOL_CHUNK_DATA_SIZE,
+          &compressed_input_size);
+    }
+
+    if (compressed_input_size > uncompressed_size) {
+      chunk.size = compressed_input_size;
+      chunk.function_index = write_compressed_fn->index;
+      chunk.code = write_compressed_fn->generate_client_command({}, compressed);
+      chunk.dest_addr_offset = write_compressed_fn->label_offsets.at("dest_addr");
+    } else {
+      chunk.size = uncompressed_size;
+      chunk.function_index = write_fn->index;
+      chunk.code = write_fn->generate_client_command(
+          {{"size", uncompressed_size}},
+          dol.data.substr(offset, uncompressed_size));
+      chunk.dest_addr_offset = write_fn->label_offsets.at("dest_addr");
+    }
+    dol.transfer_size += chunk.code.size();
+    offset += chunk.size;
+  }
+}
+
+DOLFileIndex::DOLFileIndex(const string& directory,
+    shared_ptr<const FunctionCodeIndex> function_code_index) {
   if (!function_compiler_available()) {
     log(INFO, "Function compiler is not available");
     return;
@@ -209,10 +537,12 @@ DOLFileIndex::DOLFileIndex(const string& directory) {
 
       string path = directory + "/" + filename;
       dol->data = load_file(path);
+      generate_dol_chunks(*dol, *function_code_index);
 
       this->name_to_file.emplace(dol->name, dol);
       this->item_id_to_file.emplace_back(dol);
-      log(WARNING, "Loaded DOL file %s", filename.c_str());
+      log(WARNING, "Loaded DOL file %s (%zu bytes; %zu bytes in %zu chunks to send)",
+          filename.c_str(), dol->data.size(), dol->transfer_size, dol->chunks.size());
 
     } catch (const exception& e) {
       log(WARNING, "Failed to load DOL file %s: %s", filename.c_str(), e.what());
@@ -27,21 +27,54 @@ struct CompiledFunctionCode {
   std::string name;
   uint32_t index; // 0 = unused (not registered in index_to_function)
   uint32_t menu_item_id;
-
+  // The relocation table and footer, which follow the code and suffix in each
+  // generated command. Only the footer's relocations_offset field depends on
+  // the suffix; it's written when each command is generated.
+  std::string command_footer;
+
+  // Must be called after code, relocation_deltas, and entrypoint_offset_offset
+  // are set (compile_function_code does this)
+  void prepare_command_footer();
+
+  // Returns the offset where the value for each label should be written. This
+  // can be done ahead of time for functions that are called often, so
+  // generating each call doesn't require any label lookups.
+  std::vector<uint32_t> label_write_offsets(
+      const std::vector<std::string>& labels) const;
+
+  size_t client_command_size(size_t suffix_size) const;
+  // Writes the command into dest, which must have room for
+  // client_command_size(suffix_size) bytes. values[x] is written at the offset
+  // returned by label_write_offsets for the xth label.
+  void generate_client_command(
+      void* dest,
+      const uint32_t* label_offsets,
+      const uint32_t* values,
+      size_t num_label_writes,
+      const void* suffix,
+      size_t suffix_size) const;
   std::string generate_client_command(
       const std::unordered_map<std::string, uint32_t>& label_writes = {},
       const std::string& suffix = "") const;
 };
 
+// If include_hashes is not null, it receives a hash of each file included by
+// the function (directly or indirectly), keyed by include name
 std::shared_ptr<CompiledFunctionCode> compile_function_code(
     const std::string& directory,
     const std::string& name,
-    const std::string& text);
+    const std::string& text,
+    std::map<std::string, uint64_t>* include_hashes = nullptr);
 
 
 
 struct FunctionCodeIndex {
-  FunctionCodeIndex(const std::string& directory);
+  // If cache_directory isn't empty, compiled functions are saved there, and
+  // each function is only recompiled if its source or any file it includes has
+  // changed since it was saved. Functions that need to be compiled are
+  // compiled in parallel.
+  FunctionCodeIndex(const std::string& directory,
+      const std::string& cache_directory = "");
 
   std::unordered_map<std::string, std::shared_ptr<CompiledFunctionCode>> name_to_function;
   std::unordered_map<uint32_t, std::shared_ptr<CompiledFunctionCode>> index_to_function;
@@ -59,15 +92,31 @@ struct FunctionCodeIndex {
 
 struct DOLFileIndex {
   struct DOLFile {
+    // DOL files are sent to the client in chunks, each of which is a call to
+    // WriteMemoryCompressed (or WriteMemory, if compressing the chunk wouldn't
+    // make it smaller). The commands for all chunks are generated when the file
+    // is loaded; only the destination address has to be written into each one
+    // when it's sent, since it depends on where the client has free memory.
+    struct Chunk {
+      uint32_t offset; // Offset in data (and from the client's base address)
+      uint32_t size; // Size of the written data, after decompression
+      uint32_t function_index;
+      std::string code; // From CompiledFunctionCode::generate_client_command
+      uint32_t dest_addr_offset; // Offset of dest_addr label within code
+    };
+
     uint32_t menu_item_id;
     std::string name;
     std::string data;
+    std::vector<Chunk> chunks;
+    size_t transfer_size; // Total size of all chunks' code
   };
 
   std::vector<std::shared_ptr<DOLFile>> item_id_to_file;
   std::map<std::string, std::shared_ptr<DOLFile>> name_to_file;
 
-  DOLFileIndex(const std::string& directory);
+  DOLFileIndex(const std::string& directory,
+      std::shared_ptr<const FunctionCodeIndex> function_code_index);
 
   std::vector<MenuItem> menu() const;
   inline bool empty() const {
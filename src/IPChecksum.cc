@@ -0,0 +1,162 @@
+#include "IPChecksum.hh"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_CHECKSUM_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+
+
+// All kernels sum the data as native-endian 16-bit words into a 64-bit
+// accumulator. The ones'-complement sum is byte-order independent (RFC 1071
+// section 2(B)), so we only have to swap the result once at the end instead of
+// swapping every word.
+
+static uint64_t sum_scalar(const uint8_t* data, size_t size, uint64_t acc) {
+  while (size >= 8) {
+    uint32_t w[2];
+    memcpy(w, data, 8);
+    acc += w[0];
+    acc += w[1];
+    data += 8;
+    size -= 8;
+  }
+  while (size >= 2) {
+    uint16_t w;
+    memcpy(&w, data, 2);
+    acc += w;
+    data += 2;
+    size -= 2;
+  }
+  if (size) {
+    // The last byte is the high byte of a big-endian word whose low byte is
+    // zero; in native order that's the first byte of the word in memory
+    uint8_t last[2] = {data[0], 0};
+    uint16_t w;
+    memcpy(&w, last, 2);
+    acc += w;
+  }
+  return acc;
+}
+
+#ifdef HAVE_X86_CHECKSUM_KERNELS
+
+// The SIMD kernels widen each 16-bit word to a 32-bit lane, so each lane can
+// absorb 0x8000 iterations (two words each) before it could overflow. We flush
+// the lanes into the 64-bit accumulator after at most that many iterations.
+static const size_t MAX_SIMD_ITERATIONS_PER_FLUSH = 0x7FFF;
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t* data, size_t size, uint64_t acc) {
+  const __m128i zero = _mm_setzero_si128();
+  while (size >= 16) {
+    size_t iterations = min<size_t>(size / 16, MAX_SIMD_ITERATIONS_PER_FLUSH);
+    __m128i lanes = _mm_setzero_si128();
+    for (size_t z = 0; z < iterations; z++) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+      lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(v, zero));
+      lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(v, zero));
+      data += 16;
+    }
+    size -= iterations * 16;
+
+    uint32_t lane_values[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lane_values), lanes);
+    acc += static_cast<uint64_t>(lane_values[0]) + lane_values[1] +
+        lane_values[2] + lane_values[3];
+  }
+  return sum_scalar(data, size, acc);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t* data, size_t size, uint64_t acc) {
+  const __m256i zero = _mm256_setzero_si256();
+  while (size >= 32) {
+    size_t iterations = min<size_t>(size / 32, MAX_SIMD_ITERATIONS_PER_FLUSH);
+    __m256i lanes = _mm256_setzero_si256();
+    for (size_t z = 0; z < iterations; z++) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+      lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(v, zero));
+      lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(v, zero));
+      data += 32;
+    }
+    size -= iterations * 32;
+
+    uint32_t lane_values[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lane_values), lanes);
+    for (size_t z = 0; z < 8; z++) {
+      acc += lane_values[z];
+    }
+  }
+  // Don't hand the tail to sum_sse2 here: calling legacy-encoded SSE code with
+  // the upper halves of the ymm registers dirty incurs a transition penalty
+  // that costs more than the tail itself
+  return sum_scalar(data, size, acc);
+}
+
+#endif
+
+struct ChecksumKernel {
+  const char* name;
+  uint64_t (*fn)(const uint8_t* data, size_t size, uint64_t acc);
+};
+
+static ChecksumKernel select_checksum_kernel() {
+#ifdef HAVE_X86_CHECKSUM_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {"avx2", sum_avx2};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {"sse2", sum_sse2};
+  }
+#endif
+  return {"scalar", sum_scalar};
+}
+
+static const ChecksumKernel checksum_kernel = select_checksum_kernel();
+
+
+
+static inline uint16_t fold_native_sum(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return sum;
+}
+
+static inline uint16_t native_to_network_word(uint16_t w) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap16(w);
+#else
+  return w;
+#endif
+}
+
+uint16_t ones_complement_sum(const void* data, size_t size, uint16_t initial_sum) {
+  uint64_t acc = native_to_network_word(initial_sum);
+  acc = checksum_kernel.fn(reinterpret_cast<const uint8_t*>(data), size, acc);
+  return native_to_network_word(fold_native_sum(acc));
+}
+
+uint16_t checksum_update_u16(uint16_t checksum, uint16_t old_value, uint16_t new_value) {
+  // HC' = ~(~HC + ~m + m')
+  uint16_t sum = ones_complement_add(~checksum, ~old_value);
+  return ~ones_complement_add(sum, new_value);
+}
+
+uint16_t checksum_update_u32(uint16_t checksum, uint32_t old_value, uint32_t new_value) {
+  checksum = checksum_update_u16(checksum, old_value >> 16, new_value >> 16);
+  return checksum_update_u16(checksum, old_value & 0xFFFF, new_value & 0xFFFF);
+}
+
+const char* name_for_checksum_kernel() {
+  return checksum_kernel.name;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+// These functions compute the Internet checksum (RFC 1071). The values they
+// return are plain (non-inverted) ones'-complement sums in host byte order,
+// so partial sums of adjacent regions can be combined with
+// ones_complement_add() before the final value is inverted and stored in a
+// header. All regions except the last one must have an even size.
+
+uint16_t ones_complement_sum(const void* data, size_t size, uint16_t initial_sum = 0);
+
+static inline uint16_t ones_complement_add(uint16_t a, uint16_t b) {
+  uint32_t sum = static_cast<uint32_t>(a) + b;
+  return (sum & 0xFFFF) + (sum >> 16);
+}
+
+// Incrementally updates an existing (inverted) checksum when a field covered by
+// it changes, without re-summing the rest of the data (RFC 1624, eqn. 3).
+uint16_t checksum_update_u16(uint16_t checksum, uint16_t old_value, uint16_t new_value);
+uint16_t checksum_update_u32(uint16_t checksum, uint32_t old_value, uint32_t new_value);
+
+// Returns the name of the summing kernel selected for this CPU (for logging)
+const char* name_for_checksum_kernel();
@@ -4,6 +4,8 @@
 
 #include <phosg/Strings.hh>
 
+#include "IPChecksum.hh"
+
 using namespace std;
 
 
@@ -218,6 +220,12 @@ uint16_t FrameInfo::computed_ipv4_header_checksum() const {
 
 uint16_t FrameInfo::computed_udp4_checksum(
     const IPv4Header& ipv4, const UDPHeader& udp, const void* data, size_t size) {
+  return computed_udp4_checksum_with_data_sum(
+      ipv4, udp, ones_complement_sum(data, size));
+}
+
+uint16_t FrameInfo::computed_udp4_checksum_with_data_sum(
+    const IPv4Header& ipv4, const UDPHeader& udp, uint16_t data_sum) {
   uint32_t sum =
       (ipv4.src_addr >> 16) +
       (ipv4.src_addr & 0xFFFF) +
@@ -227,15 +235,8 @@ uint16_t FrameInfo::computed_udp4_checksum(
       udp.size +
       udp.src_port +
       udp.dest_port +
-      udp.size;
-
-  const uint8_t* u8_data = reinterpret_cast<const uint8_t*>(data);
-  for (size_t offset = 0; offset + 2 <= size; offset += 2) {
-    sum += *reinterpret_cast<const be_uint16_t*>(u8_data + offset);
-  }
-  if (size & 1) {
-    sum += u8_data[size - 1] << 8;
-  }
+      udp.size +
+      data_sum;
   return ~collapse_checksum(sum);
 }
 
@@ -252,6 +253,12 @@ uint16_t FrameInfo::computed_udp4_checksum() const {
 
 uint16_t FrameInfo::computed_tcp4_checksum(
     const IPv4Header& ipv4, const TCPHeader& tcp, const void* data, size_t size) {
+  return computed_tcp4_checksum_with_data_sum(
+      ipv4, tcp, ones_complement_sum(data, size));
+}
+
+uint16_t FrameInfo::computed_tcp4_checksum_with_data_sum(
+    const IPv4Header& ipv4, const TCPHeader& tcp, uint16_t data_sum) {
   uint16_t tcp_size = ipv4.size - sizeof(IPv4Header);
   uint32_t sum =
       (ipv4.src_addr >> 16) +
@@ -268,15 +275,8 @@ uint16_t FrameInfo::computed_tcp4_checksum(
       (tcp.ack_num & 0xFFFF) +
       tcp.flags +
       tcp.window +
-      tcp.urgent_ptr;
-
-  const uint8_t* u8_data = reinterpret_cast<const uint8_t*>(data);
-  for (size_t offset = 0; offset + 2 <= size; offset += 2) {
-    sum += *reinterpret_cast<const be_uint16_t*>(u8_data + offset);
-  }
-  if (size & 1) {
-    sum += u8_data[size - 1] << 8;
-  }
+      tcp.urgent_ptr +
+      data_sum;
   return ~collapse_checksum(sum);
 }
 
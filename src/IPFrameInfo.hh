@@ -98,8 +98,15 @@ struct FrameInfo {
   uint16_t computed_ipv4_header_checksum() const;
   static uint16_t computed_udp4_checksum(
       const IPv4Header& ipv4, const UDPHeader& udp, const void* data, size_t size);
+  // These take the ones'-complement sum of the data (see IPChecksum.hh) instead
+  // of the data itself, so callers that already have it don't need to re-sum
+  // the payload
+  static uint16_t computed_udp4_checksum_with_data_sum(
+      const IPv4Header& ipv4, const UDPHeader& udp, uint16_t data_sum);
   uint16_t computed_udp4_checksum() const;
   static uint16_t computed_tcp4_checksum(
       const IPv4Header& ip, const TCPHeader& tcp, const void* data, size_t size);
+  static uint16_t computed_tcp4_checksum_with_data_sum(
+      const IPv4Header& ip, const TCPHeader& tcp, uint16_t data_sum);
   uint16_t computed_tcp4_checksum() const;
 };
@@ -19,6 +19,7 @@
 #include <phosg/Random.hh>
 #include <phosg/Time.hh>
 
+#include "IPChecksum.hh"
 #include "IPFrameInfo.hh"
 #include "DNSServer.hh"
 
@@ -80,17 +81,22 @@ IPStackSimulator::IPStackSimulator(
     std::shared_ptr<ServerState> state)
   : base(base),
     state(state),
-    pcap_text_log_file(state->ip_stack_debug ? fopen("IPStackSimulator-Log.txt", "wt") : nullptr) {
+    next_client_index(0) {
+  if (!this->state->ip_stack_capture_filename.empty()) {
+    this->capture.reset(new PcapngWriter(
+        this->state->ip_stack_capture_filename,
+        this->state->ip_stack_capture_rotate_bytes,
+        this->state->ip_stack_capture_rotate_usecs));
+  }
   memset(this->host_mac_address_bytes, 0x90, 6);
   memset(this->broadcast_mac_address_bytes, 0xFF, 6);
-}
-
-IPStackSimulator::~IPStackSimulator() {
-  if (this->pcap_text_log_file) {
-    fclose(this->pcap_text_log_file);
+  if (this->state->ip_stack_debug) {
+    this->log(INFO, "Using %s checksum kernel", name_for_checksum_kernel());
   }
 }
 
+IPStackSimulator::~IPStackSimulator() { }
+
 
 
 void IPStackSimulator::listen(const std::string& socket_path) {
@@ -133,7 +139,7 @@ uint32_t IPStackSimulator::connect_address_for_remote_address(uint32_t remote_ad
 
 
 IPStackSimulator::IPClient::IPClient(struct bufferevent* bev)
-  : bev(bev, bufferevent_free), ipv4_addr(0) {
+  : bev(bev, bufferevent_free), ipv4_addr(0), capture_interface_id(0) {
   memset(this->mac_addr, 0, 6);
 }
 
@@ -147,7 +153,13 @@ static void flush_and_free_bufferevent(struct bufferevent* bev) {
 IPStackSimulator::IPClient::TCPConnection::TCPConnection()
   : server_bev(nullptr, flush_and_free_bufferevent),
     pending_data(evbuffer_new(), evbuffer_free),
-    resend_push_event(nullptr, event_free) { }
+    pending_data_sum_bytes(0),
+    pending_data_sum(0),
+    resend_push_event(nullptr, event_free),
+    bytes_received(0),
+    bytes_received_copied(0),
+    bytes_sent(0),
+    bytes_sent_copied(0) { }
 
 
 
@@ -168,6 +180,11 @@ void IPStackSimulator::on_listen_accept(struct evconnlistener* listener,
       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
   shared_ptr<IPClient> c(new IPClient(bev));
   c->sim = this;
+  if (this->capture) {
+    c->capture_interface_id = this->capture->add_interface(string_printf(
+        "client%zu-fd%d", this->next_client_index, fd));
+  }
+  this->next_client_index++;
   this->bev_to_client.emplace(make_pair(bev, c));
 
   bufferevent_setcb(bev, &IPStackSimulator::dispatch_on_client_input, nullptr,
@@ -215,18 +232,19 @@ void IPStackSimulator::on_client_input(struct bufferevent* bev) {
       break; // No complete frame available; done for now
     }
 
-    evbuffer_drain(buf, 2);
-    string frame(frame_size, '\0');
-    evbuffer_remove(buf, frame.data(), frame.size());
-
+    // Parse the frame in place instead of copying it out of the buffer. This
+    // only moves data if the frame spans multiple chains in the buffer, which
+    // is rare since the tapserver protocol is framed.
+    const uint8_t* frame = evbuffer_pullup(buf, frame_size + 2) + 2;
     try {
-      this->on_client_frame(c, frame);
+      this->on_client_frame(c, frame, frame_size);
     } catch (const exception& e) {
       if (this->state->ip_stack_debug) {
         this->log(WARNING, "Failed to process client frame: %s", e.what());
-        print_data(stderr, frame);
+        print_data(stderr, frame, frame_size);
       }
     }
+    evbuffer_drain(buf, frame_size + 2);
   }
 }
 
@@ -252,15 +270,15 @@ void IPStackSimulator::on_client_error(struct bufferevent* bev,
 
 
 void IPStackSimulator::on_client_frame(
-    shared_ptr<IPClient> c, const string& frame) {
+    shared_ptr<IPClient> c, const void* frame, size_t size) {
   if (this->state->ip_stack_debug) {
     fputc('\n', stderr);
     this->log(INFO, "Client sent frame");
-    print_data(stderr, frame);
+    print_data(stderr, frame, size);
   }
-  this->log_frame(frame);
+  this->log_frame(c, frame, size);
 
-  FrameInfo fi(frame);
+  FrameInfo fi(frame, size);
   if (this->state->ip_stack_debug) {
     string fi_header = fi.header_str();
     this->log(INFO, "Frame header: %s", fi_header.c_str());
@@ -375,12 +393,12 @@ void IPStackSimulator::on_client_arp_frame(
     this->log(INFO, "Sending ARP response");
   }
 
-  if (this->pcap_text_log_file) {
+  if (this->capture) {
     StringWriter w;
     w.write(&r_ether, sizeof(r_ether));
     w.write(&r_arp, sizeof(r_arp));
     w.write(r_payload, sizeof(r_payload));
-    this->log_frame(w.str());
+    this->log_frame(c, w.str().data(), w.str().size());
   }
 }
 
@@ -444,13 +462,13 @@ void IPStackSimulator::on_client_udp_frame(
   evbuffer_add(out_buf, &r_udp, sizeof(r_udp));
   evbuffer_add(out_buf, r_data.data(), r_data.size());
 
-  if (this->pcap_text_log_file) {
+  if (this->capture) {
     StringWriter w;
     w.write(&r_ether, sizeof(r_ether));
     w.write(&r_ipv4, sizeof(r_ipv4));
     w.write(&r_udp, sizeof(r_udp));
     w.write(r_data.data(), r_data.size());
-    this->log_frame(w.str());
+    this->log_frame(c, w.str().data(), w.str().size());
   }
 }
 
@@ -623,7 +641,9 @@ void IPStackSimulator::on_client_tcp_frame(
           }
 
           evbuffer_drain(conn->pending_data.get(), ack_delta);
+          conn->pending_data_sum_bytes = 0;
           conn->acked_server_seq += ack_delta;
+          conn->bytes_sent += ack_delta;
           conn->resend_push_usecs = DEFAULT_RESEND_PUSH_USECS;
 
           if (this->state->ip_stack_debug) {
@@ -649,6 +669,7 @@ void IPStackSimulator::on_client_tcp_frame(
 
       string conn_str = this->str_for_tcp_connection(c, *conn);
       this->log(INFO, "Client closed TCP connection %s", conn_str.c_str());
+      this->log_connection_stats(*conn);
 
       // TODO: Are we supposed to send a response to an RST? Here we do, and the
       // client probably just ignores it anyway
@@ -715,7 +736,9 @@ void IPStackSimulator::on_client_tcp_frame(
           print_data(stderr, payload, payload_size);
         }
 
-        // Send the new data to the server
+        // Send the new data to the server. This is the only copy of inbound
+        // payload data; from here, the bufferevent pair moves the chains into
+        // the server's input buffer without copying them.
         struct evbuffer* server_out_buf = bufferevent_get_output(
             conn->server_bev.get());
         evbuffer_add(server_out_buf, payload, payload_size);
@@ -723,6 +746,7 @@ void IPStackSimulator::on_client_tcp_frame(
         // Update the sequence number and stats
         conn->next_client_seq += payload_size;
         conn->bytes_received += payload_size;
+        conn->bytes_received_copied += payload_size;
       }
 
       // Send an ACK
@@ -746,8 +770,30 @@ void IPStackSimulator::open_server_connection(
     throw logic_error("server connection is already open");
   }
 
+  // If the proxy server runs on worker threads, it can't use a bufferevent on
+  // this thread's event base, so connections to it use a socket pair instead
+  bool use_socket_pair = false;
+  try {
+    use_socket_pair = this->state->proxy_server.get() &&
+        this->state->proxy_server->uses_worker_threads() &&
+        (this->state->number_to_port_config.at(conn.server_port)->behavior == ServerBehavior::PROXY_SERVER);
+  } catch (const out_of_range&) { }
+
   struct bufferevent* bevs[2];
-  bufferevent_pair_new(this->base.get(), 0, bevs);
+  int proxy_fd = -1;
+  if (use_socket_pair) {
+    evutil_socket_t fds[2];
+    if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+      throw runtime_error("cannot create socket pair");
+    }
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_nonblocking(fds[1]);
+    bevs[0] = bufferevent_socket_new(this->base.get(), fds[0], BEV_OPT_CLOSE_ON_FREE);
+    bevs[1] = nullptr;
+    proxy_fd = fds[1];
+  } else {
+    bufferevent_pair_new(this->base.get(), 0, bevs);
+  }
 
   // Set up the IPStackSimulator end of the virtual connection
   bufferevent_setcb(bevs[0], &IPStackSimulator::dispatch_on_server_input,
@@ -773,7 +819,11 @@ void IPStackSimulator::open_server_connection(
           conn_str.c_str());
       flush_and_free_bufferevent(bevs[1]);
     } else {
-      this->state->proxy_server->connect_client(bevs[1], conn.server_port);
+      if (proxy_fd >= 0) {
+        this->state->proxy_server->connect_client(proxy_fd, conn.server_port);
+      } else {
+        this->state->proxy_server->connect_client(bevs[1], conn.server_port);
+      }
       this->log(INFO, "Connected TCP connection %s to proxy server",
           conn_str.c_str());
     }
@@ -858,29 +908,47 @@ void IPStackSimulator::send_tcp_frame(
   ipv4.size = sizeof(IPv4Header) + sizeof(TCPHeader) + src_bytes;
   ipv4.checksum = FrameInfo::computed_ipv4_header_checksum(ipv4);
 
-  const void* linear_data = src_bytes ? evbuffer_pullup(src_buf, src_bytes) : nullptr;
-  tcp.checksum = FrameInfo::computed_tcp4_checksum(
-      ipv4, tcp, linear_data, src_bytes);
-
+  // Build the frame directly in the client's output buffer. The payload is
+  // copied out of src_buf (which avoids linearizing src_buf with
+  // evbuffer_pullup) and summed from the copy, which is still in cache.
   struct evbuffer* out_buf = bufferevent_get_output(c->bev.get());
-
   uint16_t frame_size = sizeof(ether) + sizeof(ipv4) + sizeof(tcp) + src_bytes;
-  evbuffer_add(out_buf, &frame_size, 2);
-  evbuffer_add(out_buf, &ether, sizeof(ether));
-  evbuffer_add(out_buf, &ipv4, sizeof(ipv4));
-  evbuffer_add(out_buf, &tcp, sizeof(tcp));
+  struct evbuffer_iovec iov;
+  if (evbuffer_reserve_space(out_buf, frame_size + 2, &iov, 1) != 1) {
+    throw runtime_error("cannot reserve space for outbound frame");
+  }
+  uint8_t* frame_data = reinterpret_cast<uint8_t*>(iov.iov_base);
+  uint8_t* payload_data = frame_data + 2 + sizeof(ether) + sizeof(ipv4) + sizeof(tcp);
   if (src_bytes) {
-    evbuffer_add(out_buf, linear_data, src_bytes);
+    evbuffer_copyout(src_buf, payload_data, src_bytes);
+    conn.bytes_sent_copied += src_bytes;
   }
 
-  if (this->pcap_text_log_file) {
-    StringWriter w;
-    w.write(&ether, sizeof(ether));
-    w.write(&ipv4, sizeof(ipv4));
-    w.write(&tcp, sizeof(tcp));
-    w.write(linear_data, src_bytes);
-    this->log_frame(w.str());
+  // Resent PSH frames carry the same payload as the previous send, so reuse
+  // its sum if we have it; only the header fields need to be summed again
+  uint16_t payload_sum;
+  if ((src_buf == conn.pending_data.get()) &&
+      (conn.pending_data_sum_bytes == src_bytes)) {
+    payload_sum = conn.pending_data_sum;
+  } else {
+    payload_sum = ones_complement_sum(payload_data, src_bytes);
+    if (src_buf == conn.pending_data.get()) {
+      conn.pending_data_sum = payload_sum;
+      conn.pending_data_sum_bytes = src_bytes;
+    }
   }
+  tcp.checksum = FrameInfo::computed_tcp4_checksum_with_data_sum(
+      ipv4, tcp, payload_sum);
+
+  memcpy(frame_data, &frame_size, 2);
+  memcpy(frame_data + 2, &ether, sizeof(ether));
+  memcpy(frame_data + 2 + sizeof(ether), &ipv4, sizeof(ipv4));
+  memcpy(frame_data + 2 + sizeof(ether) + sizeof(ipv4), &tcp, sizeof(tcp));
+
+  this->log_frame(c, frame_data + 2, frame_size);
+
+  iov.iov_len = frame_size + 2;
+  evbuffer_commit_space(out_buf, &iov, 1);
 }
 
 void IPStackSimulator::dispatch_on_resend_push(evutil_socket_t, short, void* ctx) {
@@ -947,17 +1015,26 @@ void IPStackSimulator::on_server_error(
     string conn_str = this->str_for_tcp_connection(c, conn);
     this->log(INFO, "Server closed TCP connection %s",
         conn_str.c_str());
+    this->log_connection_stats(conn);
     c->tcp_connections.erase(this->tcp_conn_key_for_connection(conn));
   }
 }
 
 
 
-void IPStackSimulator::log_frame(const string& data) const {
-  if (this->pcap_text_log_file) {
-    print_data(this->pcap_text_log_file, data, 0, nullptr,
-        PrintDataFlags::SKIP_SEPARATOR);
-    fputc('\n', this->pcap_text_log_file);
-    fflush(this->pcap_text_log_file);
+void IPStackSimulator::log_connection_stats(
+    const IPClient::TCPConnection& conn) const {
+  // Copy ratios above 1.0 for sent data are due to retransmissions
+  this->log(INFO, "Connection stats: 0x%zX bytes received (%.2f copies per byte), 0x%zX bytes sent (%.2f copies per byte)",
+      conn.bytes_received,
+      conn.bytes_received ? (static_cast<double>(conn.bytes_received_copied) / conn.bytes_received) : 0.0,
+      conn.bytes_sent,
+      conn.bytes_sent ? (static_cast<double>(conn.bytes_sent_copied) / conn.bytes_sent) : 0.0);
+}
+
+void IPStackSimulator::log_frame(
+    shared_ptr<const IPClient> c, const void* data, size_t size) const {
+  if (this->capture) {
+    this->capture->write_packet(c->capture_interface_id, data, size);
   }
 }
@@ -7,6 +7,7 @@
 #include <phosg/Filesystem.hh>
 
 #include "IPFrameInfo.hh"
+#include "PcapngWriter.hh"
 #include "Server.hh"
 #include "ProxyServer.hh"
 #include "ServerState.hh"
@@ -43,6 +44,7 @@ private:
     unique_bufferevent bev;
     uint8_t mac_addr[6];
     uint32_t ipv4_addr;
+    uint32_t capture_interface_id;
 
     struct TCPConnection {
       std::weak_ptr<IPClient> client;
@@ -56,6 +58,11 @@ private:
       // TODO: Get rid of pending_data and just use server_bev's input buffer in
       // its place
       unique_evbuffer pending_data;
+      // Sum of the first pending_data_sum_bytes bytes of pending_data, so
+      // resent PSH frames don't have to sum the same payload again. This is
+      // invalidated (set to zero bytes) whenever pending_data is drained.
+      size_t pending_data_sum_bytes;
+      uint16_t pending_data_sum;
       unique_event resend_push_event;
 
       bool awaiting_first_ack;
@@ -67,8 +74,12 @@ private:
       uint32_t acked_server_seq;
       size_t resend_push_usecs;
       size_t max_frame_size;
+      // Payload bytes delivered in each direction, and the number of payload
+      // bytes copied in the process (including retransmissions)
       size_t bytes_received;
+      size_t bytes_received_copied;
       size_t bytes_sent;
+      size_t bytes_sent_copied;
 
       TCPConnection();
     };
@@ -83,7 +94,8 @@ private:
   uint8_t host_mac_address_bytes[6];
   uint8_t broadcast_mac_address_bytes[6];
 
-  FILE* pcap_text_log_file;
+  std::unique_ptr<PcapngWriter> capture;
+  size_t next_client_index;
 
   static uint64_t tcp_conn_key_for_connection(
       const IPClient::TCPConnection& conn);
@@ -108,7 +120,7 @@ private:
       void* ctx);
   void on_client_error(struct bufferevent* bev, short events);
 
-  void on_client_frame(std::shared_ptr<IPClient> c, const std::string& frame);
+  void on_client_frame(std::shared_ptr<IPClient> c, const void* frame, size_t size);
   void on_client_arp_frame(std::shared_ptr<IPClient> c, const FrameInfo& fi);
   void on_client_udp_frame(std::shared_ptr<IPClient> c, const FrameInfo& fi);
   void on_client_tcp_frame(std::shared_ptr<IPClient> c, const FrameInfo& fi);
@@ -135,5 +147,7 @@ private:
   void open_server_connection(
       std::shared_ptr<IPClient> c, IPClient::TCPConnection& conn);
 
-  void log_frame(const std::string& data) const;
+  void log_connection_stats(const IPClient::TCPConnection& conn) const;
+  void log_frame(std::shared_ptr<const IPClient> c, const void* data,
+      size_t size) const;
 };
@@ -2,7 +2,7 @@
 
 #include <string.h>
 
-#include <phosg/Random.hh>
+#include <phosg/Strings.hh>
 
 using namespace std;
 
@@ -227,63 +227,58 @@ void player_use_item(shared_ptr<Client> c, size_t item_index) {
 ////////////////////////////////////////////////////////////////////////////////
 
 // reads the non-rare item preferences from the config file.
-CommonItemCreator::CommonItemCreator(
-    const vector<uint32_t>& enemy_item_categories,
-    const vector<uint32_t>& box_item_categories,
-    const vector<vector<uint8_t>>& unit_types) :
-    enemy_item_categories(enemy_item_categories),
-    box_item_categories(box_item_categories),
-    unit_types(unit_types) {
-
-  // sanity check the values
-  if (this->enemy_item_categories.size() != 8) {
-    throw invalid_argument("enemy item categories is incorrect length");
-  }
-  if (this->box_item_categories.size() != 8) {
-    throw invalid_argument("box item categories is incorrect length");
-  }
-  if (this->unit_types.size() != 4) {
-    throw invalid_argument("unit types is incorrect length");
+static array<AliasTable, 10> compile_item_type_tables(
+    const vector<vector<uint32_t>>& categories, const char* name) {
+  if ((categories.size() != 1) && (categories.size() != 10)) {
+    throw invalid_argument(string_printf(
+        "%s item categories must have 1 or 10 entries", name));
   }
 
-  {
-    uint64_t sum = 0;
-    for (uint32_t v : this->enemy_item_categories) {
-      sum += v;
-    }
-    if (sum > 0xFFFFFFFF) {
-      throw invalid_argument("enemy item category sum is too large");
+  array<AliasTable, 10> ret;
+  for (size_t section_id = 0; section_id < 10; section_id++) {
+    const auto& probabilities = categories[(categories.size() == 1) ? 0 : section_id];
+    if (probabilities.size() != 8) {
+      throw invalid_argument(string_printf(
+          "%s item categories is incorrect length", name));
     }
-  }
-
-  {
     uint64_t sum = 0;
-    for (uint32_t v : this->box_item_categories) {
+    vector<double> weights;
+    for (uint32_t v : probabilities) {
       sum += v;
+      weights.emplace_back(v);
     }
-    if (sum > 0xFFFFFFFF) {
-      throw invalid_argument("box item category sum is too large");
+    if (sum > 0x100000000) {
+      throw invalid_argument(string_printf(
+          "%s item category sum is too large", name));
     }
+    weights.emplace_back(0x100000000 - sum); // no item
+    ret[section_id] = AliasTable(weights);
   }
+  return ret;
 }
 
-int32_t CommonItemCreator::decide_item_type(bool is_box) const {
-  uint32_t determinant = random_object<uint32_t>();
-
-  const auto* v = is_box ? &this->box_item_categories : &this->enemy_item_categories;
-  for (size_t x = 0; x < v->size(); x++) {
-    uint32_t probability = v->at(x);
-    if (probability > determinant) {
-      return x;
-    }
-    determinant -= probability;
+CommonItemCreator::CommonItemCreator(
+    const vector<vector<uint32_t>>& enemy_item_categories,
+    const vector<vector<uint32_t>>& box_item_categories,
+    const vector<vector<uint8_t>>& unit_types) :
+    enemy_item_type_tables(compile_item_type_tables(enemy_item_categories, "enemy")),
+    box_item_type_tables(compile_item_type_tables(box_item_categories, "box")),
+    unit_types(unit_types) {
+  if (this->unit_types.size() != 4) {
+    throw invalid_argument("unit types is incorrect length");
   }
-  return -1;
+}
+
+int32_t CommonItemCreator::decide_item_type(
+    bool is_box, uint8_t section_id, DropRNG& rng) const {
+  const auto& table = (is_box ? this->box_item_type_tables : this->enemy_item_type_tables)
+      .at(section_id);
+  size_t type = table.sample(rng);
+  return (type < 8) ? type : -1;
 }
 
 ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
-    uint8_t difficulty, uint8_t area, uint8_t) const {
-  // TODO: use the section ID (last argument) to vary drop frequencies appropriately
+    uint8_t difficulty, uint8_t area, uint8_t section_id, DropRNG& rng) const {
   // change the area if it's invalid (data for the bosses are actually in other areas)
   if (area > 10) {
     if (episode == 1) {
@@ -320,30 +315,30 @@ ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
   // picks a random non-rare item type, then gives it appropriate random stats
   // modify some of the constants in this section to change the system's
   // parameters
-  int32_t type = this->decide_item_type(is_box);
+  int32_t type = this->decide_item_type(is_box, section_id, rng);
   switch (type) {
     case 0x00: // material
       item.data1[0] = 0x03;
       item.data1[1] = 0x0B;
-      item.data1[2] = random_int(0, 6);
+      item.data1[2] = rng.next_int(0, 6);
       break;
 
     case 0x01: // equipment
-      switch (random_int(0, 3)) {
+      switch (rng.next_int(0, 3)) {
         case 0x00: // weapon
-          item.data1[1] = random_int(1, 12); // random normal class
-          item.data1[2] = difficulty + random_int(0, 2); // special type
+          item.data1[1] = rng.next_int(1, 12); // random normal class
+          item.data1[2] = difficulty + rng.next_int(0, 2); // special type
           if ((item.data1[1] > 0x09) && (item.data1[2] > 0x04)) {
             item.data1[2] = 0x04; // no special classes above 4
           }
           item.data1[4] = 0x80; // untekked
           if (item.data1[2] < 0x04) {
-            item.data1[4] |= random_int(0, 40); // give a special
+            item.data1[4] |= rng.next_int(0, 40); // give a special
           }
           for (size_t x = 0, y = 0; (x < 5) && (y < 3); x++) { // percentages
-            if (random_int(0, 10) == 1) { // 1/11 chance of getting each type of percentage
+            if (rng.next_int(0, 10) == 1) { // 1/11 chance of getting each type of percentage
               item.data1[6 + (y * 2)] = x + 1;
-              item.data1[7 + (y * 2)] = random_int(0, 10) * 5;
+              item.data1[7 + (y * 2)] = rng.next_int(0, 10) * 5;
               y++;
             }
           }
@@ -352,33 +347,33 @@ ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
         case 0x01: // armor
           item.data1[0] = 0x01;
           item.data1[1] = 0x01;
-          item.data1[2] = (6 * difficulty) + random_int(0, ((area / 2) + 2) - 1); // standard type based on difficulty and area
+          item.data1[2] = (6 * difficulty) + rng.next_int(0, ((area / 2) + 2) - 1); // standard type based on difficulty and area
           if (item.data1[2] > 0x17) {
             item.data1[2] = 0x17; // no standard types above 0x17
           }
-          if (random_int(0, 10) == 0) { // +/-
-            item.data1[4] = random_int(0, 5);
-            item.data1[6] = random_int(0, 2);
+          if (rng.next_int(0, 10) == 0) { // +/-
+            item.data1[4] = rng.next_int(0, 5);
+            item.data1[6] = rng.next_int(0, 2);
           }
-          item.data1[5] = random_int(0, 4); // slots
+          item.data1[5] = rng.next_int(0, 4); // slots
           break;
 
         case 0x02: // shield
           item.data1[0] = 0x01;
           item.data1[1] = 0x02;
-          item.data1[2] = (5 * difficulty) + random_int(0, ((area / 2) + 2) - 1); // standard type based on difficulty and area
+          item.data1[2] = (5 * difficulty) + rng.next_int(0, ((area / 2) + 2) - 1); // standard type based on difficulty and area
           if (item.data1[2] > 0x14) {
             item.data1[2] = 0x14; // no standard types above 0x14
           }
-          if (random_int(0, 10) == 0) { // +/-
-            item.data1[4] = random_int(0, 5);
-            item.data1[6] = random_int(0, 5);
+          if (rng.next_int(0, 10) == 0) { // +/-
+            item.data1[4] = rng.next_int(0, 5);
+            item.data1[6] = rng.next_int(0, 5);
           }
           break;
 
         case 0x03: { // unit
           const auto& type_table = this->unit_types.at(difficulty);
-          uint8_t type = type_table[random_int(0, type_table.size() - 1)];
+          uint8_t type = type_table[rng.next_int(0, type_table.size() - 1)];
           if (type == 0xFF) {
             throw out_of_range("no item dropped"); // 0xFF -> no item drops
           }
@@ -393,11 +388,11 @@ ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
     case 0x02: // technique
       item.data1[0] = 0x03;
       item.data1[1] = 0x02;
-      item.data1[4] = random_int(0, 18); // tech type
+      item.data1[4] = rng.next_int(0, 18); // tech type
       if ((item.data1[4] != 14) && (item.data1[4] != 17)) { // if not ryuker or reverser, give it a level
         if (item.data1[4] == 16) { // if not anti, give it a level between 1 and 30
           if (area > 3) {
-            item.data1[2] = difficulty + random_int(0, ((area - 1) / 2) - 1);
+            item.data1[2] = difficulty + rng.next_int(0, ((area - 1) / 2) - 1);
           } else {
             item.data1[2] = difficulty;
           }
@@ -405,7 +400,7 @@ ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
             item.data1[2] = 6;
           }
         } else {
-          item.data1[2] = (5 * difficulty) + random_int(0, ((area * 3) / 2) - 1); // else between 1 and 7
+          item.data1[2] = (5 * difficulty) + rng.next_int(0, ((area * 3) / 2) - 1); // else between 1 and 7
         }
       }
       break;
@@ -419,24 +414,24 @@ ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
     case 0x04: // grinder
       item.data1[0] = 0x03;
       item.data1[1] = 0x0A;
-      item.data1[2] = random_int(0, 2); // mono, di, tri
+      item.data1[2] = rng.next_int(0, 2); // mono, di, tri
       break;
 
     case 0x05: // consumable
       item.data1[0] = 0x03;
       item.data1[5] = 0x01;
-      switch (random_int(0, 2)) {
+      switch (rng.next_int(0, 2)) {
         case 0: // antidote / antiparalysis
           item.data1[1] = 6;
-          item.data1[2] = random_int(0, 1);
+          item.data1[2] = rng.next_int(0, 1);
           break;
 
         case 1: // telepipe / trap vision
-          item.data1[1] = 7 + random_int(0, 1);
+          item.data1[1] = 7 + rng.next_int(0, 1);
           break;
 
         case 2: // sol / moon / star atomizer
-          item.data1[1] = 3 + random_int(0, 2);
+          item.data1[1] = 3 + rng.next_int(0, 2);
           break;
       }
       break;
@@ -444,19 +439,19 @@ ItemData CommonItemCreator::create_drop_item(bool is_box, uint8_t episode,
     case 0x06: // consumable
       item.data1[0] = 0x03;
       item.data1[5] = 0x01;
-      item.data1[1] = random_int(0, 1); // mate or fluid
+      item.data1[1] = rng.next_int(0, 1); // mate or fluid
       if (difficulty == 0) {
-        item.data1[2] = random_int(0, 1); // only mono and di on normal
+        item.data1[2] = rng.next_int(0, 1); // only mono and di on normal
       } else if (difficulty == 3) {
-        item.data1[2] = random_int(1, 2); // only di and tri on ultimate
+        item.data1[2] = rng.next_int(1, 2); // only di and tri on ultimate
       } else {
-        item.data1[2] = random_int(0, 2); // else, any of the three
+        item.data1[2] = rng.next_int(0, 2); // else, any of the three
       }
       break;
 
     case 0x07: // meseta
       item.data1[0] = 0x04;
-      item.data2d = (90 * difficulty) + (random_int(1, 20) * (area * 2)); // meseta amount
+      item.data2d = (90 * difficulty) + (rng.next_int(1, 20) * (area * 2)); // meseta amount
       break;
 
     default:
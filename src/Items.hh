@@ -2,24 +2,35 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <memory>
 
 #include "Lobby.hh"
 #include "Client.hh"
+#include "DropTable.hh"
 
 void player_use_item(std::shared_ptr<Client> c, size_t item_index);
 
 struct CommonItemCreator {
-  std::vector<uint32_t> enemy_item_categories;
-  std::vector<uint32_t> box_item_categories;
+  // The item category probabilities are compiled into one alias table per
+  // section ID for enemies and boxes. Each table has 9 outcomes: the 8 item
+  // categories, then no item.
+  std::array<AliasTable, 10> enemy_item_type_tables;
+  std::array<AliasTable, 10> box_item_type_tables;
   std::vector<std::vector<uint8_t>> unit_types;
 
-  CommonItemCreator(const std::vector<uint32_t>& enemy_item_categories,
-      const std::vector<uint32_t>& box_item_categories,
+  // The outer vectors of enemy_item_categories and box_item_categories have
+  // either one entry (used for all section IDs) or 10 entries (one for each
+  // section ID). Each entry has 8 probabilities (out of 0x100000000), one for
+  // each item category.
+  CommonItemCreator(
+      const std::vector<std::vector<uint32_t>>& enemy_item_categories,
+      const std::vector<std::vector<uint32_t>>& box_item_categories,
       const std::vector<std::vector<uint8_t>>& unit_types);
 
-  int32_t decide_item_type(bool is_box) const;
+  // Returns -1 if no item should drop
+  int32_t decide_item_type(bool is_box, uint8_t section_id, DropRNG& rng) const;
   ItemData create_drop_item(bool is_box, uint8_t episode, uint8_t difficulty,
-      uint8_t area, uint8_t section_id) const;
+      uint8_t area, uint8_t section_id, DropRNG& rng) const;
   ItemData create_shop_item(uint8_t difficulty, uint8_t shop_type) const;
 };
@@ -17,18 +17,27 @@ LevelTable::LevelTable(const string& filename, bool compressed) {
     data = prs_decompress(data);
   }
 
-  if (data.size() < sizeof(*this)) {
+  if (data.size() < sizeof(this->data)) {
     throw invalid_argument("level table size is incorrect");
   }
 
-  memcpy(this, data.data(), sizeof(*this));
+  memcpy(&this->data, data.data(), sizeof(this->data));
+
+  for (size_t char_class = 0; char_class < 12; char_class++) {
+    auto& cumulative = this->cumulative_bonuses[char_class];
+    cumulative[0] = PlayerStats();
+    for (size_t level = 1; level < 200; level++) {
+      cumulative[level] = cumulative[level - 1];
+      this->data.levels[char_class][level].apply(cumulative[level]);
+    }
+  }
 }
 
 const PlayerStats& LevelTable::base_stats_for_class(uint8_t char_class) const {
   if (char_class >= 12) {
     throw out_of_range("invalid character class");
   }
-  return this->base_stats[char_class];
+  return this->data.base_stats[char_class];
 }
 
  const LevelStats& LevelTable::stats_for_level(uint8_t char_class,
@@ -39,7 +48,48 @@ const PlayerStats& LevelTable::base_stats_for_class(uint8_t char_class) const {
   if (level >= 200) {
     throw invalid_argument("invalid character level");
   }
-  return this->levels[char_class][level];
+  return this->data.levels[char_class][level];
+}
+
+uint8_t LevelTable::level_for_experience(uint8_t char_class,
+    uint32_t experience) const {
+  if (char_class >= 12) {
+    throw invalid_argument("invalid character class");
+  }
+  // The EXP values increase with level, so the result is the last level whose
+  // EXP value is at most the given amount
+  const auto* levels = this->data.levels[char_class];
+  size_t low = 0, high = 200;
+  while (high - low > 1) {
+    size_t mid = (low + high) / 2;
+    if (levels[mid].experience <= experience) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+void LevelTable::apply_level_ups(PlayerStats& ps, uint8_t char_class,
+    uint8_t from_level, uint8_t to_level) const {
+  if (char_class >= 12) {
+    throw invalid_argument("invalid character class");
+  }
+  if ((from_level >= 200) || (to_level >= 200)) {
+    throw invalid_argument("invalid character level");
+  }
+  if (to_level <= from_level) {
+    return;
+  }
+  const auto& from = this->cumulative_bonuses[char_class][from_level];
+  const auto& to = this->cumulative_bonuses[char_class][to_level];
+  ps.atp += to.atp - from.atp;
+  ps.mst += to.mst - from.mst;
+  ps.evp += to.evp - from.evp;
+  ps.hp += to.hp - from.hp;
+  ps.dfp += to.dfp - from.dfp;
+  ps.ata += to.ata - from.ata;
 }
 
 // Levels up a character by adding the level-up bonuses to the player's stats.
@@ -34,13 +34,31 @@ struct LevelStats {
 } __attribute__((packed));
 
 // level table format (PlyLevelTbl.prs)
-struct LevelTable {
+struct LevelTableData {
   PlayerStats base_stats[12];
   le_uint32_t unknown[12];
   LevelStats levels[12][200];
+} __attribute__((packed));
 
+class LevelTable {
+public:
   LevelTable(const std::string& filename, bool compressed);
 
   const PlayerStats& base_stats_for_class(uint8_t char_class) const;
   const LevelStats& stats_for_level(uint8_t char_class, uint8_t level) const;
-} __attribute__((packed));
+
+  // Returns the highest level (at most 199) that a character of the given
+  // class has reached with the given amount of EXP
+  uint8_t level_for_experience(uint8_t char_class, uint32_t experience) const;
+  // Adds the level-up bonuses for all levels after from_level, up to and
+  // including to_level. This takes the same time regardless of how many levels
+  // are gained.
+  void apply_level_ups(PlayerStats& ps, uint8_t char_class,
+      uint8_t from_level, uint8_t to_level) const;
+
+private:
+  LevelTableData data;
+  // The sum of the level-up bonuses for levels 1 through each level, for each
+  // class (the entry for level 0 is all zeroes)
+  PlayerStats cumulative_bonuses[12][200];
+};
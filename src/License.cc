@@ -41,6 +41,17 @@ string License::str() const {
 
 
 LicenseManager::LicenseManager(const string& filename) : filename(filename) {
+  this->load();
+}
+
+void LicenseManager::reload() {
+  lock_guard<mutex> g(this->lock);
+  this->bb_username_to_license.clear();
+  this->serial_number_to_license.clear();
+  this->load();
+}
+
+void LicenseManager::load() {
   try {
     auto licenses = load_vector_file<License>(this->filename);
     for (const auto& read_license : licenses) {
@@ -74,6 +85,7 @@ void LicenseManager::save() const {
 
 shared_ptr<const License> LicenseManager::verify_pc(uint32_t serial_number,
     const string& access_key) const {
+  lock_guard<mutex> g(this->lock);
   auto& license = this->serial_number_to_license.at(serial_number);
   if (!license->access_key.eq_n(access_key, 8)) {
     throw invalid_argument("incorrect access key");
@@ -87,6 +99,7 @@ shared_ptr<const License> LicenseManager::verify_pc(uint32_t serial_number,
 
 shared_ptr<const License> LicenseManager::verify_gc(uint32_t serial_number,
     const string& access_key) const {
+  lock_guard<mutex> g(this->lock);
   auto& license = this->serial_number_to_license.at(serial_number);
   if (!license->access_key.eq_n(access_key, 12)) {
     throw invalid_argument("incorrect access key");
@@ -99,6 +112,7 @@ shared_ptr<const License> LicenseManager::verify_gc(uint32_t serial_number,
 
 shared_ptr<const License> LicenseManager::verify_gc(uint32_t serial_number,
     const string& access_key, const string& password) const {
+  lock_guard<mutex> g(this->lock);
   auto& license = this->serial_number_to_license.at(serial_number);
   if (!license->access_key.eq_n(access_key, 12)) {
     throw invalid_argument("incorrect access key");
@@ -114,6 +128,7 @@ shared_ptr<const License> LicenseManager::verify_gc(uint32_t serial_number,
 
 shared_ptr<const License> LicenseManager::verify_bb(const string& username,
     const string& password) const {
+  lock_guard<mutex> g(this->lock);
   auto& license = this->bb_username_to_license.at(username);
   if (license->bb_password != password) {
     throw invalid_argument("incorrect password");
@@ -126,15 +141,18 @@ shared_ptr<const License> LicenseManager::verify_bb(const string& username,
 }
 
 size_t LicenseManager::count() const {
+  lock_guard<mutex> g(this->lock);
   return this->serial_number_to_license.size();
 }
 
 void LicenseManager::ban_until(uint32_t serial_number, uint64_t end_time) {
+  lock_guard<mutex> g(this->lock);
   this->serial_number_to_license.at(serial_number)->ban_end_time = end_time;
   this->save();
 }
 
 void LicenseManager::add(shared_ptr<License> l) {
+  lock_guard<mutex> g(this->lock);
   uint32_t serial_number = l->serial_number;
   this->serial_number_to_license.emplace(serial_number, l);
   if (!l->username.empty()) {
@@ -144,6 +162,7 @@ void LicenseManager::add(shared_ptr<License> l) {
 }
 
 void LicenseManager::remove(uint32_t serial_number) {
+  lock_guard<mutex> g(this->lock);
   auto l = this->serial_number_to_license.at(serial_number);
   this->serial_number_to_license.erase(l->serial_number);
   if (!l->username.empty()) {
@@ -153,6 +172,7 @@ void LicenseManager::remove(uint32_t serial_number) {
 }
 
 vector<License> LicenseManager::snapshot() const {
+  lock_guard<mutex> g(this->lock);
   vector<License> ret;
   for (auto it : this->serial_number_to_license) {
     ret.emplace_back(*it.second);
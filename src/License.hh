@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
 
 #include "Text.hh"
 
@@ -44,11 +45,17 @@ struct License {
   std::string str() const;
 } __attribute__((packed));
 
+// All public functions may be called from any thread (the proxy server's
+// worker threads verify licenses concurrently with the main thread).
 class LicenseManager {
 public:
   LicenseManager(const std::string& filename);
   ~LicenseManager() = default;
 
+  // Replaces all licenses (including temporary licenses) with the contents of
+  // the license file
+  void reload();
+
   std::shared_ptr<const License> verify_pc(uint32_t serial_number,
       const std::string& access_key) const;
   std::shared_ptr<const License> verify_gc(uint32_t serial_number,
@@ -75,8 +82,10 @@ public:
       const std::string& password, bool temporary);
 
 protected:
+  void load();
   void save() const;
 
+  mutable std::mutex lock;
   std::string filename;
   std::unordered_map<std::string, std::shared_ptr<License>> bb_username_to_license;
   std::unordered_map<uint32_t, std::shared_ptr<License>> serial_number_to_license;
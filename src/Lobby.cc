@@ -12,6 +12,7 @@ using namespace std;
 
 
 Lobby::Lobby() : lobby_id(0), min_level(0), max_level(0xFFFFFFFF),
+    drop_rng(random_object<uint64_t>()),
     next_game_item_id(0x00810000), version(GameVersion::GC), section_id(0),
     episode(1), difficulty(0), mode(0), rare_seed(random_object<uint32_t>()),
     event(0), block(0), type(0), leader_id(0), max_clients(12), flags(0) {
@@ -84,6 +85,10 @@ void Lobby::add_client(shared_ptr<Client> c) {
   c->lobby_client_id = index;
   c->lobby_id = this->lobby_id;
 
+  // Coalesced commands describe the state of the previous lobby, so they
+  // shouldn't be sent to the client after it joins this one
+  c->coalesced_commands.clear();
+
   // If there's no one else in the lobby, set the leader id as well
   if (index == (max_clients - 1) * c->prefer_high_lobby_client_id) {
     for (index = 0; index < max_clients; index++) {
@@ -118,6 +123,17 @@ void Lobby::remove_client(shared_ptr<Client> c) {
 
   this->clients[c->lobby_client_id] = nullptr;
 
+  // Don't send the client's coalesced commands after it leaves, and don't send
+  // its last position to the remaining clients (its client ID may be reused
+  // by a different player)
+  c->coalesced_commands.clear();
+  uint16_t movement_key = coalesce_key_for_movement(c->lobby_client_id);
+  for (const auto& other_c : this->clients) {
+    if (other_c) {
+      other_c->coalesced_commands.erase(movement_key);
+    }
+  }
+
   // Unassign the client's lobby if it matches the current lobby's id (it may
   // not match if the client was already added to another lobby - this can
   // happen during the lobby change procedure)
@@ -144,26 +160,6 @@ void Lobby::move_client_to_lobby(shared_ptr<Lobby> dest_lobby,
 
 
 
-shared_ptr<Client> Lobby::find_client(const u16string* identifier,
-    uint64_t serial_number) {
-  for (size_t x = 0; x < this->max_clients; x++) {
-    if (!this->clients[x]) {
-      continue;
-    }
-    if (serial_number && this->clients[x]->license &&
-        (this->clients[x]->license->serial_number == serial_number)) {
-      return this->clients[x];
-    }
-    if (identifier && (this->clients[x]->game_data.player()->disp.name == *identifier)) {
-      return this->clients[x];
-    }
-  }
-
-  throw out_of_range("client not found");
-}
-
-
-
 uint8_t Lobby::game_event_for_lobby_event(uint8_t lobby_event) {
   if (lobby_event > 7) {
     return 0;
@@ -180,21 +176,11 @@ uint8_t Lobby::game_event_for_lobby_event(uint8_t lobby_event) {
 
 
 void Lobby::add_item(const PlayerInventoryItem& item, uint8_t area, float x, float z) {
-  auto& fi = this->item_id_to_floor_item[item.data.id];
-  fi.inv_item = item;
-  fi.area = area;
-  fi.x = x;
-  fi.z = z;
+  this->floor_items.add(item, area, x, z);
 }
 
 PlayerInventoryItem Lobby::remove_item(uint32_t item_id) {
-  auto item_it = this->item_id_to_floor_item.find(item_id);
-  if (item_it == this->item_id_to_floor_item.end()) {
-    throw out_of_range("item not present");
-  }
-  PlayerInventoryItem ret = move(item_it->second.inv_item);
-  this->item_id_to_floor_item.erase(item_it);
-  return ret;
+  return this->floor_items.remove(item_id);
 }
 
 uint32_t Lobby::generate_item_id(uint8_t client_id) {
@@ -10,6 +10,7 @@
 #include <phosg/Encoding.hh>
 
 #include "Client.hh"
+#include "FloorItems.hh"
 #include "Player.hh"
 #include "Map.hh"
 #include "RareItemSet.hh"
@@ -34,18 +35,13 @@ struct Lobby {
   uint32_t max_level;
 
   // item info
-  struct FloorItem {
-    PlayerInventoryItem inv_item;
-    float x;
-    float z;
-    uint8_t area;
-  };
   std::vector<PSOEnemy> enemies;
   std::shared_ptr<const RareItemSet> rare_item_set;
+  DropRNG drop_rng;
   std::array<uint32_t, 12> next_item_id;
   uint32_t next_game_item_id;
   PlayerInventoryItem next_drop_item;
-  std::unordered_map<uint32_t, FloorItem> item_id_to_floor_item;
+  FloorItemSet floor_items;
   parray<le_uint32_t, 0x20> variations;
 
   // game config
@@ -86,13 +82,8 @@ struct Lobby {
   void move_client_to_lobby(std::shared_ptr<Lobby> dest_lobby,
       std::shared_ptr<Client> c);
 
-  std::shared_ptr<Client> find_client(
-      const std::u16string* identifier = nullptr,
-      uint64_t serial_number = 0);
-
   void add_item(const PlayerInventoryItem& item, uint8_t area, float x, float z);
   PlayerInventoryItem remove_item(uint32_t item_id);
-  size_t find_item(uint32_t item_id);
   uint32_t generate_item_id(uint8_t client_id);
 
   static uint8_t game_event_for_lobby_event(uint8_t lobby_event);
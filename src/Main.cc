@@ -1,6 +1,7 @@
 #include <signal.h>
 #include <pwd.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 #include <string.h>
 
 #include <unordered_map>
@@ -13,6 +14,7 @@
 #include "NetworkAddresses.hh"
 #include "SendCommands.hh"
 #include "DNSServer.hh"
+#include "EventLoopThread.hh"
 #include "ProxyServer.hh"
 #include "ServerState.hh"
 #include "Server.hh"
@@ -74,14 +76,31 @@ void populate_state_from_config(shared_ptr<ServerState> s,
 
   s->set_port_configuration(parse_port_configuration(d.at("PortConfiguration")));
 
-  auto enemy_categories = parse_int_vector<uint32_t>(d.at("CommonItemDropRates-Enemy"));
-  auto box_categories = parse_int_vector<uint32_t>(d.at("CommonItemDropRates-Box"));
+  // The drop rates can be given once for all section IDs, or separately for
+  // each section ID
+  auto parse_item_categories = [](shared_ptr<const JSONObject> o) {
+    vector<vector<uint32_t>> ret;
+    const auto& l = o->as_list();
+    if (!l.empty() && l[0]->is_list()) {
+      for (const auto& item : l) {
+        ret.emplace_back(parse_int_vector<uint32_t>(item));
+      }
+    } else {
+      ret.emplace_back(parse_int_vector<uint32_t>(o));
+    }
+    return ret;
+  };
+  auto enemy_categories = parse_item_categories(d.at("CommonItemDropRates-Enemy"));
+  auto box_categories = parse_item_categories(d.at("CommonItemDropRates-Box"));
   vector<vector<uint8_t>> unit_types;
   for (const auto& item : d.at("CommonUnitTypes")->as_list()) {
     unit_types.emplace_back(parse_int_vector<uint8_t>(item));
   }
-  s->common_item_creator.reset(new CommonItemCreator(enemy_categories,
-      box_categories, unit_types));
+  shared_ptr<const CommonItemCreator> common_item_creator(new CommonItemCreator(
+      enemy_categories, box_categories, unit_types));
+  s->update_config([&](ServerConfigSnapshot& config) {
+    config.common_item_creator = common_item_creator;
+  });
 
   auto local_address_str = d.at("LocalAddress")->as_string();
   try {
@@ -112,6 +131,9 @@ void populate_state_from_config(shared_ptr<ServerState> s,
   } catch (const out_of_range&) {
     s->dns_server_port = 0;
   }
+  try {
+    s->dns_server_use_thread = d.at("DNSServerThread")->as_bool();
+  } catch (const out_of_range&) { }
 
   try {
     for (const auto& item : d.at("IPStackListen")->as_list()) {
@@ -121,6 +143,19 @@ void populate_state_from_config(shared_ptr<ServerState> s,
   try {
     s->ip_stack_debug = d.at("IPStackDebug")->as_bool();
   } catch (const out_of_range&) { }
+  try {
+    s->ip_stack_capture_filename = d.at("IPStackCaptureFile")->as_string();
+  } catch (const out_of_range&) {
+    if (s->ip_stack_debug) {
+      s->ip_stack_capture_filename = "IPStackSimulator-Log.pcapng";
+    }
+  }
+  try {
+    s->ip_stack_capture_rotate_bytes = d.at("IPStackCaptureRotateBytes")->as_int();
+  } catch (const out_of_range&) { }
+  try {
+    s->ip_stack_capture_rotate_usecs = d.at("IPStackCaptureRotateSeconds")->as_int() * 1000000;
+  } catch (const out_of_range&) { }
 
   try {
     s->allow_unregistered_users = d.at("AllowUnregisteredUsers")->as_bool();
@@ -128,6 +163,29 @@ void populate_state_from_config(shared_ptr<ServerState> s,
     s->allow_unregistered_users = true;
   }
 
+  try {
+    s->proxy_fast_passthrough = d.at("ProxyFastPassthrough")->as_bool();
+  } catch (const out_of_range&) { }
+  try {
+    s->proxy_worker_threads = d.at("ProxyWorkerThreads")->as_int();
+  } catch (const out_of_range&) { }
+  try {
+    s->proxy_prewarm_destinations = d.at("ProxyPrewarmDestinations")->as_bool();
+  } catch (const out_of_range&) { }
+  try {
+    s->client_output_high_watermark = d.at("ClientOutputHighWatermark")->as_int();
+  } catch (const out_of_range&) { }
+  try {
+    s->client_output_low_watermark = d.at("ClientOutputLowWatermark")->as_int();
+  } catch (const out_of_range&) { }
+  try {
+    s->client_output_congestion_timeout_usecs = static_cast<uint64_t>(
+        d.at("ClientOutputCongestionTimeout")->as_int()) * 1000000;
+  } catch (const out_of_range&) { }
+  if (s->client_output_low_watermark > s->client_output_high_watermark) {
+    throw invalid_argument("ClientOutputLowWatermark must not be larger than ClientOutputHighWatermark");
+  }
+
   for (const string& filename : list_directory("system/blueburst/keys")) {
     if (!ends_with(filename, ".nsk")) {
       continue;
@@ -312,7 +370,12 @@ int main(int argc, char** argv) {
 
   shared_ptr<ServerState> state(new ServerState());
 
+  // Some servers can run on their own threads, which stop their event loops
+  // from the main thread, so libevent's locking has to be enabled before any
+  // event bases are created
+  evthread_use_pthreads();
   shared_ptr<struct event_base> base(event_base_new(), event_base_free);
+  state->event_loop_lag_monitors.emplace_back(new EventLoopLagMonitor(base, "main"));
 
   log(INFO, "Reading network addresses");
   state->all_addresses = get_local_addresses();
@@ -328,33 +391,56 @@ int main(int argc, char** argv) {
   log(INFO, "Loading license list");
   state->license_manager.reset(new LicenseManager("system/licenses.nsi"));
 
+  shared_ptr<ServerConfigSnapshot> config(
+      new ServerConfigSnapshot(*state->config()));
+
   log(INFO, "Loading battle parameters");
-  state->battle_params.reset(new BattleParamTable("system/blueburst/BattleParamEntry"));
+  config->battle_params.reset(new BattleParamTable("system/blueburst/BattleParamEntry"));
+
+  log(INFO, "Loading rare item table");
+  config->rare_item_table.reset(new RareItemTable("system/blueburst/ItemRT.rel"));
 
   log(INFO, "Loading level table");
-  state->level_table.reset(new LevelTable("system/blueburst/PlyLevelTbl.prs", true));
+  config->level_table.reset(new LevelTable("system/blueburst/PlyLevelTbl.prs", true));
 
   log(INFO, "Collecting Episode 3 data");
-  state->ep3_data_index.reset(new Ep3DataIndex("system/ep3"));
+  config->ep3_data_index.reset(new Ep3DataIndex("system/ep3"));
 
   log(INFO, "Collecting quest metadata");
-  state->quest_index.reset(new QuestIndex("system/quests"));
+  config->quest_index.reset(new QuestIndex("system/quests"));
 
   log(INFO, "Compiling client functions");
-  state->function_code_index.reset(new FunctionCodeIndex("system/ppc"));
+  config->function_code_index.reset(new FunctionCodeIndex(
+      "system/ppc", "system/ppc/.cache"));
 
   log(INFO, "Loading DOL files");
-  state->dol_file_index.reset(new DOLFileIndex("system/dol"));
+  config->dol_file_index.reset(new DOLFileIndex(
+      "system/dol", config->function_code_index));
+
+  state->set_config(config);
 
   log(INFO, "Creating menus");
   state->create_menus(config_json);
 
+  // dns_thread is declared after dns_server so it's destroyed (and the thread
+  // is stopped) before dns_server is destroyed
   shared_ptr<DNSServer> dns_server;
+  shared_ptr<EventLoopThread> dns_thread;
   if (state->dns_server_port) {
-    log(INFO, "Starting DNS server");
-    dns_server.reset(new DNSServer(base, state->local_address,
-        state->external_address));
+    if (state->dns_server_use_thread) {
+      log(INFO, "Starting DNS server on its own thread");
+      dns_thread.reset(new EventLoopThread("dns"));
+      state->event_loop_lag_monitors.emplace_back(dns_thread->get_lag_monitor());
+    } else {
+      log(INFO, "Starting DNS server");
+    }
+    dns_server.reset(new DNSServer(
+        dns_thread ? dns_thread->get_base() : base,
+        state->local_address, state->external_address));
     dns_server->listen("", state->dns_server_port);
+    if (dns_thread) {
+      dns_thread->start();
+    }
   } else {
     log(INFO, "DNS server is disabled");
   }
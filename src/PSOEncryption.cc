@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <string>
 #include <phosg/Encoding.hh>
@@ -21,6 +22,58 @@ void PSOEncryption::decrypt(void* data, size_t size, bool advance) {
   this->encrypt(data, size, advance);
 }
 
+bool PSOEncryption::has_data_independent_keystream() const {
+  return false;
+}
+
+void PSOEncryption::generate_keystream(le_uint32_t*, size_t) {
+  throw logic_error("cipher keystream depends on data");
+}
+
+void rekey_stream_cipher_data(
+    PSOEncryption& from_crypt, PSOEncryption& to_crypt, void* vdata, size_t size) {
+  if (size & 3) {
+    throw invalid_argument("size must be a multiple of 4");
+  }
+
+  // Both keystreams are generated into small buffers that stay in L1, so the
+  // data itself is only traversed once
+  static const size_t CHUNK_WORDS = 0x100;
+  le_uint32_t from_keystream[CHUNK_WORDS];
+  le_uint32_t to_keystream[CHUNK_WORDS];
+  uint8_t* data = reinterpret_cast<uint8_t*>(vdata);
+  size_t remaining_words = size >> 2;
+  while (remaining_words) {
+    size_t chunk_words = min<size_t>(remaining_words, CHUNK_WORDS);
+    from_crypt.generate_keystream(from_keystream, chunk_words);
+    to_crypt.generate_keystream(to_keystream, chunk_words);
+
+    size_t chunk_size = chunk_words << 2;
+    const uint8_t* from_bytes = reinterpret_cast<const uint8_t*>(from_keystream);
+    const uint8_t* to_bytes = reinterpret_cast<const uint8_t*>(to_keystream);
+    size_t z = 0;
+    for (; z + 8 <= chunk_size; z += 8) {
+      uint64_t w, f, t;
+      memcpy(&w, data + z, 8);
+      memcpy(&f, from_bytes + z, 8);
+      memcpy(&t, to_bytes + z, 8);
+      w ^= f ^ t;
+      memcpy(data + z, &w, 8);
+    }
+    if (z < chunk_size) {
+      uint32_t w, f, t;
+      memcpy(&w, data + z, 4);
+      memcpy(&f, from_bytes + z, 4);
+      memcpy(&t, to_bytes + z, 4);
+      w ^= f ^ t;
+      memcpy(data + z, &w, 4);
+    }
+
+    data += chunk_size;
+    remaining_words -= chunk_words;
+  }
+}
+
 
 
 void PSOPCEncryption::update_stream() {
@@ -96,6 +149,28 @@ void PSOPCEncryption::encrypt(void* vdata, size_t size, bool advance) {
   }
 }
 
+bool PSOPCEncryption::has_data_independent_keystream() const {
+  return true;
+}
+
+void PSOPCEncryption::generate_keystream(le_uint32_t* out, size_t count) {
+  // This is equivalent to calling next() count times, but copies contiguous
+  // runs of the stream at once
+  while (count) {
+    if (this->offset == PC_STREAM_LENGTH) {
+      this->update_stream();
+      this->offset = 1;
+    }
+    size_t run = min<size_t>(count, PC_STREAM_LENGTH - this->offset);
+    for (size_t z = 0; z < run; z++) {
+      out[z] = this->stream[this->offset + z];
+    }
+    this->offset += run;
+    out += run;
+    count -= run;
+  }
+}
+
 
 
 void PSOGCEncryption::update_stream() {
@@ -173,6 +248,25 @@ void PSOGCEncryption::encrypt(void* vdata, size_t size, bool advance) {
   }
 }
 
+bool PSOGCEncryption::has_data_independent_keystream() const {
+  return true;
+}
+
+void PSOGCEncryption::generate_keystream(le_uint32_t* out, size_t count) {
+  while (count) {
+    if (this->offset == GC_STREAM_LENGTH) {
+      this->update_stream();
+    }
+    size_t run = min<size_t>(count, GC_STREAM_LENGTH - this->offset);
+    for (size_t z = 0; z < run; z++) {
+      out[z] = this->stream[this->offset + z];
+    }
+    this->offset += run;
+    out += run;
+    count -= run;
+  }
+}
+
 
 
 void PSOBBEncryption::decrypt(void* vdata, size_t size, bool advance) {
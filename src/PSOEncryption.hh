@@ -30,15 +30,34 @@ public:
     this->decrypt(data.data(), data.size(), advance);
   }
 
+  // Returns true if encrypt() and decrypt() just XOR the data with a keystream
+  // that doesn't depend on the data (this is the case for PC and GC, but not
+  // BB). Data encrypted with one of these ciphers can be re-encrypted with
+  // another one by rekey_stream_cipher_data() without being decrypted first.
+  virtual bool has_data_independent_keystream() const;
+  // Writes the next count words of the keystream to out and advances the
+  // cipher. This is only implemented for ciphers with data-independent
+  // keystreams.
+  virtual void generate_keystream(le_uint32_t* out, size_t count);
+
 protected:
   PSOEncryption() = default;
 };
 
+// Converts data encrypted with from_crypt into data encrypted with to_crypt,
+// advancing both ciphers. Both ciphers must have data-independent keystreams;
+// the two keystreams are combined and applied to the data in a single pass, so
+// the plaintext is never materialized. size must be a multiple of 4.
+void rekey_stream_cipher_data(
+    PSOEncryption& from_crypt, PSOEncryption& to_crypt, void* data, size_t size);
+
 class PSOPCEncryption : public PSOEncryption {
 public:
   explicit PSOPCEncryption(uint32_t seed);
 
   virtual void encrypt(void* data, size_t size, bool advance = true);
+  virtual bool has_data_independent_keystream() const;
+  virtual void generate_keystream(le_uint32_t* out, size_t count);
 
 protected:
   void update_stream();
@@ -53,6 +72,8 @@ public:
   explicit PSOGCEncryption(uint32_t key);
 
   virtual void encrypt(void* data, size_t size, bool advance = true);
+  virtual bool has_data_independent_keystream() const;
+  virtual void generate_keystream(le_uint32_t* out, size_t count);
 
 protected:
   void update_stream();
@@ -131,7 +131,7 @@ void PSOCommandHeader::set_flag(GameVersion version, uint32_t flag) {
 
 
 
-void for_each_received_command(
+bool receive_command(
     struct bufferevent* bev,
     GameVersion version,
     PSOEncryption* crypt,
@@ -139,54 +139,61 @@ void for_each_received_command(
   struct evbuffer* buf = bufferevent_get_input(bev);
 
   size_t header_size = (version == GameVersion::BB) ? 8 : 4;
-  for (;;) {
-    PSOCommandHeader header;
-    if (evbuffer_copyout(buf, &header, header_size)
-        < static_cast<ssize_t>(header_size)) {
-      break;
-    }
-
-    if (crypt) {
-      crypt->decrypt(&header, header_size, false);
-    }
+  PSOCommandHeader header;
+  if (evbuffer_copyout(buf, &header, header_size)
+      < static_cast<ssize_t>(header_size)) {
+    return false;
+  }
 
-    size_t command_logical_size = header.size(version);
+  if (crypt) {
+    crypt->decrypt(&header, header_size, false);
+  }
 
-    // If encryption is enabled, BB pads commands to 8-byte boundaries, and this
-    // is not reflected in the size field. This logic does not occur if
-    // encryption is not yet enabled.
-    size_t command_physical_size = (crypt && (version == GameVersion::BB))
-        ? ((command_logical_size + header_size - 1) & ~(header_size - 1))
-        : command_logical_size;
-    if (evbuffer_get_length(buf) < command_physical_size) {
-      break;
-    }
+  size_t command_logical_size = header.size(version);
 
-    // If we get here, then there is a full command in the buffer. Some
-    // encryption algorithms' advancement depends on the decrypted data, so we
-    // have to actually decrypt the header again (with advance=true) to keep
-    // them in a consistent state.
+  // If encryption is enabled, BB pads commands to 8-byte boundaries, and this
+  // is not reflected in the size field. This logic does not occur if
+  // encryption is not yet enabled.
+  size_t command_physical_size = (crypt && (version == GameVersion::BB))
+      ? ((command_logical_size + header_size - 1) & ~(header_size - 1))
+      : command_logical_size;
+  if (evbuffer_get_length(buf) < command_physical_size) {
+    return false;
+  }
 
-    string header_data(header_size, '\0');
-    if (evbuffer_remove(buf, header_data.data(), header_data.size())
-        < static_cast<ssize_t>(header_data.size())) {
-      throw logic_error("enough bytes available, but could not remove them");
-    }
+  // If we get here, then there is a full command in the buffer. Some
+  // encryption algorithms' advancement depends on the decrypted data, so we
+  // have to actually decrypt the header again (with advance=true) to keep
+  // them in a consistent state.
 
-    string command_data(command_physical_size - header_size, '\0');
-    if (evbuffer_remove(buf, command_data.data(), command_data.size())
-        < static_cast<ssize_t>(command_data.size())) {
-      throw logic_error("enough bytes available, but could not remove them");
-    }
+  string header_data(header_size, '\0');
+  if (evbuffer_remove(buf, header_data.data(), header_data.size())
+      < static_cast<ssize_t>(header_data.size())) {
+    throw logic_error("enough bytes available, but could not remove them");
+  }
 
-    if (crypt) {
-      crypt->decrypt(header_data.data(), header_data.size());
-      crypt->decrypt(command_data.data(), command_data.size());
-    }
-    command_data.resize(command_logical_size - header_size);
+  string command_data(command_physical_size - header_size, '\0');
+  if (evbuffer_remove(buf, command_data.data(), command_data.size())
+      < static_cast<ssize_t>(command_data.size())) {
+    throw logic_error("enough bytes available, but could not remove them");
+  }
 
-    fn(header.command(version), header.flag(version), command_data);
+  if (crypt) {
+    crypt->decrypt(header_data.data(), header_data.size());
+    crypt->decrypt(command_data.data(), command_data.size());
   }
+  command_data.resize(command_logical_size - header_size);
+
+  fn(header.command(version), header.flag(version), command_data);
+  return true;
+}
+
+void for_each_received_command(
+    struct bufferevent* bev,
+    GameVersion version,
+    PSOEncryption* crypt,
+    function<void(uint16_t, uint16_t, string&)> fn) {
+  while (receive_command(bev, version, crypt, fn)) { }
 }
 
 void print_received_command(
@@ -52,6 +52,15 @@ union PSOSubcommand {
   le_uint32_t dword;
 } __attribute__((packed));
 
+// Removes one complete command from the bufferevent's input buffer, decrypts
+// it, and calls fn with it. Returns false (and doesn't call fn) if the buffer
+// doesn't contain a complete command.
+bool receive_command(
+    struct bufferevent* bev,
+    GameVersion version,
+    PSOEncryption* crypt,
+    std::function<void(uint16_t, uint16_t, std::string&)> fn);
+
 void for_each_received_command(
     struct bufferevent* bev,
     GameVersion version,
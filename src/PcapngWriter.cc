@@ -0,0 +1,271 @@
+#include "PcapngWriter.hh"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+using namespace std;
+
+
+
+struct SectionHeaderBlock {
+  le_uint32_t type;
+  le_uint32_t size;
+  le_uint32_t byte_order_magic;
+  le_uint16_t major_version;
+  le_uint16_t minor_version;
+  le_uint64_t section_size;
+  le_uint32_t size2;
+} __attribute__((packed));
+
+struct InterfaceDescriptionBlockHeader {
+  le_uint32_t type;
+  le_uint32_t size;
+  le_uint16_t link_type;
+  le_uint16_t reserved;
+  le_uint32_t snap_len;
+} __attribute__((packed));
+
+struct BlockOptionHeader {
+  le_uint16_t code;
+  le_uint16_t size;
+} __attribute__((packed));
+
+struct EnhancedPacketBlockHeader {
+  le_uint32_t type;
+  le_uint32_t size;
+  le_uint32_t interface_id;
+  le_uint32_t timestamp_high;
+  le_uint32_t timestamp_low;
+  le_uint32_t captured_size;
+  le_uint32_t original_size;
+} __attribute__((packed));
+
+static const uint32_t BLOCK_TYPE_INTERFACE_DESCRIPTION = 0x00000001;
+static const uint32_t BLOCK_TYPE_ENHANCED_PACKET = 0x00000006;
+static const uint32_t BLOCK_TYPE_SECTION_HEADER = 0x0A0D0D0A;
+static const uint16_t OPTION_END = 0;
+static const uint16_t OPTION_IF_NAME = 2;
+static const uint16_t LINK_TYPE_ETHERNET = 1;
+
+static void fclose_file(FILE* f) {
+  fclose(f);
+}
+
+static inline size_t pad4(size_t size) {
+  return (size + 3) & (~3);
+}
+
+
+
+PcapngWriter::PcapngWriter(
+    const string& filename,
+    size_t rotate_bytes,
+    uint64_t rotate_usecs,
+    size_t max_buffered_bytes)
+  : filename(filename),
+    rotate_bytes(rotate_bytes),
+    rotate_usecs(rotate_usecs),
+    max_buffered_bytes(max_buffered_bytes),
+    should_exit(false),
+    dropped_packets(0),
+    f(nullptr, fclose_file),
+    file_bytes(0),
+    file_start_time(0),
+    file_interface_count(0) {
+  // Open the first file here, so configuration errors are reported at startup
+  // instead of on the writer thread
+  this->open_file();
+  this->writer_thread = thread(&PcapngWriter::write_thread_fn, this);
+}
+
+PcapngWriter::~PcapngWriter() {
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+  }
+  this->cv.notify_one();
+  this->writer_thread.join();
+
+  size_t dropped = this->dropped_packets;
+  if (dropped) {
+    log(WARNING, "[PcapngWriter] %zu packet(s) were dropped because the writer fell behind",
+        dropped);
+  }
+}
+
+uint32_t PcapngWriter::add_interface(const string& name) {
+  lock_guard<mutex> g(this->lock);
+  this->interface_names.emplace_back(name);
+  return this->interface_names.size() - 1;
+}
+
+void PcapngWriter::write_packet(uint32_t interface_id, const void* data, size_t size) {
+  uint64_t t = now();
+  size_t block_size = sizeof(EnhancedPacketBlockHeader) + pad4(size) + sizeof(le_uint32_t);
+
+  bool was_empty;
+  {
+    lock_guard<mutex> g(this->lock);
+    if (this->pending_blocks.size() + block_size > this->max_buffered_bytes) {
+      this->dropped_packets++;
+      return;
+    }
+    was_empty = this->pending_blocks.empty();
+
+    size_t offset = this->pending_blocks.size();
+    this->pending_blocks.resize(offset + block_size, '\0');
+    char* block = this->pending_blocks.data() + offset;
+
+    EnhancedPacketBlockHeader header;
+    header.type = BLOCK_TYPE_ENHANCED_PACKET;
+    header.size = block_size;
+    header.interface_id = interface_id;
+    header.timestamp_high = t >> 32;
+    header.timestamp_low = t;
+    header.captured_size = size;
+    header.original_size = size;
+    memcpy(block, &header, sizeof(header));
+    memcpy(block + sizeof(header), data, size);
+    le_uint32_t trailer_size = block_size;
+    memcpy(block + block_size - sizeof(trailer_size), &trailer_size, sizeof(trailer_size));
+  }
+
+  // The writer thread only waits when there's nothing pending, so it only needs
+  // to be woken up if the buffer was empty
+  if (was_empty) {
+    this->cv.notify_one();
+  }
+}
+
+void PcapngWriter::write_packet(uint32_t interface_id, const string& data) {
+  this->write_packet(interface_id, data.data(), data.size());
+}
+
+string PcapngWriter::filename_for_time(uint64_t t) const {
+  if (!this->rotate_bytes && !this->rotate_usecs) {
+    return this->filename;
+  }
+  string base = this->filename;
+  if (ends_with(base, ".pcapng")) {
+    base.resize(base.size() - 7);
+  }
+  return string_printf("%s-%" PRIu64 ".pcapng", base.c_str(), t);
+}
+
+void PcapngWriter::open_file() {
+  this->file_start_time = now();
+  string filename = this->filename_for_time(this->file_start_time);
+  this->f = fopen_unique(filename, "wb");
+
+  SectionHeaderBlock shb;
+  shb.type = BLOCK_TYPE_SECTION_HEADER;
+  shb.size = sizeof(SectionHeaderBlock);
+  shb.byte_order_magic = 0x1A2B3C4D;
+  shb.major_version = 1;
+  shb.minor_version = 0;
+  shb.section_size = 0xFFFFFFFFFFFFFFFF; // Unknown
+  shb.size2 = sizeof(SectionHeaderBlock);
+  fwritex(this->f.get(), &shb, sizeof(shb));
+
+  this->file_bytes = sizeof(shb);
+  this->file_interface_count = 0;
+  log(INFO, "[PcapngWriter] Writing capture to %s", filename.c_str());
+}
+
+void PcapngWriter::write_thread_fn() {
+  string blocks;
+  vector<string> new_interface_names;
+  for (;;) {
+    bool exiting;
+    {
+      unique_lock<mutex> g(this->lock);
+      this->cv.wait(g, [&]() -> bool {
+        return this->should_exit || !this->pending_blocks.empty();
+      });
+      exiting = this->should_exit;
+      // blocks is empty here, so this hands its capacity back to the producers
+      blocks.swap(this->pending_blocks);
+
+      // Rotation only happens when there's something to write, so we don't
+      // create empty files while the server is idle
+      if (this->f && !blocks.empty()) {
+        if ((this->rotate_bytes && (this->file_bytes >= this->rotate_bytes)) ||
+            (this->rotate_usecs && (now() - this->file_start_time >= this->rotate_usecs))) {
+          this->f.reset();
+        }
+      }
+
+      size_t first_new_interface = this->f ? this->file_interface_count : 0;
+      new_interface_names.assign(
+          this->interface_names.begin() + first_new_interface,
+          this->interface_names.end());
+    }
+
+    try {
+      if (!this->f) {
+        this->open_file();
+      }
+
+      // Interface descriptions have to appear in the file before any packets
+      // that refer to them. All interfaces referenced by the blocks we just
+      // took were added before those blocks, so they're all in this list.
+      for (const auto& name : new_interface_names) {
+        size_t block_size = sizeof(InterfaceDescriptionBlockHeader) +
+            sizeof(BlockOptionHeader) + pad4(name.size()) +
+            sizeof(BlockOptionHeader) + sizeof(le_uint32_t);
+        string block(block_size, '\0');
+        char* data = block.data();
+
+        InterfaceDescriptionBlockHeader header;
+        header.type = BLOCK_TYPE_INTERFACE_DESCRIPTION;
+        header.size = block_size;
+        header.link_type = LINK_TYPE_ETHERNET;
+        header.reserved = 0;
+        header.snap_len = 0;
+        memcpy(data, &header, sizeof(header));
+        data += sizeof(header);
+
+        BlockOptionHeader name_option;
+        name_option.code = OPTION_IF_NAME;
+        name_option.size = name.size();
+        memcpy(data, &name_option, sizeof(name_option));
+        data += sizeof(name_option);
+        memcpy(data, name.data(), name.size());
+        data += pad4(name.size());
+
+        BlockOptionHeader end_option;
+        end_option.code = OPTION_END;
+        end_option.size = 0;
+        memcpy(data, &end_option, sizeof(end_option));
+        data += sizeof(end_option);
+
+        le_uint32_t trailer_size = block_size;
+        memcpy(data, &trailer_size, sizeof(trailer_size));
+
+        fwritex(this->f.get(), block);
+        this->file_bytes += block.size();
+        this->file_interface_count++;
+      }
+
+      if (!blocks.empty()) {
+        fwritex(this->f.get(), blocks);
+        this->file_bytes += blocks.size();
+      }
+      fflush(this->f.get());
+
+    } catch (const exception& e) {
+      log(ERROR, "[PcapngWriter] Failed to write capture data: %s", e.what());
+      this->f.reset();
+    }
+    blocks.clear();
+
+    if (exiting) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Writes captured Ethernet frames to pcapng files, which can be opened in
+// Wireshark, tcpdump, etc. Packets are serialized into a memory buffer on the
+// calling thread and written to disk by a background thread, so capturing
+// doesn't block the event loop on file I/O. If the background thread falls
+// behind by more than max_buffered_bytes, new packets are dropped (and
+// counted) instead of growing the buffer without bound.
+//
+// Each interface (one per IPStackSimulator client) gets its own Interface
+// Description Block. If rotation is enabled, a new file is started when the
+// current file exceeds rotate_bytes or is older than rotate_usecs; every file
+// begins with a Section Header Block and all interfaces' descriptions, so each
+// file can be opened independently.
+class PcapngWriter {
+public:
+  PcapngWriter(
+      const std::string& filename,
+      size_t rotate_bytes = 0,
+      uint64_t rotate_usecs = 0,
+      size_t max_buffered_bytes = 0x1000000);
+  PcapngWriter(const PcapngWriter&) = delete;
+  PcapngWriter(PcapngWriter&&) = delete;
+  PcapngWriter& operator=(const PcapngWriter&) = delete;
+  PcapngWriter& operator=(PcapngWriter&&) = delete;
+  ~PcapngWriter();
+
+  // Returns the interface ID to pass to write_packet
+  uint32_t add_interface(const std::string& name);
+
+  void write_packet(uint32_t interface_id, const void* data, size_t size);
+  void write_packet(uint32_t interface_id, const std::string& data);
+
+  inline size_t dropped_packet_count() const {
+    return this->dropped_packets;
+  }
+
+private:
+  std::string filename;
+  size_t rotate_bytes;
+  uint64_t rotate_usecs;
+  size_t max_buffered_bytes;
+
+  // These are protected by this->lock
+  std::mutex lock;
+  std::condition_variable cv;
+  std::string pending_blocks;
+  std::vector<std::string> interface_names;
+  bool should_exit;
+
+  std::atomic<size_t> dropped_packets;
+
+  // These are only used by the writer thread
+  std::unique_ptr<FILE, void(*)(FILE*)> f;
+  size_t file_bytes;
+  uint64_t file_start_time;
+  size_t file_interface_count;
+
+  std::thread writer_thread;
+
+  std::string filename_for_time(uint64_t t) const;
+  void open_file();
+  void write_thread_fn();
+};
@@ -413,7 +413,7 @@ static bool process_server_B2(shared_ptr<ServerState>,
     ProxyServer::LinkedSession& session, uint16_t, uint32_t flag, string& data) {
   if (session.save_files) {
     string output_filename = string_printf("code.%" PRId64 ".bin", now());
-    save_file(output_filename, data);
+    session.write_capture_file(output_filename, string(data));
     session.log(INFO, "Wrote code from server to file %s", output_filename.c_str());
 
 #ifdef HAVE_RESOURCE_FILE
@@ -457,13 +457,12 @@ static bool process_server_B2(shared_ptr<ServerState>,
           &labels);
 
       output_filename = string_printf("code.%" PRId64 ".txt", now());
-      {
-        auto f = fopen_unique(output_filename, "wt");
-        fprintf(f.get(), "// code_size = 0x%" PRIX32 "\n", header.code_size.load());
-        fprintf(f.get(), "// checksum_addr = 0x%" PRIX32 "\n", header.checksum_start.load());
-        fprintf(f.get(), "// checksum_size = 0x%" PRIX32 "\n", header.checksum_size.load());
-        fwritex(f.get(), disassembly);
-      }
+      string file_data = string_printf(
+          "// code_size = 0x%" PRIX32 "\n// checksum_addr = 0x%" PRIX32 "\n// checksum_size = 0x%" PRIX32 "\n",
+          header.code_size.load(), header.checksum_start.load(),
+          header.checksum_size.load());
+      file_data += disassembly;
+      session.write_capture_file(output_filename, move(file_data));
       session.log(INFO, "Wrote disassembly to file %s", output_filename.c_str());
 
     } catch (const exception& e) {
@@ -488,7 +487,7 @@ static bool process_server_E7(shared_ptr<ServerState>,
     ProxyServer::LinkedSession& session, uint16_t, uint32_t, string& data) {
   if (session.save_files) {
     string output_filename = string_printf("player.%" PRId64 ".bin", now());
-    save_file(output_filename, data);
+    session.write_capture_file(output_filename, string(data));
     session.log(INFO, "Wrote player data to file %s", output_filename.c_str());
   }
   return true;
@@ -594,6 +593,11 @@ static bool process_server_game_19_patch_14(shared_ptr<ServerState>,
     return false;
 
   } else {
+    // The client will disconnect and reconnect to the proxy, which will then
+    // connect to the new destination; start connecting now so the client
+    // doesn't have to wait as long
+    session.shard->upstream_pool->prewarm(session.next_destination);
+
     // If the client is on a virtual connection (fd < 0), only change
     // the port (so we'll know which version to treat the next
     // connection as). It's better to leave the address as-is so we
@@ -641,8 +645,9 @@ static bool process_server_60_62_6C_6D_C9_CB(shared_ptr<ServerState>,
         string filename = string_printf("map%08" PRIX32 ".%" PRIu64 ".mnmd",
             subs[3].dword.load(), now());
         string map_data = prs_decompress(data.substr(0x14));
-        save_file(filename, map_data);
-        session.log(INFO, "Wrote %zu bytes to %s", map_data.size(), filename.c_str());
+        size_t map_data_size = map_data.size();
+        session.write_capture_file(filename, move(map_data));
+        session.log(INFO, "Wrote %zu bytes to %s", map_data_size, filename.c_str());
       }
     }
   }
@@ -671,7 +676,8 @@ static bool process_server_44_A6(shared_ptr<ServerState>,
     }
 
     ProxyServer::LinkedSession::SavingFile sf(
-        cmd.filename, output_filename, cmd.file_size);
+        cmd.filename, output_filename, cmd.file_size,
+        session.open_capture_file(output_filename));
     session.saving_files.emplace(cmd.filename, move(sf));
     session.log(INFO, "Opened file %s", output_filename.c_str());
   }
@@ -699,7 +705,7 @@ static bool process_server_13_A7(shared_ptr<ServerState>,
     }
 
     session.log(INFO, "Writing %zu bytes to %s", bytes_to_write, sf->output_filename.c_str());
-    fwritex(sf->f.get(), cmd.data, bytes_to_write);
+    sf->f->write(cmd.data, bytes_to_write);
     if (bytes_to_write > sf->remaining_bytes) {
       session.log(WARNING, "Chunk size extends beyond original file size; file may be truncated");
       sf->remaining_bytes = 0;
@@ -731,7 +737,7 @@ static bool process_server_gc_B8(shared_ptr<ServerState>,
     }
 
     string output_filename = string_printf("cardupdate.%" PRIu64 ".mnr", now());
-    save_file(output_filename, r.read(size));
+    session.write_capture_file(output_filename, r.read(size));
     session.log(INFO, "Wrote %zu bytes to %s", size, output_filename.c_str());
   }
   return true;
@@ -1236,6 +1242,11 @@ static process_command_t get_handler(GameVersion version, bool from_server, uint
   return (from_server ? server_handlers : client_handlers)[version_index][command];
 }
 
+bool proxy_command_has_handler(
+    GameVersion version, bool from_server, uint16_t command) {
+  return get_handler(version, from_server, command) != process_default;
+}
+
 void process_proxy_command(
     shared_ptr<ServerState> s,
     ProxyServer::LinkedSession& session,
@@ -16,3 +16,8 @@ void process_proxy_command(
     uint16_t command,
     uint32_t flag,
     std::string& data);
+
+// Returns false if commands with this number are forwarded without being
+// inspected or modified by the proxy (that is, if they have no handler)
+bool proxy_command_has_handler(
+    GameVersion version, bool from_server, uint16_t command);
@@ -42,6 +42,14 @@ static void flush_and_free_bufferevent(struct bufferevent* bev) {
   bufferevent_free(bev);
 }
 
+// Unlicensed session IDs are allocated so that shard_for_session_id maps each
+// one back to the shard that allocated it; this returns the lowest such ID for
+// the given shard.
+static uint64_t first_unlicensed_session_id(size_t shard_index, size_t num_shards) {
+  static const uint64_t base_id = 0xFF00000000000001;
+  return base_id + ((shard_index + num_shards - (base_id % num_shards)) % num_shards);
+}
+
 
 
 ProxyServer::ProxyServer(
@@ -50,21 +58,93 @@ ProxyServer::ProxyServer(
   : log("[ProxyServer] "),
     base(base),
     state(state),
-    next_unlicensed_session_id(0xFF00000000000001) { }
+    file_writer(new AsyncFileWriter()) {
+  size_t num_threads = this->state->proxy_worker_threads;
+  if (num_threads == 0) {
+    this->shards.emplace_back(new Shard(this, 0, this->base, false));
+  } else {
+    for (size_t z = 0; z < num_threads; z++) {
+      this->shards.emplace_back(new Shard(this, z, this->base, true));
+      this->state->event_loop_lag_monitors.emplace_back(
+          this->shards.back()->thread->get_lag_monitor());
+    }
+    for (auto& shard : this->shards) {
+      shard->thread->start();
+    }
+    this->log(INFO, "Running %zu proxy worker threads", num_threads);
+  }
+
+  // Keep unused connections open to all the configured destinations, if
+  // enabled. The threads are already running, so this has to be done on each
+  // shard's thread, but the names are resolved here so each name is only
+  // resolved once.
+  if (this->state->proxy_prewarm_destinations) {
+    vector<pair<string, uint16_t>> netlocs = this->state->proxy_destinations_pc;
+    netlocs.insert(netlocs.end(), this->state->proxy_destinations_gc.begin(),
+        this->state->proxy_destinations_gc.end());
+    netlocs.emplace_back(this->state->proxy_destination_patch);
+    netlocs.emplace_back(this->state->proxy_destination_bb);
+
+    vector<struct sockaddr_storage> dests;
+    for (const auto& netloc : netlocs) {
+      if (netloc.first.empty() || !netloc.second) {
+        continue;
+      }
+      try {
+        dests.emplace_back(make_sockaddr_storage(netloc.first, netloc.second).first);
+        this->log(INFO, "Prewarming connections to %s:%hu",
+            netloc.first.c_str(), netloc.second);
+      } catch (const exception& e) {
+        this->log(WARNING, "Cannot resolve proxy destination %s: %s",
+            netloc.first.c_str(), e.what());
+      }
+    }
+    for (auto& shard : this->shards) {
+      shard->call([&]() {
+        for (const auto& dest : dests) {
+          shard->upstream_pool->add_standing_destination(dest);
+        }
+      });
+    }
+  }
+}
+
+ProxyServer::~ProxyServer() {
+  // Stop all the worker threads before destroying the listeners and sessions,
+  // since they're still using them
+  for (auto& shard : this->shards) {
+    shard->thread.reset();
+  }
+}
+
+bool ProxyServer::uses_worker_threads() const {
+  return this->shards.at(0)->thread.get() != nullptr;
+}
+
+ProxyServer::Shard* ProxyServer::shard_for_session_id(uint64_t id) {
+  return this->shards[id % this->shards.size()].get();
+}
 
 void ProxyServer::listen(uint16_t port, GameVersion version,
     const struct sockaddr_storage* default_destination) {
-  shared_ptr<ListeningSocket> socket_obj(new ListeningSocket(
-      this, port, version, default_destination));
-  auto l = this->listeners.emplace(port, socket_obj).first->second;
+  // Listening sockets are distributed across the shards in the order they're
+  // created. The evconnlistener is created on the shard's thread so that all
+  // of its events are only ever touched there.
+  Shard* shard = this->shards[this->listeners.size() % this->shards.size()].get();
+  shared_ptr<ListeningSocket> socket_obj;
+  shard->call([&]() {
+    socket_obj.reset(new ListeningSocket(shard, port, version, default_destination));
+  });
+  this->listeners.emplace(port, socket_obj);
 }
 
 ProxyServer::ListeningSocket::ListeningSocket(
-    ProxyServer* server,
+    Shard* shard,
     uint16_t port,
     GameVersion version,
     const struct sockaddr_storage* default_destination)
-  : server(server),
+  : server(shard->server),
+    shard(shard),
     log(string_printf("[ProxyServer:ListeningSocket:%hu] ", port)),
     port(port),
     fd(::listen("", port, SOMAXCONN)),
@@ -74,7 +154,7 @@ ProxyServer::ListeningSocket::ListeningSocket(
     throw runtime_error("cannot listen on port");
   }
   this->listener.reset(evconnlistener_new(
-      this->server->base.get(),
+      this->shard->base.get(),
       &ProxyServer::ListeningSocket::dispatch_on_listen_accept,
       this,
       LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
@@ -92,8 +172,9 @@ ProxyServer::ListeningSocket::ListeningSocket(
     this->default_destination.ss_family = 0;
   }
 
-  this->log(INFO, "Listening on TCP port %hu (%s) on fd %d",
-      this->port, name_for_version(this->version), static_cast<int>(this->fd));
+  this->log(INFO, "Listening on TCP port %hu (%s) on fd %d (shard %zu)",
+      this->port, name_for_version(this->version), static_cast<int>(this->fd),
+      this->shard->index);
 }
 
 void ProxyServer::ListeningSocket::dispatch_on_listen_accept(
@@ -109,9 +190,9 @@ void ProxyServer::ListeningSocket::dispatch_on_listen_error(
 void ProxyServer::ListeningSocket::on_listen_accept(int fd) {
   this->log(INFO, "Client connected on fd %d (port %hu, version %s)",
       fd, this->port, name_for_version(this->version));
-  auto* bev = bufferevent_socket_new(this->server->base.get(), fd,
+  auto* bev = bufferevent_socket_new(this->shard->base.get(), fd,
       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
-  this->server->on_client_connect(bev, this->port, this->version,
+  this->shard->on_client_connect(bev, this->port, this->version,
       (this->default_destination.ss_family == AF_INET) ? &this->default_destination : nullptr);
 }
 
@@ -125,7 +206,84 @@ void ProxyServer::ListeningSocket::on_listen_error() {
 
 
 
+ProxyServer::LinkRequest::LinkRequest()
+  : bev(nullptr, flush_and_free_bufferevent),
+    fd(-1),
+    pending_input(nullptr, evbuffer_free),
+    pending_output(nullptr, evbuffer_free),
+    local_port(0),
+    version(GameVersion::GC),
+    sub_version(0) {
+  memset(&this->next_destination, 0, sizeof(this->next_destination));
+}
+
+ProxyServer::LinkRequest::~LinkRequest() {
+  if (this->fd >= 0) {
+    close(this->fd);
+  }
+}
+
+
+
+ProxyServer::Shard::Shard(
+    ProxyServer* server,
+    size_t index,
+    shared_ptr<struct event_base> main_base,
+    bool use_thread)
+  : server(server),
+    index(index),
+    log(string_printf("[ProxyServer:Shard:%zu] ", index)),
+    thread(use_thread
+        ? new EventLoopThread(string_printf("proxy-shard-%zu", index))
+        : nullptr),
+    base(use_thread ? this->thread->get_base() : main_base),
+    upstream_pool(new UpstreamConnectionPool(this->base)),
+    commands_processed(0),
+    commands_forwarded(0),
+    sessions_moved_in(0) {
+  this->next_unlicensed_session_id = first_unlicensed_session_id(
+      this->index, max<size_t>(this->server->state->proxy_worker_threads, 1));
+}
+
+ProxyServer::Shard::~Shard() {
+  this->thread.reset();
+}
+
+void ProxyServer::Shard::post(function<void()>&& fn) {
+  if (this->thread) {
+    this->thread->post(move(fn));
+  } else {
+    fn();
+  }
+}
+
+void ProxyServer::Shard::call(const function<void()>& fn) {
+  if (this->thread) {
+    this->thread->call(fn);
+  } else {
+    fn();
+  }
+}
+
+uint64_t ProxyServer::Shard::allocate_unlicensed_session_id() {
+  size_t num_shards = this->server->shards.size();
+  uint64_t ret = this->next_unlicensed_session_id;
+  this->next_unlicensed_session_id += num_shards;
+  if (this->next_unlicensed_session_id < ret) {
+    this->next_unlicensed_session_id = first_unlicensed_session_id(
+        this->index, num_shards);
+  }
+  return ret;
+}
+
+
+
 void ProxyServer::connect_client(struct bufferevent* bev, uint16_t server_port) {
+  if (this->uses_worker_threads()) {
+    flush_and_free_bufferevent(bev);
+    throw logic_error("bufferevent virtual connections cannot be used with proxy worker threads");
+  }
+
   // Look up the listening socket for the given port, and use that game version.
   // We don't support default-destination proxying for virtual connections (yet)
   GameVersion version;
@@ -140,12 +298,34 @@ void ProxyServer::connect_client(struct bufferevent* bev, uint16_t server_port)
 
   this->log(INFO, "Client connected on virtual connection %p (port %hu)", bev,
       server_port);
-  this->on_client_connect(bev, server_port, version, nullptr);
+  this->shards.at(0)->on_client_connect(bev, server_port, version, nullptr);
+}
+
+void ProxyServer::connect_client(int fd, uint16_t server_port) {
+  shared_ptr<ListeningSocket> listener;
+  try {
+    listener = this->listeners.at(server_port);
+  } catch (const out_of_range&) {
+    this->log(INFO, "Virtual connection received on unregistered port %hu; closing it",
+        server_port);
+    close(fd);
+    return;
+  }
+
+  this->log(INFO, "Client connected on virtual connection fd %d (port %hu)", fd,
+      server_port);
+  Shard* shard = listener->shard;
+  GameVersion version = listener->version;
+  shard->post([shard, fd, server_port, version]() {
+    auto* bev = bufferevent_socket_new(shard->base.get(), fd,
+        BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    shard->on_client_connect(bev, server_port, version, nullptr);
+  });
 }
 
 
 
-void ProxyServer::on_client_connect(
+void ProxyServer::Shard::on_client_connect(
     struct bufferevent* bev,
     uint16_t listen_port,
     GameVersion version,
@@ -154,10 +334,7 @@ void ProxyServer::on_client_connect(
   // client, create a linked session immediately and connect to the remote
   // server. This creates a direct session.
   if (default_destination && (version == GameVersion::PATCH)) {
-    uint64_t session_id = this->next_unlicensed_session_id++;
-    if (this->next_unlicensed_session_id == 0) {
-      this->next_unlicensed_session_id = 0xFF00000000000001;
-    }
+    uint64_t session_id = this->allocate_unlicensed_session_id();
 
     auto emplace_ret = this->id_to_session.emplace(session_id, new LinkedSession(
         this, session_id, listen_port, version, *default_destination));
@@ -233,7 +410,7 @@ void ProxyServer::on_client_connect(
 
         static const string expected_first_data("\xB4\x00\x93\x00\x00\x00\x00\x00", 8);
         session->detector_crypt.reset(new PSOBBMultiKeyDetectorEncryption(
-            this->state->bb_private_keys, expected_first_data, cmd.client_key.data(), sizeof(cmd.client_key)));
+            this->server->state->bb_private_keys, expected_first_data, cmd.client_key.data(), sizeof(cmd.client_key)));
         session->crypt_in = session->detector_crypt;
         session->crypt_out.reset(new PSOBBMultiKeyImitatorEncryption(
             session->detector_crypt, cmd.server_key.data(), sizeof(cmd.server_key), true));
@@ -248,8 +425,9 @@ void ProxyServer::on_client_connect(
 
 
 ProxyServer::UnlinkedSession::UnlinkedSession(
-    ProxyServer* server, struct bufferevent* bev, uint16_t local_port, GameVersion version)
-  : server(server),
+    Shard* shard, struct bufferevent* bev, uint16_t local_port, GameVersion version)
+  : server(shard->server),
+    shard(shard),
     log(string_printf("[ProxyServer:UnlinkedSession:%p] ", bev)),
     bev(bev, flush_and_free_bufferevent),
     local_port(local_port),
@@ -340,63 +518,53 @@ void ProxyServer::UnlinkedSession::on_client_input() {
     // doesn't get converted/merged to a linked session
     should_close_unlinked_session = true;
 
-    // Look up the linked session for this license (if any)
-    shared_ptr<LinkedSession> session;
-    try {
-      session = this->server->id_to_session.at(license->serial_number);
-      session->log(INFO, "Resuming linked session from unlinked session");
-
-    } catch (const out_of_range&) {
-      // If there's no open session for this license, then there must be a valid
-      // destination somewhere - either in the client config or in the unlinked
-      // session
-      if (client_config.cfg.magic == CLIENT_CONFIG_MAGIC) {
-        session.reset(new LinkedSession(
-            this->server,
-            this->local_port,
-            this->version,
-            license,
-            client_config));
-        session->log(INFO, "Opened licensed session for unlinked session based on client config");
-      } else if (this->next_destination.ss_family == AF_INET) {
-        session.reset(new LinkedSession(
-            this->server,
-            this->local_port,
-            this->version,
-            license,
-            this->next_destination));
-        session->log(INFO, "Opened licensed session for unlinked session based on unlinked default destination");
-      } else {
-        this->log(ERROR, "Cannot open linked session: no valid destination in client config or unlinked session");
-      }
-    }
+    shared_ptr<LinkRequest> req(new LinkRequest());
+    req->license = license;
+    req->local_port = this->local_port;
+    req->version = this->version;
+    req->next_destination = this->next_destination;
+    req->crypt_in = this->crypt_in;
+    req->crypt_out = this->crypt_out;
+    req->detector_crypt = this->detector_crypt;
+    req->sub_version = sub_version;
+    req->character_name = character_name;
+    req->client_config = client_config;
+    req->login_command_bb = move(login_command_bb);
+    this->crypt_in.reset();
+    this->crypt_out.reset();
+
+    // The linked session for this license (if any) is on the shard that owns
+    // the license's serial number. If that's a different shard, detach the
+    // connection from this shard's event base and send it there along with any
+    // data that hasn't been sent or processed yet.
+    Shard* target_shard = this->server->shard_for_session_id(license->serial_number);
+    if (target_shard == this->shard) {
+      req->bev = move(this->bev);
+      target_shard->link_session(req);
 
-    if (session.get()) {
-      this->server->id_to_session.emplace(license->serial_number, session);
-      if (session->version != this->version) {
-        session->log(ERROR, "Linked session has different game version");
+    } else {
+      struct bufferevent* bev = this->bev.get();
+      req->fd = bufferevent_getfd(bev);
+      if (req->fd < 0) {
+        this->log(ERROR, "Cannot move virtual connection to shard %zu", target_shard->index);
       } else {
-        // Resume the linked session using the unlinked session
-        try {
-          if (this->version == GameVersion::BB) {
-            session->resume(move(this->bev), this->crypt_in, this->crypt_out,
-                this->detector_crypt, move(login_command_bb));
-          } else {
-            session->resume(move(this->bev), this->crypt_in, this->crypt_out,
-                this->detector_crypt, sub_version, character_name);
-          }
-          this->crypt_in.reset();
-          this->crypt_out.reset();
-        } catch (const exception& e) {
-          session->log(ERROR, "Failed to resume linked session: %s", e.what());
-        }
+        bufferevent_disable(bev, EV_READ | EV_WRITE);
+        req->pending_input.reset(evbuffer_new());
+        req->pending_output.reset(evbuffer_new());
+        evbuffer_add_buffer(req->pending_input.get(), bufferevent_get_input(bev));
+        evbuffer_add_buffer(req->pending_output.get(), bufferevent_get_output(bev));
+        bufferevent_setfd(bev, -1);
+        this->log(INFO, "Moving connection to shard %zu", target_shard->index);
+        target_shard->post([target_shard, req]() {
+          target_shard->link_session(req);
+        });
       }
     }
   }
 
   if (should_close_unlinked_session) {
     this->log(INFO, "Closing session");
-    this->server->bev_to_unlinked_session.erase(session_key);
+    this->shard->bev_to_unlinked_session.erase(session_key);
     // At this point, (*this) is destroyed! We must be careful not to touch it.
   }
 }
@@ -409,27 +577,96 @@ void ProxyServer::UnlinkedSession::on_client_error(short events) {
   }
   if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
     this->log(WARNING, "Unlinked client has disconnected");
-    this->server->bev_to_unlinked_session.erase(this->bev.get());
+    this->shard->bev_to_unlinked_session.erase(this->bev.get());
+  }
+}
+
+
+
+void ProxyServer::Shard::link_session(shared_ptr<LinkRequest> req) {
+  if (!req->bev) {
+    // The connection was accepted by a different shard
+    req->bev.reset(bufferevent_socket_new(this->base.get(), req->fd,
+        BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS));
+    req->fd = -1;
+    evbuffer_add_buffer(bufferevent_get_input(req->bev.get()), req->pending_input.get());
+    evbuffer_add_buffer(bufferevent_get_output(req->bev.get()), req->pending_output.get());
+    this->sessions_moved_in++;
+  }
+
+  // Look up the linked session for this license (if any)
+  shared_ptr<LinkedSession> session;
+  try {
+    session = this->id_to_session.at(req->license->serial_number);
+    session->log(INFO, "Resuming linked session from unlinked session");
+
+  } catch (const out_of_range&) {
+    // If there's no open session for this license, then there must be a valid
+    // destination somewhere - either in the client config or in the unlinked
+    // session
+    if (req->client_config.cfg.magic == CLIENT_CONFIG_MAGIC) {
+      session.reset(new LinkedSession(
+          this,
+          req->local_port,
+          req->version,
+          req->license,
+          req->client_config));
+      session->log(INFO, "Opened licensed session for unlinked session based on client config");
+    } else if (req->next_destination.ss_family == AF_INET) {
+      session.reset(new LinkedSession(
+          this,
+          req->local_port,
+          req->version,
+          req->license,
+          req->next_destination));
+      session->log(INFO, "Opened licensed session for unlinked session based on unlinked default destination");
+    } else {
+      this->log(ERROR, "Cannot open linked session: no valid destination in client config or unlinked session");
+    }
+  }
+
+  if (session.get()) {
+    this->id_to_session.emplace(req->license->serial_number, session);
+    if (session->version != req->version) {
+      session->log(ERROR, "Linked session has different game version");
+    } else {
+      // Resume the linked session using the unlinked session
+      try {
+        if (req->version == GameVersion::BB) {
+          session->resume(move(req->bev), req->crypt_in, req->crypt_out,
+              req->detector_crypt, move(req->login_command_bb));
+        } else {
+          session->resume(move(req->bev), req->crypt_in, req->crypt_out,
+              req->detector_crypt, req->sub_version, req->character_name);
+        }
+      } catch (const exception& e) {
+        session->log(ERROR, "Failed to resume linked session: %s", e.what());
+      }
+    }
   }
 }
 
 
 
 ProxyServer::LinkedSession::LinkedSession(
-    ProxyServer* server,
+    Shard* shard,
     uint64_t id,
     uint16_t local_port,
     GameVersion version)
-  : server(server),
+  : server(shard->server),
+    shard(shard),
     id(id),
     client_name(string_printf("LinkedSession:%08" PRIX64 ":client", this->id)),
     server_name(string_printf("LinkedSession:%08" PRIX64 ":server", this->id)),
     log(string_printf("[ProxyServer:LinkedSession:%08" PRIX64 "] ", this->id)),
-    timeout_event(event_new(this->server->base.get(), -1, EV_TIMEOUT,
+    timeout_event(event_new(this->shard->base.get(), -1, EV_TIMEOUT,
         &LinkedSession::dispatch_on_timeout, this), event_free),
+    resume_server_input_event(event_new(this->shard->base.get(), -1, EV_TIMEOUT,
+        &LinkedSession::dispatch_on_resume_server_input, this), event_free),
     license(nullptr),
     client_bev(nullptr, flush_and_free_bufferevent),
     server_bev(nullptr, flush_and_free_bufferevent),
+    server_connect_start_time(0),
     local_port(local_port),
     remote_ip_crc(0),
     enable_remote_ip_crc_patch(false),
@@ -447,18 +684,19 @@ ProxyServer::LinkedSession::LinkedSession(
     override_lobby_event(-1),
     override_lobby_number(-1),
     lobby_players(12),
-    lobby_client_id(0) {
+    lobby_client_id(0),
+    file_writer_account(new AsyncFileWriter::Account()) {
   this->last_switch_enabled_command.subcommand = 0;
   memset(this->prev_server_command_bytes, 0, sizeof(this->prev_server_command_bytes));
 }
 
 ProxyServer::LinkedSession::LinkedSession(
-    ProxyServer* server,
+    Shard* shard,
     uint16_t local_port,
     GameVersion version,
     shared_ptr<const License> license,
     const ClientConfigBB& newserv_client_config)
-  : LinkedSession(server, license->serial_number, local_port, version) {
+  : LinkedSession(shard, license->serial_number, local_port, version) {
   this->license = license;
   this->newserv_client_config = newserv_client_config;
   memset(&this->next_destination, 0, sizeof(this->next_destination));
@@ -469,23 +707,23 @@ ProxyServer::LinkedSession::LinkedSession(
 }
 
 ProxyServer::LinkedSession::LinkedSession(
-    ProxyServer* server,
+    Shard* shard,
     uint16_t local_port,
     GameVersion version,
     std::shared_ptr<const License> license,
     const struct sockaddr_storage& next_destination)
-  : LinkedSession(server, license->serial_number, local_port, version) {
+  : LinkedSession(shard, license->serial_number, local_port, version) {
   this->license = license;
   this->next_destination = next_destination;
 }
 
 ProxyServer::LinkedSession::LinkedSession(
-    ProxyServer* server,
+    Shard* shard,
     uint64_t id,
     uint16_t local_port,
     GameVersion version,
     const struct sockaddr_storage& destination)
-  : LinkedSession(server, id, local_port, version) {
+  : LinkedSession(shard, id, local_port, version) {
   this->next_destination = destination;
 }
 
@@ -552,30 +790,24 @@ void ProxyServer::LinkedSession::resume_inner(
 void ProxyServer::LinkedSession::connect() {
   // Connect to the remote server. The command handlers will do the login steps
   // and set up forwarding
-  this->server_bev.reset(bufferevent_socket_new(this->server->base.get(), -1,
-      BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS));
-
-  struct sockaddr_storage local_ss;
-  struct sockaddr_in* local_sin = reinterpret_cast<struct sockaddr_in*>(&local_ss);
-  memset(local_sin, 0, sizeof(*local_sin));
-  local_sin->sin_family = AF_INET;
   const struct sockaddr_in* dest_sin = reinterpret_cast<const sockaddr_in*>(&this->next_destination);
   if (dest_sin->sin_family != AF_INET) {
     throw logic_error("ss not AF_INET");
   }
-  local_sin->sin_port = dest_sin->sin_port;
-  local_sin->sin_addr.s_addr = dest_sin->sin_addr.s_addr;
 
-  string netloc_str = render_sockaddr_storage(local_ss);
+  string netloc_str = render_sockaddr_storage(this->next_destination);
   this->log(INFO, "Connecting to %s", netloc_str.c_str());
-  if (bufferevent_socket_connect(this->server_bev.get(),
-      reinterpret_cast<const sockaddr*>(local_sin), sizeof(*local_sin)) != 0) {
-    throw runtime_error(string_printf("failed to connect (%d)", EVUTIL_SOCKET_ERROR()));
-  }
+  // If the connection was opened ahead of time, the server may have already
+  // sent its first command
+  this->server_bev = this->shard->upstream_pool->connect(
+      this->next_destination, &this->server_connect_start_time);
   bufferevent_setcb(this->server_bev.get(),
       &ProxyServer::LinkedSession::dispatch_on_server_input, nullptr,
       &ProxyServer::LinkedSession::dispatch_on_server_error, this);
   bufferevent_enable(this->server_bev.get(), EV_READ | EV_WRITE);
+  if (evbuffer_get_length(bufferevent_get_input(this->server_bev.get()))) {
+    bufferevent_trigger(this->server_bev.get(), EV_READ, 0);
+  }
 
   // Cancel the session delete timeout
   event_del(this->timeout_event.get());
@@ -586,11 +818,37 @@ void ProxyServer::LinkedSession::connect() {
 ProxyServer::LinkedSession::SavingFile::SavingFile(
     const string& basename,
     const string& output_filename,
-    uint32_t remaining_bytes)
+    uint32_t remaining_bytes,
+    shared_ptr<AsyncFileWriter::File> f)
   : basename(basename),
     output_filename(output_filename),
     remaining_bytes(remaining_bytes),
-    f(fopen_unique(this->output_filename, "wb")) { }
+    f(f) { }
+
+shared_ptr<AsyncFileWriter::File> ProxyServer::LinkedSession::open_capture_file(
+    const string& filename) {
+  return this->server->file_writer->open(filename, this->file_writer_account);
+}
+
+void ProxyServer::LinkedSession::write_capture_file(
+    const string& filename, string&& data) {
+  this->server->file_writer->write_file(
+      filename, move(data), this->file_writer_account);
+}
+
+bool ProxyServer::LinkedSession::throttle_server_input_for_capture() {
+  if (!this->server_bev ||
+      !this->server->file_writer->should_throttle(*this->file_writer_account)) {
+    return false;
+  }
+  if (!event_pending(this->resume_server_input_event.get(), EV_TIMEOUT, nullptr)) {
+    this->log(WARNING, "Too much captured data is waiting to be written; pausing server input");
+    bufferevent_disable(this->server_bev.get(), EV_READ);
+    struct timeval tv = usecs_to_timeval(10000);
+    event_add(this->resume_server_input_event.get(), &tv);
+  }
+  return true;
+}
 
 
 
@@ -619,17 +877,43 @@ void ProxyServer::LinkedSession::dispatch_on_timeout(
   reinterpret_cast<LinkedSession*>(ctx)->on_timeout();
 }
 
+void ProxyServer::LinkedSession::dispatch_on_resume_server_input(
+    evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<LinkedSession*>(ctx)->on_resume_server_input();
+}
+
 
 
 void ProxyServer::LinkedSession::on_timeout() {
   this->log(INFO, "Session timed out");
-  this->server->delete_session(this->id);
+  this->shard->delete_session(this->id);
+}
+
+void ProxyServer::LinkedSession::on_resume_server_input() {
+  if (!this->server_bev) {
+    return;
+  }
+  if (this->server->file_writer->should_throttle(*this->file_writer_account)) {
+    struct timeval tv = usecs_to_timeval(10000);
+    event_add(this->resume_server_input_event.get(), &tv);
+  } else {
+    this->log(INFO, "Captured data has been written; resuming server input");
+    bufferevent_enable(this->server_bev.get(), EV_READ);
+    // There may be complete commands in the input buffer already
+    this->on_server_input();
+  }
 }
 
 
 
 void ProxyServer::LinkedSession::on_stream_error(
     short events, bool is_server_stream) {
+  if (is_server_stream && this->server_connect_start_time &&
+      (events & (BEV_EVENT_CONNECTED | BEV_EVENT_ERROR | BEV_EVENT_EOF))) {
+    this->shard->upstream_pool->record_connect_result(
+        this->server_connect_start_time, events & BEV_EVENT_CONNECTED);
+    this->server_connect_start_time = 0;
+  }
   if (events & BEV_EVENT_ERROR) {
     int err = EVUTIL_SOCKET_ERROR();
     this->log(WARNING, "Error %d (%s) in %s stream",
@@ -647,6 +931,7 @@ void ProxyServer::LinkedSession::disconnect() {
   // Forward the disconnection to the other end
   this->server_bev.reset();
   this->client_bev.reset();
+  event_del(this->resume_server_input_event.get());
 
   // Disable encryption for the next connection
   this->server_input_crypt.reset();
@@ -668,19 +953,29 @@ bool ProxyServer::LinkedSession::is_connected() const {
 
 
 void ProxyServer::LinkedSession::on_client_input() {
+  auto process_command = [&](uint16_t command, uint32_t flag, string& data) {
+    print_received_command(command, flag, data.data(), data.size(),
+        this->version, this->client_name.c_str());
+    this->shard->commands_processed++;
+    process_proxy_command(
+        this->server->state,
+        *this,
+        false, // from_server
+        command,
+        flag,
+        data);
+  };
+
   try {
-    for_each_received_command(this->client_bev.get(), this->version, this->client_input_crypt.get(),
-      [&](uint16_t command, uint32_t flag, string& data) {
-        print_received_command(command, flag, data.data(), data.size(),
-            this->version, this->client_name.c_str());
-        process_proxy_command(
-            this->server->state,
-            *this,
-            false, // from_server
-            command,
-            flag,
-            data);
-      });
+    // The handler may disconnect the session, so we have to check for that
+    // after each command
+    while (this->client_bev) {
+      while (this->forward_unhandled_command(false)) { }
+      if (!receive_command(this->client_bev.get(), this->version,
+          this->client_input_crypt.get(), process_command)) {
+        break;
+      }
+    }
   } catch (const exception& e) {
     this->log(ERROR, "Failed to process command from client: %s", e.what());
     this->disconnect();
@@ -688,27 +983,106 @@ void ProxyServer::LinkedSession::on_client_input() {
 }
 
 void ProxyServer::LinkedSession::on_server_input() {
+  auto process_command = [&](uint16_t command, uint32_t flag, string& data) {
+    print_received_command(command, flag, data.data(), data.size(),
+        this->version, this->server_name.c_str(), TerminalFormat::FG_RED);
+    size_t bytes_to_save = min<size_t>(data.size(), sizeof(this->prev_server_command_bytes));
+    memcpy(this->prev_server_command_bytes, data.data(), bytes_to_save);
+    this->shard->commands_processed++;
+    process_proxy_command(
+        this->server->state,
+        *this,
+        true, // from_server
+        command,
+        flag,
+        data);
+  };
+
   try {
-    for_each_received_command(this->server_bev.get(), this->version, this->server_input_crypt.get(),
-      [&](uint16_t command, uint32_t flag, string& data) {
-        print_received_command(command, flag, data.data(), data.size(),
-            this->version, this->server_name.c_str(), TerminalFormat::FG_RED);
-        size_t bytes_to_save = min<size_t>(data.size(), sizeof(this->prev_server_command_bytes));
-        memcpy(this->prev_server_command_bytes, data.data(), bytes_to_save);
-        process_proxy_command(
-            this->server->state,
-            *this,
-            true, // from_server
-            command,
-            flag,
-            data);
-      });
+    while (this->server_bev && !this->throttle_server_input_for_capture()) {
+      while (this->forward_unhandled_command(true)) { }
+      if (!receive_command(this->server_bev.get(), this->version,
+          this->server_input_crypt.get(), process_command)) {
+        break;
+      }
+    }
   } catch (const exception& e) {
     this->log(ERROR, "Failed to process command from server: %s", e.what());
     this->disconnect();
   }
 }
 
+bool ProxyServer::LinkedSession::forward_unhandled_command(bool from_server) {
+  // If fast passthrough is enabled, commands that the proxy doesn't need to
+  // look at are moved directly from one end's input buffer to the other end's
+  // output buffer. Instead of decrypting each command into a string and then
+  // re-encrypting it (as the normal path does), we convert the ciphertext from
+  // one cipher to the other in place. This only works for ciphers whose
+  // keystreams don't depend on the data, so BB sessions always use the normal
+  // path. Commands forwarded this way are not printed.
+  if (!this->server->state->proxy_fast_passthrough) {
+    return false;
+  }
+  auto* src_bev = from_server ? this->server_bev.get() : this->client_bev.get();
+  auto* dest_bev = from_server ? this->client_bev.get() : this->server_bev.get();
+  auto* in_crypt = from_server ? this->server_input_crypt.get() : this->client_input_crypt.get();
+  auto* out_crypt = from_server ? this->client_output_crypt.get() : this->server_output_crypt.get();
+  if (!src_bev || !dest_bev || !in_crypt || !out_crypt ||
+      !in_crypt->has_data_independent_keystream() ||
+      !out_crypt->has_data_independent_keystream()) {
+    return false;
+  }
+
+  struct evbuffer* src_buf = bufferevent_get_input(src_bev);
+  size_t header_size = PSOCommandHeader::header_size(this->version);
+  PSOCommandHeader header;
+  if (evbuffer_copyout(src_buf, &header, header_size)
+      < static_cast<ssize_t>(header_size)) {
+    return false;
+  }
+  in_crypt->decrypt(&header, header_size, false);
+
+  // Commands that are malformed or too large to send are left for the normal
+  // path, which reports the appropriate error
+  size_t size = header.size(this->version);
+  if ((size < header_size) || (size & 3) || (size > 0x7C00) ||
+      (evbuffer_get_length(src_buf) < size) ||
+      proxy_command_has_handler(this->version, from_server, header.command(this->version))) {
+    return false;
+  }
+
+  // The header and the beginning of the command are decrypted normally, since
+  // we need to remember the first few bytes of each server command (see
+  // process_server_game_19_patch_14)
+  uint8_t head[12];
+  size_t head_size = min<size_t>(size, sizeof(head));
+  evbuffer_remove(src_buf, head, head_size);
+  in_crypt->decrypt(head, head_size);
+  if (from_server) {
+    size_t bytes_to_save = min<size_t>(
+        head_size - header_size, sizeof(this->prev_server_command_bytes));
+    memcpy(this->prev_server_command_bytes, head + header_size, bytes_to_save);
+  }
+  out_crypt->encrypt(head, head_size);
+
+  struct evbuffer* dest_buf = bufferevent_get_output(dest_bev);
+  evbuffer_add(dest_buf, head, head_size);
+
+  size_t rest_size = size - head_size;
+  if (rest_size) {
+    struct evbuffer_iovec iov;
+    if (evbuffer_reserve_space(dest_buf, rest_size, &iov, 1) != 1) {
+      throw runtime_error("cannot reserve space in output buffer");
+    }
+    evbuffer_remove(src_buf, iov.iov_base, rest_size);
+    rekey_stream_cipher_data(*in_crypt, *out_crypt, iov.iov_base, rest_size);
+    iov.iov_len = rest_size;
+    evbuffer_commit_space(dest_buf, &iov, 1);
+  }
+  this->shard->commands_forwarded++;
+  return true;
+}
+
 void ProxyServer::LinkedSession::send_to_end(
     bool to_server,
     uint16_t command,
@@ -761,30 +1135,59 @@ void ProxyServer::LinkedSession::send_to_end_with_header(
   this->send_to_end_with_header(to_server, data.data(), data.size());
 }
 
-shared_ptr<ProxyServer::LinkedSession> ProxyServer::get_session() {
-  if (this->id_to_session.empty()) {
-    throw runtime_error("no sessions exist");
+void ProxyServer::call_on_session(
+    const function<void(shared_ptr<LinkedSession>)>& fn) {
+  // Find the shard that has a session without touching any other shard's
+  // sessions, then look up the session again on its own thread (it may have
+  // been deleted in the meantime)
+  Shard* session_shard = nullptr;
+  for (const auto& stats : this->get_shard_stats()) {
+    if (stats.linked_session_count == 0) {
+      continue;
+    }
+    if (session_shard || (stats.linked_session_count > 1)) {
+      throw runtime_error("multiple sessions exist");
+    }
+    session_shard = this->shards[stats.index].get();
   }
-  if (this->id_to_session.size() > 1) {
-    throw runtime_error("multiple sessions exist");
+  if (!session_shard) {
+    throw runtime_error("no sessions exist");
   }
-  return this->id_to_session.begin()->second;
+
+  session_shard->call([&]() {
+    if (session_shard->id_to_session.size() != 1) {
+      throw runtime_error("session was closed or opened during lookup");
+    }
+    fn(session_shard->id_to_session.begin()->second);
+  });
 }
 
-shared_ptr<ProxyServer::LinkedSession> ProxyServer::create_licensed_session(
+void ProxyServer::create_licensed_session(
     shared_ptr<const License> l, uint16_t local_port, GameVersion version,
     const ClientConfigBB& newserv_client_config) {
-  shared_ptr<LinkedSession> session(new LinkedSession(
-      this, local_port, version, l, newserv_client_config));
-  auto emplace_ret = this->id_to_session.emplace(session->id, session);
-  if (!emplace_ret.second) {
-    throw runtime_error("session already exists for this license");
-  }
-  session->log(INFO, "Opening licensed session");
-  return emplace_ret.first->second;
+  Shard* shard = this->shard_for_session_id(l->serial_number);
+  shard->post([shard, l, local_port, version, newserv_client_config]() {
+    shared_ptr<LinkedSession> session(new LinkedSession(
+        shard, local_port, version, l, newserv_client_config));
+    auto emplace_ret = shard->id_to_session.emplace(session->id, session);
+    if (!emplace_ret.second) {
+      throw runtime_error("session already exists for this license");
+    }
+    session->log(INFO, "Opening licensed session");
+    // The client will reconnect and the session will connect to the remote
+    // server shortly, so start connecting now
+    shard->upstream_pool->prewarm(session->next_destination);
+  });
 }
 
 void ProxyServer::delete_session(uint64_t id) {
+  Shard* shard = this->shard_for_session_id(id);
+  shard->post([shard, id]() {
+    shard->delete_session(id);
+  });
+}
+
+void ProxyServer::Shard::delete_session(uint64_t id) {
   if (this->id_to_session.erase(id)) {
     this->log(INFO, "Closed LinkedSession:%08" PRIX64, id);
   }
@@ -792,13 +1195,35 @@ void ProxyServer::delete_session(uint64_t id) {
 
 size_t ProxyServer::delete_disconnected_sessions() {
   size_t count = 0;
-  for (auto it = this->id_to_session.begin(); it != this->id_to_session.end();) {
-    if (!it->second->is_connected()) {
-      it = this->id_to_session.erase(it);
-      count++;
-    } else {
-      it++;
-    }
+  for (auto& shard : this->shards) {
+    shard->call([&]() {
+      auto& id_to_session = shard->id_to_session;
+      for (auto it = id_to_session.begin(); it != id_to_session.end();) {
+        if (!it->second->is_connected()) {
+          it = id_to_session.erase(it);
+          count++;
+        } else {
+          it++;
+        }
+      }
+    });
   }
   return count;
 }
+
+vector<ProxyServer::ShardStats> ProxyServer::get_shard_stats() {
+  vector<ShardStats> ret;
+  for (auto& shard : this->shards) {
+    auto& stats = ret.emplace_back();
+    shard->call([&]() {
+      stats.index = shard->index;
+      stats.linked_session_count = shard->id_to_session.size();
+      stats.unlinked_session_count = shard->bev_to_unlinked_session.size();
+      stats.commands_processed = shard->commands_processed;
+      stats.commands_forwarded = shard->commands_forwarded;
+      stats.sessions_moved_in = shard->sessions_moved_in;
+      stats.upstream = shard->upstream_pool->get_stats();
+    });
+  }
+  return ret;
+}
@@ -11,12 +11,23 @@
 #include <memory>
 #include <phosg/Filesystem.hh>
 
+#include "AsyncFileWriter.hh"
+#include "EventLoopThread.hh"
 #include "PSOEncryption.hh"
 #include "PSOProtocol.hh"
 #include "ServerState.hh"
+#include "UpstreamConnectionPool.hh"
 
 
 
+// The proxy's sessions are divided into shards. If state->proxy_worker_threads
+// is zero, there is a single shard that runs on the main event loop; otherwise,
+// each shard runs its own event loop on a separate thread. Linked sessions live
+// on the shard given by their ID (license serial number) modulo the number of
+// shards, so that a client that reconnects always finds its session. Each
+// listening socket belongs to one shard; unlinked sessions live on the shard
+// that accepted the connection, and are moved to the owning shard when they
+// are linked.
 class ProxyServer {
 public:
   ProxyServer() = delete;
@@ -25,26 +36,40 @@ public:
   ProxyServer(
       std::shared_ptr<struct event_base> base,
       std::shared_ptr<ServerState> state);
-  virtual ~ProxyServer() = default;
+  virtual ~ProxyServer();
 
   void listen(uint16_t port, GameVersion version,
       const struct sockaddr_storage* default_destination = nullptr);
 
+  // Virtual connections can only be passed as bufferevents if the proxy runs
+  // on the main event loop (that is, if uses_worker_threads() returns false);
+  // otherwise, the other end of the connection must be a socket.
   void connect_client(struct bufferevent* bev, uint16_t server_port);
+  void connect_client(int fd, uint16_t server_port);
+
+  bool uses_worker_threads() const;
+
+  struct Shard;
 
   struct LinkedSession {
     ProxyServer* server;
+    Shard* shard;
     uint64_t id;
     std::string client_name;
     std::string server_name;
     PrefixedLogger log;
 
     std::unique_ptr<struct event, void(*)(struct event*)> timeout_event;
+    // Used when reading from the server is paused because too much captured
+    // file data (see save_files) is waiting to be written
+    std::unique_ptr<struct event, void(*)(struct event*)> resume_server_input_event;
 
     std::shared_ptr<const License> license;
 
     std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> client_bev;
     std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> server_bev;
+    // Nonzero while server_bev is still connecting
+    uint64_t server_connect_start_time;
     uint16_t local_port;
     struct sockaddr_storage next_destination;
 
@@ -90,35 +115,37 @@ public:
       std::string basename;
       std::string output_filename;
       uint32_t remaining_bytes;
-      std::unique_ptr<FILE, std::function<void(FILE*)>> f;
+      std::shared_ptr<AsyncFileWriter::File> f;
 
       SavingFile(
           const std::string& basename,
           const std::string& output_filename,
-          uint32_t remaining_bytes);
+          uint32_t remaining_bytes,
+          std::shared_ptr<AsyncFileWriter::File> f);
     };
     std::unordered_map<std::string, SavingFile> saving_files;
+    std::shared_ptr<AsyncFileWriter::Account> file_writer_account;
 
     // TODO: This first constructor should be private
     LinkedSession(
-        ProxyServer* server,
+        Shard* shard,
         uint64_t id,
         uint16_t local_port,
         GameVersion version);
     LinkedSession(
-        ProxyServer* server,
+        Shard* shard,
         uint16_t local_port,
         GameVersion version,
         std::shared_ptr<const License> license,
         const ClientConfigBB& newserv_client_config);
     LinkedSession(
-        ProxyServer* server,
+        Shard* shard,
         uint16_t local_port,
         GameVersion version,
         std::shared_ptr<const License> license,
         const struct sockaddr_storage& next_destination);
     LinkedSession(
-        ProxyServer* server,
+        Shard* shard,
         uint64_t id,
         uint16_t local_port,
         GameVersion version,
@@ -154,8 +181,19 @@ public:
     static void dispatch_on_timeout(evutil_socket_t fd, short what, void* ctx);
     void on_client_input();
     void on_server_input();
+    bool forward_unhandled_command(bool from_server);
     void on_stream_error(short events, bool is_server_stream);
     void on_timeout();
+    static void dispatch_on_resume_server_input(evutil_socket_t fd, short what, void* ctx);
+    void on_resume_server_input();
+
+    // Captured files are written on the proxy's file writer thread. These
+    // don't block, but if too much data is waiting to be written, reading from
+    // the server is paused until it has been written.
+    std::shared_ptr<AsyncFileWriter::File> open_capture_file(
+        const std::string& filename);
+    void write_capture_file(const std::string& filename, std::string&& data);
+    bool throttle_server_input_for_capture();
 
     void send_to_end(bool to_server, uint16_t command, uint32_t flag,
         const void* data = nullptr, size_t size = 0);
@@ -170,8 +208,17 @@ public:
     bool is_connected() const;
   };
 
-  std::shared_ptr<LinkedSession> get_session();
-  std::shared_ptr<LinkedSession> create_licensed_session(
+  // Calls fn with the only open session, on the thread that the session's
+  // shard runs on, and waits for it to return. Throws if there are no sessions
+  // or multiple sessions. This is for use by the shell, which runs on the main
+  // thread.
+  void call_on_session(
+      const std::function<void(std::shared_ptr<LinkedSession>)>& fn);
+  // These are called from the main thread. If the proxy uses worker threads,
+  // create_licensed_session and delete_session return before the session has
+  // been created or deleted, but the owning shard handles them in the order
+  // they were called, and before any connection that arrives afterward.
+  void create_licensed_session(
     std::shared_ptr<const License> l,
     uint16_t local_port,
     GameVersion version,
@@ -180,9 +227,92 @@ public:
 
   size_t delete_disconnected_sessions();
 
+  struct ShardStats {
+    size_t index;
+    size_t linked_session_count;
+    size_t unlinked_session_count;
+    uint64_t commands_processed;
+    uint64_t commands_forwarded;
+    uint64_t sessions_moved_in;
+    UpstreamConnectionPool::Stats upstream;
+  };
+  std::vector<ShardStats> get_shard_stats();
+
+private:
+  struct UnlinkedSession;
+
+  // Everything needed to attach a client connection to a linked session. If
+  // the connection is moved from one shard to another, bev is null and the
+  // connection's fd and unsent/unprocessed data are in the following fields
+  // instead, since a bufferevent can't be moved to a different event base.
+  struct LinkRequest {
+    std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> bev;
+    int fd;
+    std::unique_ptr<struct evbuffer, void(*)(struct evbuffer*)> pending_input;
+    std::unique_ptr<struct evbuffer, void(*)(struct evbuffer*)> pending_output;
+
+    std::shared_ptr<const License> license;
+    uint16_t local_port;
+    GameVersion version;
+    struct sockaddr_storage next_destination;
+
+    std::shared_ptr<PSOEncryption> crypt_in;
+    std::shared_ptr<PSOEncryption> crypt_out;
+    std::shared_ptr<PSOBBMultiKeyDetectorEncryption> detector_crypt;
+
+    uint32_t sub_version;
+    std::string character_name;
+    ClientConfigBB client_config;
+    std::string login_command_bb;
+
+    LinkRequest();
+    ~LinkRequest();
+  };
+
+public:
+  struct Shard {
+    ProxyServer* server;
+    size_t index;
+    PrefixedLogger log;
+    // This is null if the shard runs on the main event loop
+    std::unique_ptr<EventLoopThread> thread;
+    std::shared_ptr<struct event_base> base;
+
+    std::unordered_map<struct bufferevent*, std::shared_ptr<UnlinkedSession>> bev_to_unlinked_session;
+    std::unordered_map<uint64_t, std::shared_ptr<LinkedSession>> id_to_session;
+    uint64_t next_unlicensed_session_id;
+    std::unique_ptr<UpstreamConnectionPool> upstream_pool;
+
+    // These are only accessed on the shard's thread; get_shard_stats() reads
+    // them via call()
+    uint64_t commands_processed;
+    uint64_t commands_forwarded;
+    uint64_t sessions_moved_in;
+
+    Shard(ProxyServer* server, size_t index,
+        std::shared_ptr<struct event_base> main_base, bool use_thread);
+    ~Shard();
+
+    // These run fn on the shard's thread. If the shard runs on the main event
+    // loop, fn is called immediately.
+    void post(std::function<void()>&& fn);
+    void call(const std::function<void()>& fn);
+
+    uint64_t allocate_unlicensed_session_id();
+
+    void on_client_connect(
+        struct bufferevent* bev,
+        uint16_t listen_port,
+        GameVersion version,
+        const struct sockaddr_storage* default_destination);
+    void link_session(std::shared_ptr<LinkRequest> req);
+    void delete_session(uint64_t id);
+  };
+
 private:
   struct ListeningSocket {
     ProxyServer* server;
+    Shard* shard;
 
     PrefixedLogger log;
     uint16_t port;
@@ -192,7 +322,7 @@ private:
     struct sockaddr_storage default_destination;
 
     ListeningSocket(
-        ProxyServer* server,
+        Shard* shard,
         uint16_t port,
         GameVersion version,
         const struct sockaddr_storage* default_destination);
@@ -206,6 +336,7 @@ private:
 
   struct UnlinkedSession {
     ProxyServer* server;
+    Shard* shard;
 
     PrefixedLogger log;
     std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> bev;
@@ -217,7 +348,7 @@ private:
     std::shared_ptr<PSOEncryption> crypt_in;
     std::shared_ptr<PSOBBMultiKeyDetectorEncryption> detector_crypt;
 
-    UnlinkedSession(ProxyServer* server, struct bufferevent* bev, uint16_t port, GameVersion version);
+    UnlinkedSession(Shard* shard, struct bufferevent* bev, uint16_t port, GameVersion version);
 
     void receive_and_process_commands();
 
@@ -231,14 +362,13 @@ private:
   PrefixedLogger log;
   std::shared_ptr<struct event_base> base;
   std::shared_ptr<ServerState> state;
+  // This must be destroyed after the shards, since sessions may have files
+  // open on it
+  std::shared_ptr<AsyncFileWriter> file_writer;
+  // The shards must be destroyed after the listeners, since the listeners'
+  // events are on the shards' event bases
+  std::vector<std::unique_ptr<Shard>> shards;
   std::map<int, std::shared_ptr<ListeningSocket>> listeners;
-  std::unordered_map<struct bufferevent*, std::shared_ptr<UnlinkedSession>> bev_to_unlinked_session;
-  std::unordered_map<uint64_t, std::shared_ptr<LinkedSession>> id_to_session;
-  uint64_t next_unlicensed_session_id;
-
-  void on_client_connect(
-      struct bufferevent* bev,
-      uint16_t listen_port,
-      GameVersion version,
-      const struct sockaddr_storage* default_destination);
+
+  Shard* shard_for_session_id(uint64_t id);
 };
@@ -1,24 +1,93 @@
 #include "RareItemSet.hh"
 
+#include <string.h>
+
 #include <phosg/Filesystem.hh>
-#include <phosg/Random.hh>
+#include <phosg/Strings.hh>
 
 using namespace std;
 
 
 
-RareItemSet::RareItemSet(const char* filename, uint8_t episode,
-    uint8_t difficulty, uint8_t secid) {
-  scoped_fd fd(filename, O_RDONLY);
-  size_t offset = (episode * 0x6400) + (difficulty * 0x1900) + (secid * 0x0280);
-  preadx(fd, this, sizeof(*this), offset);
-}
-
-bool sample_rare_item(uint8_t pc) {
+uint32_t rate_for_rare_item_probability(uint8_t pc) {
   int8_t shift = ((pc >> 3) & 0x1F) - 4;
   if (shift < 0) {
     shift = 0;
   }
-  uint32_t rate = ((2 << shift) * ((pc & 7) + 7));
-  return (random_object<uint32_t>() < rate);
+  return ((2 << shift) * ((pc & 7) + 7));
+}
+
+
+
+RareItemSet::RareItemSet(const RareItemSetData& data) {
+  for (size_t x = 0; x < this->enemy_drops.size(); x++) {
+    auto& drop = this->enemy_drops[x];
+    drop.rate = rate_for_rare_item_probability(data.rares[x].probability);
+    memcpy(drop.item_code, data.rares[x].item_code, 3);
+  }
+
+  this->area_to_box_table_index.fill(0xFF);
+  for (size_t x = 0; x < 0x1E; x++) {
+    uint8_t area = data.box_areas[x];
+    if (this->area_to_box_table_index[area] != 0xFF) {
+      continue;
+    }
+
+    // A box rare is dropped only if every box rare before it for the same
+    // area didn't drop, so its overall probability is its own probability
+    // times the probability that none of the earlier ones dropped
+    BoxAreaTable table;
+    vector<double> weights;
+    double none_probability = 1.0;
+    for (size_t z = x; z < 0x1E; z++) {
+      if (data.box_areas[z] != area) {
+        continue;
+      }
+      double p = static_cast<double>(rate_for_rare_item_probability(
+          data.box_rares[z].probability)) / 0x100000000;
+      weights.emplace_back(none_probability * p);
+      none_probability *= (1.0 - p);
+      auto& code = table.item_codes.emplace_back();
+      memcpy(code.data(), data.box_rares[z].item_code, 3);
+    }
+    weights.emplace_back(none_probability);
+    table.outcomes = AliasTable(weights);
+
+    this->area_to_box_table_index[area] = this->box_area_tables.size();
+    this->box_area_tables.emplace_back(move(table));
+  }
+}
+
+const uint8_t* RareItemSet::sample_box_drop(uint8_t area, DropRNG& rng) const {
+  uint8_t table_index = this->area_to_box_table_index[area];
+  if (table_index == 0xFF) {
+    return nullptr;
+  }
+  const auto& table = this->box_area_tables[table_index];
+  size_t index = table.outcomes.sample(rng);
+  return (index < table.item_codes.size())
+      ? table.item_codes[index].data() : nullptr;
+}
+
+
+
+RareItemTable::RareItemTable(const string& filename) {
+  string data = load_file(filename);
+  size_t num_sets = data.size() / sizeof(RareItemSetData);
+  if (num_sets == 0 || (num_sets % 40)) {
+    throw runtime_error(string_printf(
+        "rare item table size %zX is not a multiple of the episode size", data.size()));
+  }
+  const auto* sets_data = reinterpret_cast<const RareItemSetData*>(data.data());
+  for (size_t x = 0; x < num_sets; x++) {
+    this->sets.emplace_back(new RareItemSet(sets_data[x]));
+  }
+}
+
+shared_ptr<const RareItemSet> RareItemTable::get(
+    uint8_t episode, uint8_t difficulty, uint8_t section_id) const {
+  if ((difficulty >= 4) || (section_id >= 10)) {
+    throw out_of_range("invalid difficulty or section ID");
+  }
+  return this->sets.at((episode * 40) + (difficulty * 10) + section_id);
 }
@@ -2,6 +2,13 @@
 
 #include <stdint.h>
 
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DropTable.hh"
+
 
 
 struct RareItemDrop {
@@ -9,7 +16,7 @@ struct RareItemDrop {
   uint8_t item_code[3];
 } __attribute__((packed));
 
-struct RareItemSet {
+struct RareItemSetData {
   // TODO: It looks like this structure can actually vary. We see the offsets
   // 0194 and 01B2 in the unused section, along with the value 1E (number of box
   // rares). In PSOGC, these all appear to be the same size/format, but that's
@@ -19,9 +26,62 @@ struct RareItemSet {
   uint8_t box_areas[0x1E];      // 0194 - 01B2 in file
   RareItemDrop box_rares[0x1E]; // 01B2 - 022A in file
   uint8_t unused[0x56];
-
-  RareItemSet(const char* filename, uint8_t episode, uint8_t difficulty,
-  	  uint8_t secid);
 } __attribute__((packed));
 
-bool sample_rare_item(uint8_t pc);
+// Returns the probability (out of 0x100000000) that a rare item drops, given
+// its encoded probability byte from the rare item table
+uint32_t rate_for_rare_item_probability(uint8_t pc);
+
+// The rare item drops for one episode, difficulty, and section ID, decoded
+// into a form that's fast to sample from. Each enemy has one rare item that
+// it drops with a fixed probability. Each box can drop any of the box rares
+// listed for its area; the original format represents this as a sequence of
+// independent chances (the first one that succeeds is dropped), which is
+// compiled into an alias table per area so each box needs only one random
+// number.
+class RareItemSet {
+public:
+  explicit RareItemSet(const RareItemSetData& data);
+
+  // These return a pointer to the item code (3 bytes) of the rare item that
+  // should drop, or nullptr if no rare item should drop
+  inline const uint8_t* sample_enemy_drop(uint8_t enemy_id, DropRNG& rng) const {
+    if (enemy_id >= this->enemy_drops.size()) {
+      return nullptr;
+    }
+    const auto& drop = this->enemy_drops[enemy_id];
+    return ((rng.next() & 0xFFFFFFFF) < drop.rate) ? drop.item_code : nullptr;
+  }
+  const uint8_t* sample_box_drop(uint8_t area, DropRNG& rng) const;
+
+private:
+  struct EnemyDrop {
+    uint32_t rate;
+    uint8_t item_code[3];
+  };
+  std::array<EnemyDrop, 0x65> enemy_drops;
+
+  // The last outcome in each table means no rare item drops
+  struct BoxAreaTable {
+    AliasTable outcomes;
+    std::vector<std::array<uint8_t, 3>> item_codes;
+  };
+  std::vector<BoxAreaTable> box_area_tables;
+  std::array<uint8_t, 0x100> area_to_box_table_index; // FF = no box rares
+};
+
+// All the rare item sets in an ItemRT.rel file, compiled when the file is
+// loaded
+class RareItemTable {
+public:
+  explicit RareItemTable(const std::string& filename);
+
+  // episode is 0-2 (for Episodes 1, 2, and 4); throws out_of_range if there is
+  // no set for the given parameters
+  std::shared_ptr<const RareItemSet> get(
+      uint8_t episode, uint8_t difficulty, uint8_t section_id) const;
+
+private:
+  // Indexed by (episode * 40) + (difficulty * 10) + section ID
+  std::vector<std::shared_ptr<const RareItemSet>> sets;
+};
@@ -137,6 +137,7 @@ void process_disconnect(shared_ptr<ServerState> s, shared_ptr<Client> c) {
   if (c->lobby_id) {
     s->remove_client_from_lobby(c);
   }
+  s->remove_client_from_indexes(c);
 
   // TODO: Make a timer event for each connected player that saves their data
   // periodically, not only when they disconnect
@@ -611,11 +612,11 @@ void process_menu_item_info_request(shared_ptr<ServerState> s, shared_ptr<Client
       break;
 
     case MenuID::QUEST: {
-      if (!s->quest_index) {
+      if (!s->config()->quest_index) {
         send_quest_info(c, u"$C6Quests are not available.", !c->lobby_id);
         break;
       }
-      auto q = s->quest_index->get(c->version, cmd.item_id);
+      auto q = s->config()->quest_index->get(c->version, cmd.item_id);
       if (!q) {
         send_quest_info(c, u"$C4Quest does not\nexist.", !c->lobby_id);
         break;
@@ -704,7 +705,7 @@ void process_menu_item_info_request(shared_ptr<ServerState> s, shared_ptr<Client
         send_ship_info(c, u"Return to the\nmain menu.");
       } else {
         try {
-          auto dol = s->dol_file_index->item_id_to_file.at(cmd.item_id);
+          auto dol = s->config()->dol_file_index->item_id_to_file.at(cmd.item_id);
           string size_str = format_size(dol->data.size());
           string info = string_printf("$C6%s$C7\n%s", dol->name.c_str(), size_str.c_str());
           send_ship_info(c, decode_sjis(info));
@@ -761,7 +762,7 @@ void process_menu_selection(shared_ptr<ServerState> s, shared_ptr<Client> c,
         case MainMenuItemID::DOWNLOAD_QUESTS:
           if (c->flags & Client::Flag::EPISODE_3) {
             shared_ptr<Lobby> l = c->lobby_id ? s->find_lobby(c->lobby_id) : nullptr;
-            auto quests = s->quest_index->filter(
+            auto quests = s->config()->quest_index->filter(
                 c->version, false, QuestCategory::EPISODE_3);
             if (quests.empty()) {
               send_lobby_message_box(c, u"$C6There are no quests\navailable.");
@@ -778,11 +779,11 @@ void process_menu_selection(shared_ptr<ServerState> s, shared_ptr<Client> c,
           break;
 
         case MainMenuItemID::PATCHES:
-          send_menu(c, u"Patches", MenuID::PATCHES, s->function_code_index->patch_menu());
+          send_menu(c, u"Patches", MenuID::PATCHES, s->config()->function_code_index->patch_menu());
           break;
 
         case MainMenuItemID::PROGRAMS:
-          send_menu(c, u"Programs", MenuID::PROGRAMS, s->dol_file_index->menu());
+          send_menu(c, u"Programs", MenuID::PROGRAMS, s->config()->dol_file_index->menu());
           break;
 
         case MainMenuItemID::DISCONNECT:
@@ -918,12 +919,12 @@ void process_menu_selection(shared_ptr<ServerState> s, shared_ptr<Client> c,
     }
 
     case MenuID::QUEST_FILTER: {
-      if (!s->quest_index) {
+      if (!s->config()->quest_index) {
         send_lobby_message_box(c, u"$C6Quests are not available.");
         break;
       }
       shared_ptr<Lobby> l = c->lobby_id ? s->find_lobby(c->lobby_id) : nullptr;
-      auto quests = s->quest_index->filter(c->version,
+      auto quests = s->config()->quest_index->filter(c->version,
           c->flags & Client::Flag::DCV1,
           static_cast<QuestCategory>(cmd.item_id & 0xFF));
       if (quests.empty()) {
@@ -938,11 +939,11 @@ void process_menu_selection(shared_ptr<ServerState> s, shared_ptr<Client> c,
     }
 
     case MenuID::QUEST: {
-      if (!s->quest_index) {
+      if (!s->config()->quest_index) {
         send_lobby_message_box(c, u"$C6Quests are not available.");
         break;
       }
-      auto q = s->quest_index->get(c->version, cmd.item_id);
+      auto q = s->config()->quest_index->get(c->version, cmd.item_id);
       if (!q) {
         send_lobby_message_box(c, u"$C6Quest does not exist.");
         break;
@@ -1031,8 +1032,8 @@ void process_menu_selection(shared_ptr<ServerState> s, shared_ptr<Client> c,
         }
 
         send_function_call(
-            c, s->function_code_index->menu_item_id_to_patch_function.at(cmd.item_id));
-        send_menu(c, u"Patches", MenuID::PATCHES, s->function_code_index->patch_menu());
+            c, s->config()->function_code_index->menu_item_id_to_patch_function.at(cmd.item_id));
+        send_menu(c, u"Patches", MenuID::PATCHES, s->config()->function_code_index->patch_menu());
       }
       break;
 
@@ -1045,14 +1046,14 @@ void process_menu_selection(shared_ptr<ServerState> s, shared_ptr<Client> c,
           throw runtime_error("client does not support send_function_call");
         }
 
-        c->loading_dol_file = s->dol_file_index->item_id_to_file.at(cmd.item_id);
+        c->loading_dol_file = s->config()->dol_file_index->item_id_to_file.at(cmd.item_id);
 
         // Send the first function call, which triggers the process of loading a
         // DOL file. This function call determines the necessary base address
         // for loading the file.
         send_function_call(
             c,
-            s->function_code_index->name_to_function.at("ReadMemoryWord"),
+            s->config()->function_code_index->name_to_function.at("ReadMemoryWord"),
             {{"address", 0x80000034}}); // ArenaHigh from GC globals
       }
       break;
@@ -1135,24 +1136,21 @@ void process_change_block(shared_ptr<ServerState> s, shared_ptr<Client> c,
 ////////////////////////////////////////////////////////////////////////////////
 // DOL loading commands
 
-static void send_dol_file_chunk(shared_ptr<ServerState> s, shared_ptr<Client> c,
-    uint32_t start_addr) {
-  size_t offset = start_addr - c->dol_base_addr;
-  if (offset >= c->loading_dol_file->data.size()) {
-    throw logic_error("DOL file offset beyond end of data");
-  }
-  size_t bytes_to_send = min<size_t>(0x7800, c->loading_dol_file->data.size() - offset);
-  string data_to_send = c->loading_dol_file->data.substr(offset, bytes_to_send);
-
-  auto fn = s->function_code_index->name_to_function.at("WriteMemory");
-  unordered_map<string, uint32_t> label_writes(
-      {{"dest_addr", start_addr}, {"size", bytes_to_send}});
-  send_function_call(c, fn, label_writes, data_to_send);
+// This many chunks of a DOL file are sent before the client responds to the
+// first one, so the client doesn't have to wait for a round trip to the server
+// after writing each chunk
+static const size_t DOL_CHUNKS_IN_FLIGHT = 4;
 
-  size_t progress_percent = ((offset + bytes_to_send) * 100) / c->loading_dol_file->data.size();
-  string info = string_printf("Loading $C6%s$C7\n%zu%%%% complete",
-      c->loading_dol_file->name.c_str(), progress_percent);
-  send_ship_info(c, decode_sjis(info));
+static void send_next_dol_file_chunk(shared_ptr<Client> c) {
+  const auto& dol = c->loading_dol_file;
+  if (c->dol_next_chunk_index >= dol->chunks.size()) {
+    return;
+  }
+  const auto& chunk = dol->chunks[c->dol_next_chunk_index++];
+  string code = chunk.code;
+  *reinterpret_cast<be_uint32_t*>(code.data() + chunk.dest_addr_offset) =
+      c->dol_base_addr + chunk.offset;
+  send_function_call(c, code, chunk.function_index);
 }
 
 void process_function_call_result(shared_ptr<ServerState> s, shared_ptr<Client> c,
@@ -1162,14 +1160,35 @@ void process_function_call_result(shared_ptr<ServerState> s, shared_ptr<Client>
     return;
   }
 
-  auto called_fn = s->function_code_index->index_to_function.at(flag);
+  auto called_fn = s->config()->function_code_index->index_to_function.at(flag);
   if (c->loading_dol_file.get()) {
+    const auto& dol = c->loading_dol_file;
     if (called_fn->name == "ReadMemoryWord") {
-      c->dol_base_addr = (cmd.return_value - c->loading_dol_file->data.size()) & (~3);
-      send_dol_file_chunk(s, c, c->dol_base_addr);
-    } else if (called_fn->name == "WriteMemory") {
-      if (cmd.return_value >= c->dol_base_addr + c->loading_dol_file->data.size()) {
-        auto fn = s->function_code_index->name_to_function.at("RunDOL");
+      c->dol_base_addr = (cmd.return_value - dol->data.size()) & (~3);
+      c->dol_next_chunk_index = 0;
+      c->dol_chunks_written = 0;
+      c->dol_load_start_time = now();
+      for (size_t x = 0; x < DOL_CHUNKS_IN_FLIGHT; x++) {
+        send_next_dol_file_chunk(c);
+      }
+
+    } else if ((called_fn->name == "WriteMemory") ||
+               (called_fn->name == "WriteMemoryCompressed")) {
+      // The client runs the chunks in the order they were sent, so this result
+      // is for the earliest chunk that hasn't been written yet
+      if (c->dol_chunks_written >= c->dol_next_chunk_index) {
+        throw runtime_error("client wrote more DOL chunks than were sent");
+      }
+      const auto& chunk = dol->chunks[c->dol_chunks_written++];
+      if (cmd.return_value != c->dol_base_addr + chunk.offset + chunk.size) {
+        throw runtime_error("client did not write DOL chunk correctly");
+      }
+
+      if (c->dol_chunks_written >= dol->chunks.size()) {
+        log(INFO, "Sent DOL file %s (%zu bytes; %zu bytes in %zu chunks) in %" PRIu64 "ms",
+            dol->name.c_str(), dol->data.size(), dol->transfer_size,
+            dol->chunks.size(), (now() - c->dol_load_start_time) / 1000);
+        auto fn = s->config()->function_code_index->name_to_function.at("RunDOL");
         unordered_map<string, uint32_t> label_writes(
             {{"dol_base_ptr", c->dol_base_addr}});
         send_function_call(c, fn, label_writes);
@@ -1177,7 +1196,12 @@ void process_function_call_result(shared_ptr<ServerState> s, shared_ptr<Client>
         c->should_disconnect = true;
 
       } else {
-        send_dol_file_chunk(s, c, cmd.return_value);
+        send_next_dol_file_chunk(c);
+
+        size_t progress_percent = ((chunk.offset + chunk.size) * 100) / dol->data.size();
+        string info = string_printf("Loading $C6%s$C7\n%zu%%%% complete",
+            dol->name.c_str(), progress_percent);
+        send_ship_info(c, decode_sjis(info));
       }
     }
   }
@@ -1190,7 +1214,7 @@ void process_quest_list_request(shared_ptr<ServerState> s, shared_ptr<Client> c,
     uint16_t, uint32_t flag, const string& data) { // A2
   check_size_v(data.size(), 0);
 
-  if (!s->quest_index) {
+  if (!s->config()->quest_index) {
     send_lobby_message_box(c, u"$C6Quests are not available.");
     return;
   }
@@ -1333,6 +1357,7 @@ void process_player_data(shared_ptr<ServerState> s, shared_ptr<Client> c,
     default:
       throw logic_error("player data command not implemented for version");
   }
+  s->update_client_indexes(c);
 
   if (command == 0x61 && !c->pending_bb_save_username.empty()) {
     string prev_bb_username = c->game_data.bb_username;
@@ -1541,7 +1566,7 @@ void process_create_character_bb(shared_ptr<ServerState> s, shared_ptr<Client> c
   c->game_data.bb_player_index = cmd.player_index;
 
   try {
-    c->game_data.create_player(cmd.preview, s->level_table);
+    c->game_data.create_player(cmd.preview, s->config()->level_table);
   } catch (const exception& e) {
     string message = string_printf("$C6New character could not be created:\n%s", e.what());
     send_message_box(c, decode_sjis(message));
@@ -1626,17 +1651,43 @@ void process_change_arrow_color(shared_ptr<ServerState> s, shared_ptr<Client> c,
 void process_card_search(shared_ptr<ServerState> s, shared_ptr<Client> c,
     uint16_t, uint32_t, const string& data) { // 40
   const auto& cmd = check_size_t<C_GuildCardSearch_40>(data);
-  try {
-    auto result = s->find_client(nullptr, cmd.target_guild_card_number);
+  auto result = s->find_client(nullptr, cmd.target_guild_card_number);
+  if (result) {
     auto result_lobby = s->find_lobby(result->lobby_id);
-    send_card_search_result(s, c, result, result_lobby);
-  } catch (const out_of_range&) { }
+    if (result_lobby) {
+      send_card_search_result(s, c, result, result_lobby);
+    }
+  }
 }
 
-void process_choice_search(shared_ptr<ServerState>, shared_ptr<Client> c,
-    uint16_t, uint32_t, const string&) { // C0
-  // TODO: Implement choice search.
-  send_text_message(c, u"$C6Choice Search is\nnot supported");
+// Maximum number of players returned by a single Choice Search
+static const size_t MAX_CHOICE_SEARCH_RESULTS = 32;
+
+void process_choice_search_options_request(shared_ptr<ServerState>,
+    shared_ptr<Client> c, uint16_t, uint32_t, const string& data) { // C0
+  check_size_v(data.size(), 0);
+  send_choice_search_options(c);
+}
+
+void process_set_choice_search_parameters(shared_ptr<ServerState> s,
+    shared_ptr<Client> c, uint16_t, uint32_t, const string& data) { // C2
+  const auto& cmd = check_size_t<C_SetChoiceSearchParameters_C2>(data,
+      sizeof(C_SetChoiceSearchParameters_C2), 0xFFFF);
+  c->choice_search_disabled = (cmd.disabled != 0);
+  s->update_client_indexes(c);
+}
+
+void process_execute_choice_search(shared_ptr<ServerState> s,
+    shared_ptr<Client> c, uint16_t, uint32_t, const string& data) { // C3
+  const auto& cmd = check_size_t<C_ExecuteChoiceSearch_C3>(data,
+      sizeof(C_ExecuteChoiceSearch_C3), 0xFFFF);
+  size_t entry_count = (data.size() - sizeof(C_ExecuteChoiceSearch_C3)) /
+      sizeof(C_ExecuteChoiceSearch_C3::Entry);
+  ChoiceSearchIndex::Query q(cmd.entries, entry_count);
+  auto results = s->choice_search_index.find(
+      c->version, (c->flags & Client::Flag::EPISODE_3), q, c.get(),
+      MAX_CHOICE_SEARCH_RESULTS);
+  send_choice_search_results(s, c, results);
 }
 
 void process_simple_mail(shared_ptr<ServerState> s, shared_ptr<Client> c,
@@ -1650,6 +1701,9 @@ void process_simple_mail(shared_ptr<ServerState> s, shared_ptr<Client> c,
   const auto& cmd = check_size_t<SC_SimpleMail_GC_81>(data);
 
   auto target = s->find_client(nullptr, cmd.to_guild_card_number);
+  if (!target) {
+    return;
+  }
 
   // If the sender is blocked, don't forward the mail
   for (size_t y = 0; y < 30; y++) {
@@ -1793,9 +1847,8 @@ shared_ptr<Lobby> create_game_generic(shared_ptr<ServerState> s,
 
   const uint32_t* variation_maxes = nullptr;
   if (game->version == GameVersion::BB) {
-    // TODO: cache these somewhere so we don't read the file every time, lolz
-    game->rare_item_set.reset(new RareItemSet("system/blueburst/ItemRT.rel",
-        game->episode - 1, game->difficulty, game->section_id));
+    game->rare_item_set = s->config()->rare_item_table->get(
+        game->episode - 1, game->difficulty, game->section_id);
 
     for (size_t x = 0; x < 4; x++) {
       game->next_item_id[x] = (0x00200000 * x) + 0x00010000;
@@ -1803,7 +1856,7 @@ shared_ptr<Lobby> create_game_generic(shared_ptr<ServerState> s,
     game->next_game_item_id = 0x00810000;
     game->enemies.resize(0x0B50);
 
-    const auto* bp_subtable = s->battle_params->get_subtable(game->mode == 3,
+    const auto* bp_subtable = s->config()->battle_params->get_subtable(game->mode == 3,
         game->episode - 1, game->difficulty);
 
     const char* type_chars = (game->mode == 3) ? "sm" : "m";
@@ -2272,7 +2325,7 @@ static process_command_t gc_handlers[0x100] = {
   nullptr, nullptr, nullptr, nullptr,
 
   // C0
-  process_choice_search, process_create_game_dc_gc, nullptr, nullptr,
+  process_choice_search_options_request, process_create_game_dc_gc, process_set_choice_search_parameters, process_execute_choice_search,
   nullptr, nullptr, process_set_blocked_senders_list, process_set_auto_reply_t<char>,
   process_disable_auto_reply, process_game_command, process_ep3_server_data_request, process_game_command,
   nullptr, nullptr, nullptr, nullptr,
@@ -258,7 +258,14 @@ void process_subcommand_movement(shared_ptr<ServerState>,
   c->x = cmd->x;
   c->z = cmd->z;
 
-  forward_subcommand(l, c, command, flag, data);
+  // Players who can't keep up don't need to see every step another player
+  // takes; only the latest position of each player is sent to them
+  if (command_is_private(command)) {
+    forward_subcommand(l, c, command, flag, data);
+  } else {
+    send_command_droppable_excluding_client(l, c, command, flag, data.data(),
+        data.size(), coalesce_key_for_movement(c->lobby_client_id));
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -534,11 +541,11 @@ static void process_subcommand_open_shop_bb_or_unknown_ep3(shared_ptr<ServerStat
       while (c->game_data.shop_contents.size() < num_items) {
         ItemData item_data;
         if (shop_type == 0) { // tool shop
-          item_data = s->common_item_creator->create_shop_item(l->difficulty, 3);
+          item_data = s->config()->common_item_creator->create_shop_item(l->difficulty, 3);
         } else if (shop_type == 1) { // weapon shop
-          item_data = s->common_item_creator->create_shop_item(l->difficulty, 0);
+          item_data = s->config()->common_item_creator->create_shop_item(l->difficulty, 0);
         } else if (shop_type == 2) { // guards shop
-          item_data = s->common_item_creator->create_shop_item(l->difficulty, 1);
+          item_data = s->config()->common_item_creator->create_shop_item(l->difficulty, 1);
         } else { // unknown shop... just leave it blank I guess
           break;
         }
@@ -646,19 +653,15 @@ static void process_subcommand_enemy_drop_item_request(shared_ptr<ServerState> s
     PlayerInventoryItem item;
 
     // TODO: Deduplicate this code with the box drop item request handler
-    bool is_rare = false;
     if (l->next_drop_item.data.data1d[0]) {
       item = l->next_drop_item;
       l->next_drop_item.data.data1d[0] = 0;
     } else {
-      if (l->rare_item_set) {
-        if (cmd->enemy_id <= 0x65) {
-          is_rare = sample_rare_item(l->rare_item_set->rares[cmd->enemy_id].probability);
-        }
-      }
+      const uint8_t* code = l->rare_item_set
+          ? l->rare_item_set->sample_enemy_drop(cmd->enemy_id, l->drop_rng)
+          : nullptr;
 
-      if (is_rare) {
-        const auto& code = l->rare_item_set->rares[cmd->enemy_id].item_code;
+      if (code) {
         item.data.data1[0] = code[0];
         item.data.data1[1] = code[1];
         item.data.data1[2] = code[2];
@@ -668,8 +671,8 @@ static void process_subcommand_enemy_drop_item_request(shared_ptr<ServerState> s
         }
       } else {
         try {
-          item.data = s->common_item_creator->create_drop_item(false, l->episode,
-              l->difficulty, cmd->area, l->section_id);
+          item.data = s->config()->common_item_creator->create_drop_item(false, l->episode,
+              l->difficulty, cmd->area, l->section_id, l->drop_rng);
         } catch (const out_of_range&) {
           // create_common_item throws this when it doesn't want to make an item
           return;
@@ -699,26 +702,15 @@ static void process_subcommand_box_drop_item_request(shared_ptr<ServerState> s,
 
     PlayerInventoryItem item;
 
-    bool is_rare = false;
     if (l->next_drop_item.data.data1d[0]) {
       item = l->next_drop_item;
       l->next_drop_item.data.data1d[0] = 0;
     } else {
-      size_t index;
-      if (l->rare_item_set) {
-        for (index = 0; index < 30; index++) {
-          if (l->rare_item_set->box_areas[index] != cmd->area) {
-            continue;
-          }
-          if (sample_rare_item(l->rare_item_set->box_rares[index].probability)) {
-            is_rare = true;
-            break;
-          }
-        }
-      }
+      const uint8_t* code = l->rare_item_set
+          ? l->rare_item_set->sample_box_drop(cmd->area, l->drop_rng)
+          : nullptr;
 
-      if (is_rare) {
-        const auto& code = l->rare_item_set->box_rares[index].item_code;
+      if (code) {
         item.data.data1[0] = code[0];
         item.data.data1[1] = code[1];
         item.data.data1[2] = code[2];
@@ -728,8 +720,8 @@ static void process_subcommand_box_drop_item_request(shared_ptr<ServerState> s,
         }
       } else {
         try {
-          item.data = s->common_item_creator->create_drop_item(true, l->episode,
-              l->difficulty, cmd->area, l->section_id);
+          item.data = s->config()->common_item_creator->create_drop_item(true, l->episode,
+              l->difficulty, cmd->area, l->section_id, l->drop_rng);
         } catch (const out_of_range&) {
           // create_common_item throws this when it doesn't want to make an item
           return;
@@ -834,7 +826,19 @@ static void process_subcommand_enemy_killed(shared_ptr<ServerState> s,
 
     auto& enemy = l->enemies[cmd->enemy_id];
     enemy.hit_flags |= 0x80;
-    for (size_t x = 0; x < l->max_clients; x++) {
+
+    // Compute and apply the rewards for all players first, then send all the
+    // notifications, so each player's client gets the game's EXP and level-up
+    // commands together
+    struct Reward {
+      shared_ptr<Client> c;
+      uint32_t exp;
+      bool leveled_up;
+    };
+    array<Reward, 12> rewards;
+    size_t num_rewards = 0;
+    auto level_table = s->config()->level_table;
+    for (size_t x = 0; x < min<size_t>(l->max_clients, rewards.size()); x++) {
       if (!((enemy.hit_flags >> x) & 1)) {
         continue; // player did not hit this enemy
       }
@@ -843,35 +847,38 @@ static void process_subcommand_enemy_killed(shared_ptr<ServerState> s,
       if (!other_c) {
         continue; // no player
       }
-      if (other_c->game_data.player()->disp.level >= 199) {
+      auto& disp = other_c->game_data.player()->disp;
+      if (disp.level >= 199) {
         continue; // player is level 200 or higher
       }
 
+      auto& reward = rewards[num_rewards++];
+      reward.c = other_c;
       // killer gets full experience, others get 77%
-      uint32_t exp;
       if (enemy.last_hit == other_c->lobby_client_id) {
-        exp = enemy.experience;
+        reward.exp = enemy.experience;
       } else {
-        exp = ((enemy.experience * 77) / 100);
+        reward.exp = ((enemy.experience * 77) / 100);
+      }
+      disp.experience += reward.exp;
+
+      uint8_t new_level = level_table->level_for_experience(
+          disp.char_class, disp.experience);
+      reward.leveled_up = (new_level > disp.level);
+      if (reward.leveled_up) {
+        level_table->apply_level_ups(
+            disp.stats, disp.char_class, disp.level, new_level);
+        disp.level = new_level;
       }
+    }
 
-      other_c->game_data.player()->disp.experience += exp;
-      send_give_experience(l, other_c, exp);
-
-      bool leveled_up = false;
-      do {
-        const auto& level = s->level_table->stats_for_level(
-            other_c->game_data.player()->disp.char_class, other_c->game_data.player()->disp.level + 1);
-        if (other_c->game_data.player()->disp.experience >= level.experience) {
-          leveled_up = true;
-          level.apply(other_c->game_data.player()->disp.stats);
-          other_c->game_data.player()->disp.level++;
-        } else {
-          break;
-        }
-      } while (other_c->game_data.player()->disp.level < 199);
-      if (leveled_up) {
-        send_level_up(l, other_c);
+    for (size_t x = 0; x < num_rewards; x++) {
+      send_give_experience(l, rewards[x].c, rewards[x].exp);
+    }
+    for (size_t x = 0; x < num_rewards; x++) {
+      if (rewards[x].leveled_up) {
+        send_level_up(l, rewards[x].c);
+        s->update_client_indexes(rewards[x].c);
       }
     }
   }
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+
+
+// Shift-JIS <=> Unicode (UTF-16) mapping tables. These are generated at
+// compile time, so nothing needs to be loaded or parsed at startup. Both
+// tables are indexed by the source character; for two-byte Shift-JIS
+// characters, the index is (first byte << 8) | second byte. Characters that
+// can't be translated map to zero.
+struct SJISTables {
+  char16_t sjis_to_unicode[0x10000];
+  char16_t unicode_to_sjis[0x10000];
+};
+
+extern const SJISTables sjis_tables;
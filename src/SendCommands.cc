@@ -14,6 +14,7 @@
 #include "PSOProtocol.hh"
 #include "CommandFormats.hh"
 #include "FileContentsCache.hh"
+#include "StaticGameData.hh"
 #include "Text.hh"
 
 using namespace std;
@@ -122,11 +123,8 @@ void send_command(
   evbuffer_add(buf, send_data.data(), send_data.size());
 }
 
-void send_command(shared_ptr<Client> c, uint16_t command, uint32_t flag,
-    const void* data, size_t size) {
-  if (!c->bev) {
-    return;
-  }
+static void send_command_now(shared_ptr<Client> c, uint16_t command,
+    uint32_t flag, const void* data, size_t size) {
   string encoded_name;
   auto player = c->game_data.player(false);
   if (player) {
@@ -134,6 +132,101 @@ void send_command(shared_ptr<Client> c, uint16_t command, uint32_t flag,
   }
   send_command(c->bev, c->version, c->crypt_out.get(), command, flag, data,
       size, encoded_name.c_str());
+  update_output_congestion(c);
+}
+
+static void queue_command(shared_ptr<Client> c, uint16_t command,
+    uint32_t flag, const void* data, size_t size) {
+  c->queued_commands.emplace_back(Client::QueuedCommand{
+      command, flag, string(reinterpret_cast<const char*>(data), size)});
+}
+
+void send_command(shared_ptr<Client> c, uint16_t command, uint32_t flag,
+    const void* data, size_t size) {
+  if (!c->bev) {
+    return;
+  }
+  if (!c->queued_commands.empty()) {
+    queue_command(c, command, flag, data, size);
+  } else {
+    send_command_now(c, command, flag, data, size);
+  }
+}
+
+void send_command_paced(shared_ptr<Client> c, uint16_t command,
+    uint32_t flag, const void* data, size_t size) {
+  if (!c->bev) {
+    return;
+  }
+  if (!c->queued_commands.empty() ||
+      (evbuffer_get_length(bufferevent_get_output(c->bev)) >= PACED_OUTPUT_BUFFER_BYTES)) {
+    queue_command(c, command, flag, data, size);
+  } else {
+    send_command_now(c, command, flag, data, size);
+  }
+}
+
+void send_queued_commands(shared_ptr<Client> c, bool force) {
+  if (!c->bev) {
+    c->queued_commands.clear();
+    return;
+  }
+  struct evbuffer* buf = bufferevent_get_output(c->bev);
+  while (!c->queued_commands.empty() &&
+         (force || (evbuffer_get_length(buf) < PACED_OUTPUT_BUFFER_BYTES))) {
+    const auto& cmd = c->queued_commands.front();
+    send_command_now(c, cmd.command, cmd.flag, cmd.data.data(), cmd.data.size());
+    c->queued_commands.pop_front();
+  }
+}
+
+void update_output_congestion(shared_ptr<Client> c) {
+  if (!c->bev) {
+    c->output_congested_since = 0;
+    c->coalesced_commands.clear();
+    return;
+  }
+
+  size_t buffered_bytes = evbuffer_get_length(bufferevent_get_output(c->bev));
+  if (buffered_bytes > c->max_output_buffer_bytes) {
+    c->max_output_buffer_bytes = buffered_bytes;
+  }
+
+  if (!c->output_congested_since) {
+    if (c->output_high_watermark && (buffered_bytes >= c->output_high_watermark)) {
+      c->output_congested_since = now();
+    }
+
+  } else if (buffered_bytes <= c->output_low_watermark) {
+    c->output_congested_since = 0;
+    // Sending these can make the client congested again, in which case any
+    // further droppable commands go into a new map
+    map<uint16_t, Client::QueuedCommand> coalesced_commands;
+    coalesced_commands.swap(c->coalesced_commands);
+    for (const auto& it : coalesced_commands) {
+      const auto& cmd = it.second;
+      send_command(c, cmd.command, cmd.flag, cmd.data.data(), cmd.data.size());
+    }
+  }
+}
+
+void send_command_droppable(shared_ptr<Client> c, uint16_t command,
+    uint32_t flag, const void* data, size_t size, uint16_t coalesce_key) {
+  if (!c->bev) {
+    return;
+  }
+  if (c->output_congested_since) {
+    Client::QueuedCommand cmd{
+        command, flag, string(reinterpret_cast<const char*>(data), size)};
+    auto emplace_ret = c->coalesced_commands.emplace(coalesce_key, move(cmd));
+    if (!emplace_ret.second) {
+      // The previous command with this key will never be sent
+      emplace_ret.first->second = move(cmd);
+      c->dropped_command_count++;
+    }
+  } else {
+    send_command(c, command, flag, data, size);
+  }
 }
 
 void send_command_excluding_client(shared_ptr<Lobby> l, shared_ptr<Client> c,
@@ -146,6 +239,17 @@ void send_command_excluding_client(shared_ptr<Lobby> l, shared_ptr<Client> c,
   }
 }
 
+void send_command_droppable_excluding_client(shared_ptr<Lobby> l,
+    shared_ptr<Client> c, uint16_t command, uint32_t flag, const void* data,
+    size_t size, uint16_t coalesce_key) {
+  for (auto& client : l->clients) {
+    if (!client || (client == c)) {
+      continue;
+    }
+    send_command_droppable(client, command, flag, data, size, coalesce_key);
+  }
+}
+
 void send_command(shared_ptr<Lobby> l, uint16_t command, uint32_t flag,
     const void* data, size_t size) {
   send_command_excluding_client(l, nullptr, command, flag, data, size);
@@ -331,11 +435,43 @@ void send_function_call(
     throw logic_error("cannot send function calls to Episode 3 clients");
   }
 
-  string data;
-  uint32_t index = 0;
-  if (code.get()) {
-    data = code->generate_client_command(label_writes, suffix);
-    index = code->index;
+  if (!code) {
+    send_function_call(c, string(), 0, checksum_addr, checksum_size);
+    return;
+  }
+
+  vector<string> labels;
+  vector<uint32_t> values;
+  for (const auto& it : label_writes) {
+    labels.emplace_back(it.first);
+    values.emplace_back(it.second);
+  }
+  auto offsets = code->label_write_offsets(labels);
+
+  // Generate the code directly after the header, so it isn't copied again
+  size_t code_size = code->client_command_size(suffix.size());
+  string data(sizeof(S_ExecuteCode_B2) + code_size, '\0');
+  auto* header = reinterpret_cast<S_ExecuteCode_B2*>(data.data());
+  header->code_size = code_size;
+  header->checksum_start = checksum_addr;
+  header->checksum_size = checksum_size;
+  code->generate_client_command(data.data() + sizeof(S_ExecuteCode_B2),
+      offsets.data(), values.data(), offsets.size(), suffix.data(),
+      suffix.size());
+  send_command(c, 0xB2, code->index, data);
+}
+
+void send_function_call(
+    shared_ptr<Client> c,
+    const string& data,
+    uint32_t index,
+    uint32_t checksum_addr,
+    uint32_t checksum_size) {
+  if (c->version != GameVersion::GC) {
+    throw logic_error("cannot send function calls to non-GameCube clients");
+  }
+  if (c->flags & Client::Flag::EPISODE_3) {
+    throw logic_error("cannot send function calls to Episode 3 clients");
   }
 
   S_ExecuteCode_B2 header = {data.size(), checksum_addr, checksum_size};
@@ -716,6 +852,79 @@ void send_card_search_result(
 
 
 
+void send_choice_search_options(shared_ptr<Client> c) {
+  if (c->version != GameVersion::GC) {
+    throw logic_error("choice search is only implemented on GC");
+  }
+
+  vector<S_ChoiceSearchEntry_DC_GC_C0> entries;
+  for (const auto& category : choice_search_categories()) {
+    auto& category_e = entries.emplace_back();
+    category_e.parent_category_id = 0;
+    category_e.category_id = category.category_id;
+    category_e.text = category.name;
+
+    auto& any_e = entries.emplace_back();
+    any_e.parent_category_id = category.category_id;
+    any_e.category_id = 1;
+    any_e.text = "Any";
+
+    for (size_t x = 0; x < category.choice_names.size(); x++) {
+      auto& e = entries.emplace_back();
+      e.parent_category_id = category.category_id;
+      e.category_id = x + 2;
+      e.text = category.choice_names[x];
+    }
+  }
+  send_command_vt(c, 0xC0, entries.size(), entries);
+}
+
+void send_choice_search_results(
+    shared_ptr<ServerState> s,
+    shared_ptr<Client> c,
+    const vector<shared_ptr<Client>>& results) {
+  if (c->version != GameVersion::GC) {
+    throw logic_error("choice search is only implemented on GC");
+  }
+
+  auto encoded_server_name = encode_sjis(s->name);
+  vector<S_ChoiceSearchResultEntry_GC_C4> entries;
+  for (const auto& result : results) {
+    // Players on virtual connections don't have an address that the searcher
+    // could connect to, so they can't be included
+    const sockaddr_in* local_addr = reinterpret_cast<const sockaddr_in*>(&result->local_addr);
+    if (!local_addr->sin_addr.s_addr || !local_addr->sin_port) {
+      continue;
+    }
+    auto result_lobby = s->find_lobby(result->lobby_id);
+    auto player = result->game_data.player();
+
+    auto& e = entries.emplace_back();
+    e.guild_card_number = result->license->serial_number;
+    e.name = remove_language_marker(encode_sjis(player->disp.name));
+    e.info_string = string_printf("%s Lvl %" PRIu32,
+        name_for_char_class(player->disp.char_class), player->disp.level + 1);
+    if (result_lobby->is_game()) {
+      string encoded_lobby_name = encode_sjis(result_lobby->name);
+      e.locator_string = string_printf("%s,BLOCK00,%s",
+          encoded_lobby_name.c_str(), encoded_server_name.c_str());
+    } else {
+      e.locator_string = string_printf("BLOCK00-%02hhu,BLOCK00,%s",
+          result_lobby->block, encoded_server_name.c_str());
+    }
+    e.server_ip = local_addr->sin_addr.s_addr;
+    e.server_port = ntohs(local_addr->sin_port);
+    e.unused1 = 0;
+    e.menu_id = MenuID::LOBBY;
+    e.lobby_id = result->lobby_id;
+    e.game_id = result_lobby->is_game() ? result_lobby->lobby_id : 0;
+    e.unused2.clear(0);
+  }
+  send_command_vt(c, 0xC4, entries.size(), entries);
+}
+
+
+
 template <typename CmdT>
 void send_guild_card_pc_gc(shared_ptr<Client> c, shared_ptr<Client> source) {
   CmdT cmd;
@@ -818,7 +1027,8 @@ void send_menu(shared_ptr<Client> c, const u16string& menu_name,
 // CommandGameSelect: presents the player with a Game Select menu. returns the selection in the same way as CommandShipSelect.
 
 template <typename CharT>
-void send_game_menu_t(shared_ptr<Client> c, shared_ptr<ServerState> s) {
+string game_menu_data_t(shared_ptr<ServerState> s, GameVersion version,
+    const ServerState::GameMenuPartition& partition) {
   vector<S_GameMenuEntry<CharT>> entries;
   {
     auto& e = entries.emplace_back();
@@ -830,22 +1040,16 @@ void send_game_menu_t(shared_ptr<Client> c, shared_ptr<ServerState> s) {
     e.episode = 0x00;
     e.flags = 0x04;
   }
-  for (shared_ptr<Lobby> l : s->all_lobbies()) {
-    if (!l->is_game() || (l->version != c->version)) {
-      continue;
-    }
+  for (const auto& it : partition.id_to_game) {
+    const auto& l = it.second;
     bool l_is_ep3 = !!(l->flags & Lobby::Flag::EPISODE_3_ONLY);
-    bool c_is_ep3 = !!(c->flags & Client::Flag::EPISODE_3);
-    if (l_is_ep3 != c_is_ep3) {
-      continue;
-    }
 
     auto& e = entries.emplace_back();
     e.menu_id = MenuID::GAME;
     e.game_id = l->lobby_id;
     e.difficulty_tag = (l_is_ep3 ? 0x0A : (l->difficulty + 0x22));
     e.num_players = l->count_clients();
-    e.episode = ((c->version == GameVersion::BB) ? (l->max_clients << 4) : 0) | l->episode;
+    e.episode = ((version == GameVersion::BB) ? (l->max_clients << 4) : 0) | l->episode;
     if (l->flags & Lobby::Flag::EPISODE_3_ONLY) {
       e.flags = (l->password.empty() ? 0 : 2);
     } else {
@@ -854,15 +1058,22 @@ void send_game_menu_t(shared_ptr<Client> c, shared_ptr<ServerState> s) {
     e.name = l->name;
   }
 
-  send_command_vt(c, 0x08, entries.size() - 1, entries);
+  return string(reinterpret_cast<const char*>(entries.data()),
+      entries.size() * sizeof(entries[0]));
 }
 
 void send_game_menu(shared_ptr<Client> c, shared_ptr<ServerState> s) {
-  if ((c->version == GameVersion::DC) || (c->version == GameVersion::GC)) {
-    send_game_menu_t<char>(c, s);
-  } else {
-    send_game_menu_t<char16_t>(c, s);
+  auto& partition = s->game_menu_partition(
+      c->version, !!(c->flags & Client::Flag::EPISODE_3));
+  if (partition.menu_data.empty()) {
+    if ((c->version == GameVersion::DC) || (c->version == GameVersion::GC)) {
+      partition.menu_data = game_menu_data_t<char>(s, c->version, partition);
+    } else {
+      partition.menu_data = game_menu_data_t<char16_t>(s, c->version, partition);
+    }
   }
+  send_command(c, 0x08, partition.id_to_game.size(),
+      partition.menu_data.data(), partition.menu_data.size());
 }
 
 
@@ -1152,7 +1363,11 @@ void send_arrow_update(shared_ptr<Lobby> l) {
     e.arrow_color = l->clients[x]->lobby_arrow_color;
   }
 
-  send_command_vt(l, 0x88, entries.size(), entries);
+  // Arrow updates always describe the entire lobby, so only the latest one
+  // needs to be sent to a congested client
+  send_command_droppable_excluding_client(l, nullptr, 0x88, entries.size(),
+      entries.data(), entries.size() * sizeof(S_ArrowUpdateEntry_88),
+      COALESCE_KEY_ARROW_UPDATE);
 }
 
 // tells the player that the joining player is done joining, and the game can resume
@@ -1365,7 +1580,7 @@ void send_give_experience(shared_ptr<Lobby> l, shared_ptr<Client> c,
 // ep3 only commands
 
 void send_ep3_card_list_update(shared_ptr<ServerState> s, shared_ptr<Client> c) {
-  const auto& data = s->ep3_data_index->get_compressed_card_definitions();
+  const auto& data = s->config()->ep3_data_index->get_compressed_card_definitions();
 
   StringWriter w;
   w.put_u32l(data.size());
@@ -1383,37 +1598,14 @@ void send_ep3_rank_update(shared_ptr<Client> c) {
 
 // sends the map list (used for battle setup) to all players in a game
 void send_ep3_map_list(shared_ptr<ServerState> s, shared_ptr<Lobby> l) {
-  const auto& data = s->ep3_data_index->get_compressed_map_list();
-
-  string cmd_data(16, '\0');
-  PSOSubcommand* subs = reinterpret_cast<PSOSubcommand*>(cmd_data.data());
-  subs[0].dword = 0x000000B6;
-  subs[1].dword = (data.size() + 0x14 + 3) & 0xFFFFFFFC;
-  subs[2].dword = 0x00000040;
-  subs[3].dword = data.size();
-  cmd_data += data;
-
-  send_command(l, 0x6C, 0x00, cmd_data);
+  send_command(l, 0x6C, 0x00,
+      s->config()->ep3_data_index->get_map_list_command_data());
 }
 
 // sends the map data for the chosen map to all players in the game
 void send_ep3_map_data(shared_ptr<ServerState> s, shared_ptr<Lobby> l, uint32_t map_id) {
-  auto entry = s->ep3_data_index->get_map(map_id);
-  const auto& compressed = entry->compressed();
-
-  string data(0x14, '\0');
-  PSOSubcommand* subs = reinterpret_cast<PSOSubcommand*>(data.data());
-  subs[0].dword = 0x000000B6;
-  subs[1].dword = (19 + compressed.size()) & 0xFFFFFFFC;
-  subs[2].dword = 0x00000041;
-  subs[3].dword = entry->map.map_number.load();
-  subs[4].dword = compressed.size();
-  data += compressed;
-  while (data.size() & 3) {
-    data.push_back('\0');
-  }
-
-  send_command(l, 0x6C, 0x00, data);
+  auto entry = s->config()->ep3_data_index->get_map(map_id);
+  send_command(l, 0x6C, 0x00, entry->command_data());
 }
 
 
@@ -1476,7 +1668,8 @@ void send_quest_file_chunk(
   }
   cmd.data_size = size;
 
-  send_command_t(c, (type == QuestFileType::ONLINE) ? 0x13 : 0xA7, chunk_index, cmd);
+  send_command_paced(c, (type == QuestFileType::ONLINE) ? 0x13 : 0xA7,
+      chunk_index, &cmd, sizeof(cmd));
 }
 
 void send_quest_file(shared_ptr<Client> c, const string& quest_name,
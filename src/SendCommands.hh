@@ -38,9 +38,42 @@ inline void send_command(std::shared_ptr<Client> c, uint16_t command,
   send_command(c, command, flag, nullptr, 0);
 }
 
+// Large transfers (e.g. quest files) are sent with send_command_paced, which
+// only adds commands to the client's output buffer while it holds fewer than
+// this many bytes; the rest are sent by send_queued_commands as the buffer
+// drains, so the transfer doesn't all have to be encrypted at once
+constexpr size_t PACED_OUTPUT_BUFFER_BYTES = 0x8000;
+
+void send_command_paced(std::shared_ptr<Client> c, uint16_t command,
+    uint32_t flag, const void* data, size_t size);
+// Sends queued commands until the client's output buffer is full again. If
+// force is true, sends all queued commands regardless of the buffer size.
+void send_queued_commands(std::shared_ptr<Client> c, bool force = false);
+
+// Commands that only describe transient state (e.g. other players' positions)
+// are sent with send_command_droppable. If the client's output buffer is
+// congested, the command isn't sent; instead, it replaces any previous command
+// with the same coalescing key, and only the latest command for each key is
+// sent when the buffer drains. See Client::output_congested_since.
+void send_command_droppable(std::shared_ptr<Client> c, uint16_t command,
+    uint32_t flag, const void* data, size_t size, uint16_t coalesce_key);
+
+constexpr uint16_t COALESCE_KEY_ARROW_UPDATE = 0x0001;
+inline uint16_t coalesce_key_for_movement(uint8_t client_id) {
+  return 0x0100 | client_id;
+}
+
+// Updates the client's congestion state from the size of its output buffer,
+// and sends the coalesced droppable commands if the congestion has ended.
+// This is called after every send and whenever the output buffer drains.
+void update_output_congestion(std::shared_ptr<Client> c);
+
 void send_command_excluding_client(std::shared_ptr<Lobby> l,
     std::shared_ptr<Client> c, uint16_t command, uint32_t flag,
     const void* data, size_t size);
+void send_command_droppable_excluding_client(std::shared_ptr<Lobby> l,
+    std::shared_ptr<Client> c, uint16_t command, uint32_t flag,
+    const void* data, size_t size, uint16_t coalesce_key);
 
 inline void send_command_excluding_client(std::shared_ptr<Lobby> l,
     std::shared_ptr<Client> c, uint16_t command, uint32_t flag) {
@@ -112,6 +145,14 @@ void send_function_call(
     const std::string& suffix = "",
     uint32_t checksum_addr = 0,
     uint32_t checksum_size = 0);
+// Sends a function call that was already generated by
+// CompiledFunctionCode::generate_client_command
+void send_function_call(
+    std::shared_ptr<Client> c,
+    const std::string& code,
+    uint32_t index,
+    uint32_t checksum_addr = 0,
+    uint32_t checksum_size = 0);
 
 void send_reconnect(std::shared_ptr<Client> c, uint32_t address, uint16_t port);
 void send_pc_gc_split_reconnect(std::shared_ptr<Client> c, uint32_t address,
@@ -164,6 +205,12 @@ void send_card_search_result(
     std::shared_ptr<Client> result,
     std::shared_ptr<Lobby> result_lobby);
 
+void send_choice_search_options(std::shared_ptr<Client> c);
+void send_choice_search_results(
+    std::shared_ptr<ServerState> s,
+    std::shared_ptr<Client> c,
+    const std::vector<std::shared_ptr<Client>>& results);
+
 void send_guild_card(std::shared_ptr<Client> c, std::shared_ptr<Client> source);
 void send_menu(std::shared_ptr<Client> c, const std::u16string& menu_name,
     uint32_t menu_id, const std::vector<MenuItem>& items, bool is_info_menu = false);
@@ -8,6 +8,7 @@
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -22,6 +23,7 @@
 
 #include "PSOProtocol.hh"
 #include "ReceiveCommands.hh"
+#include "SendCommands.hh"
 
 using namespace std;
 
@@ -31,7 +33,23 @@ void Server::disconnect_client(struct bufferevent* bev) {
   this->disconnect_client(this->bev_to_client.at(bev));
 }
 
+// Each time a client gets a turn, at most this many commands (or about this
+// many bytes of commands) are processed. Any remaining commands are processed
+// after all other clients with pending input have had a turn, so a client
+// that sends many commands at once can't keep the others waiting.
+static const size_t MAX_COMMANDS_PER_TURN = 32;
+static const size_t MAX_COMMAND_BYTES_PER_TURN = 0x8000;
+
+// How often clients' output buffers are checked for congestion timeouts
+static const uint64_t CHECK_CLIENT_OUTPUT_INTERVAL_USECS = 1000000;
+
+
+
 void Server::disconnect_client(shared_ptr<Client> c) {
+  // Anything still queued is sent (or at least added to the output buffer,
+  // which is drained below) before the client is disconnected
+  send_queued_commands(c, true);
+
   this->bev_to_client.erase(c->bev);
   struct bufferevent* bev = c->bev;
   c->bev = nullptr;
@@ -55,7 +73,11 @@ void Server::disconnect_client(shared_ptr<Client> c) {
     bufferevent_setcb(bev, nullptr,
         Server::dispatch_on_disconnecting_client_output,
         Server::dispatch_on_disconnecting_client_error, this);
+    // Remove the pacing watermark, so the output callback is only called when
+    // the output buffer is completely empty
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
     bufferevent_disable(bev, EV_READ);
+    this->draining_bev_to_start_time.emplace(bev, now());
   }
 
   process_disconnect(this->state, c);
@@ -77,6 +99,18 @@ void Server::dispatch_on_client_input(struct bufferevent* bev, void* ctx) {
   reinterpret_cast<Server*>(ctx)->on_client_input(bev);
 }
 
+void Server::dispatch_on_client_output(struct bufferevent* bev, void* ctx) {
+  reinterpret_cast<Server*>(ctx)->on_client_output(bev);
+}
+
+void Server::dispatch_process_deferred_input(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<Server*>(ctx)->process_deferred_input();
+}
+
+void Server::dispatch_check_client_output(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<Server*>(ctx)->check_client_output();
+}
+
 void Server::dispatch_on_client_error(struct bufferevent* bev, short events,
     void* ctx) {
   reinterpret_cast<Server*>(ctx)->on_client_error(bev, events);
@@ -113,11 +147,10 @@ void Server::on_listen_accept(struct evconnlistener* listener,
       BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
   shared_ptr<Client> c(new Client(bev, listening_socket->version,
       listening_socket->behavior));
+  c->output_high_watermark = this->state->client_output_high_watermark;
+  c->output_low_watermark = this->state->client_output_low_watermark;
   this->bev_to_client.emplace(make_pair(bev, c));
-
-  bufferevent_setcb(bev, &Server::dispatch_on_client_input, nullptr,
-      &Server::dispatch_on_client_error, this);
-  bufferevent_enable(bev, EV_READ | EV_WRITE);
+  this->set_client_callbacks(bev);
 
   process_connect(this->state, c);
 }
@@ -128,6 +161,8 @@ void Server::connect_client(
   this->log(INFO, "Client connected on virtual connection %p", bev);
 
   shared_ptr<Client> c(new Client(bev, version, initial_state));
+  c->output_high_watermark = this->state->client_output_high_watermark;
+  c->output_low_watermark = this->state->client_output_low_watermark;
   this->bev_to_client.emplace(make_pair(bev, c));
 
   // Manually set the remote address, since the bufferevent has no fd and the
@@ -136,14 +171,22 @@ void Server::connect_client(
   sin->sin_family = AF_INET;
   sin->sin_addr.s_addr = htonl(address);
   sin->sin_port = htons(port);
-
-  bufferevent_setcb(bev, &Server::dispatch_on_client_input, nullptr,
-      &Server::dispatch_on_client_error, this);
-  bufferevent_enable(bev, EV_READ | EV_WRITE);
+  this->set_client_callbacks(bev);
 
   process_connect(this->state, c);
 }
 
+void Server::set_client_callbacks(struct bufferevent* bev) {
+  bufferevent_setcb(bev, &Server::dispatch_on_client_input,
+      &Server::dispatch_on_client_output, &Server::dispatch_on_client_error,
+      this);
+  // The output callback is called when the output buffer drains below half
+  // of the pacing limit, so paced transfers are refilled before the client
+  // runs out of data to receive
+  bufferevent_setwatermark(bev, EV_WRITE, PACED_OUTPUT_BUFFER_BYTES / 2, 0);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
 void Server::on_listen_error(struct evconnlistener* listener) {
   int err = EVUTIL_SOCKET_ERROR();
   this->log(ERROR, "Failure on listening socket %d: %d (%s)",
@@ -171,7 +214,14 @@ void Server::on_client_input(struct bufferevent* bev) {
   }
 
   c->last_recv_time = now();
-  this->receive_and_process_commands(c);
+  // If the client is already waiting for its next turn, the new input will be
+  // processed then
+  if (c->has_deferred_input) {
+    return;
+  }
+  if (this->receive_and_process_commands(c)) {
+    this->defer_client_input(c);
+  }
 
   if (c->should_disconnect) {
     this->disconnect_client(bev);
@@ -179,7 +229,84 @@ void Server::on_client_input(struct bufferevent* bev) {
   }
 }
 
+void Server::on_client_output(struct bufferevent* bev) {
+  auto it = this->bev_to_client.find(bev);
+  if (it != this->bev_to_client.end()) {
+    send_queued_commands(it->second);
+    update_output_congestion(it->second);
+  }
+}
+
+void Server::defer_client_input(shared_ptr<Client> c) {
+  c->has_deferred_input = true;
+  this->clients_with_deferred_input.emplace_back(c);
+  // A zero timeout (rather than event_active) makes the deferred input wait
+  // until the next loop iteration, after other clients' I/O callbacks
+  struct timeval tv = {0, 0};
+  event_add(this->process_deferred_input_event.get(), &tv);
+}
+
+void Server::process_deferred_input() {
+  // Clients deferred again during this pass go to the end of the queue and
+  // are processed on the next pass, not this one
+  size_t count = this->clients_with_deferred_input.size();
+  for (size_t x = 0; x < count; x++) {
+    auto c = this->clients_with_deferred_input.front();
+    this->clients_with_deferred_input.pop_front();
+    c->has_deferred_input = false;
+    if (!c->bev) {
+      continue; // Client has disconnected since it was deferred
+    }
+    if (!c->should_disconnect && this->receive_and_process_commands(c)) {
+      this->defer_client_input(c);
+    }
+    if (c->should_disconnect) {
+      this->disconnect_client(c);
+    }
+  }
+}
+
+void Server::check_client_output() {
+  uint64_t t = now();
+  uint64_t timeout = this->state->client_output_congestion_timeout_usecs;
+
+  vector<shared_ptr<Client>> clients_to_disconnect;
+  for (const auto& it : this->bev_to_client) {
+    const auto& c = it.second;
+    update_output_congestion(c);
+    if (c->output_congested_since && (t - c->output_congested_since >= timeout)) {
+      clients_to_disconnect.emplace_back(c);
+    }
+  }
+
+  for (const auto& c : clients_to_disconnect) {
+    struct evbuffer* out_buffer = bufferevent_get_output(c->bev);
+    this->log(WARNING, "Client output buffer has been congested for %" PRIu64 "ms (%zu bytes buffered, %zu commands queued); disconnecting client",
+        (t - c->output_congested_since) / 1000, evbuffer_get_length(out_buffer),
+        c->queued_commands.size());
+    // The client isn't receiving data anyway, so there's no point in moving it
+    // to the draining pool
+    c->queued_commands.clear();
+    c->coalesced_commands.clear();
+    evbuffer_drain(out_buffer, evbuffer_get_length(out_buffer));
+    this->disconnect_client(c);
+  }
+
+  for (auto it = this->draining_bev_to_start_time.begin();
+       it != this->draining_bev_to_start_time.end();) {
+    if (t - it->second >= timeout) {
+      this->log(WARNING, "Disconnected client did not receive its remaining data within %" PRIu64 "ms; closing connection",
+          timeout / 1000);
+      bufferevent_free(it->first);
+      it = this->draining_bev_to_start_time.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
 void Server::on_disconnecting_client_output(struct bufferevent* bev) {
+  this->draining_bev_to_start_time.erase(bev);
   bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
   bufferevent_free(bev);
 }
@@ -203,21 +330,37 @@ void Server::on_disconnecting_client_error(struct bufferevent* bev,
         evutil_socket_error_to_string(err));
   }
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    this->draining_bev_to_start_time.erase(bev);
     bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
     bufferevent_free(bev);
   }
 }
 
-void Server::receive_and_process_commands(shared_ptr<Client> c) {
+bool Server::receive_and_process_commands(shared_ptr<Client> c) {
+  size_t commands_processed = 0;
+  size_t bytes_processed = 0;
+  auto process = [&](uint16_t command, uint16_t flag, const std::string& data) {
+    bytes_processed += data.size();
+    process_command(this->state, c, command, flag, data);
+  };
   try {
-    for_each_received_command(c->bev, c->version, c->crypt_in.get(),
-        [this, c](uint16_t command, uint16_t flag, const std::string& data) {
-          process_command(this->state, c, command, flag, data);
-        });
+    for (;;) {
+      if (!c->bev || c->should_disconnect) {
+        return false;
+      }
+      if ((commands_processed >= MAX_COMMANDS_PER_TURN) ||
+          (bytes_processed >= MAX_COMMAND_BYTES_PER_TURN)) {
+        return (evbuffer_get_length(bufferevent_get_input(c->bev)) > 0);
+      }
+      if (!receive_command(c->bev, c->version, c->crypt_in.get(), process)) {
+        return false;
+      }
+      commands_processed++;
+    }
   } catch (const exception& e) {
     this->log(INFO, "Error in client stream: %s", e.what());
     c->should_disconnect = true;
-    return;
+    return false;
   }
 }
 
@@ -226,7 +369,14 @@ Server::Server(
     shared_ptr<ServerState> state)
   : log("[Server] "),
     base(base),
-    state(state) { }
+    process_deferred_input_event(event_new(this->base.get(), -1, EV_TIMEOUT,
+        &Server::dispatch_process_deferred_input, this), event_free),
+    check_client_output_event(event_new(this->base.get(), -1, EV_TIMEOUT | EV_PERSIST,
+        &Server::dispatch_check_client_output, this), event_free),
+    state(state) {
+  struct timeval tv = usecs_to_timeval(CHECK_CLIENT_OUTPUT_INTERVAL_USECS);
+  event_add(this->check_client_output_event.get(), &tv);
+}
 
 void Server::listen(
     const std::string& name,
@@ -282,4 +432,12 @@ shared_ptr<Client> Server::get_client() const {
     throw runtime_error("multiple clients on game server");
   }
   return this->bev_to_client.begin()->second;
+}
+
+vector<shared_ptr<Client>> Server::get_all_clients() const {
+  vector<shared_ptr<Client>> ret;
+  for (const auto& it : this->bev_to_client) {
+    ret.emplace_back(it.second);
+  }
+  return ret;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <event2/event.h>
 
+#include <deque>
 #include <unordered_set>
 #include <vector>
 #include <string>
@@ -30,6 +31,10 @@ public:
       GameVersion version, ServerBehavior initial_state);
 
   std::shared_ptr<Client> get_client() const;
+  std::vector<std::shared_ptr<Client>> get_all_clients() const;
+  inline size_t num_draining_clients() const {
+    return this->draining_bev_to_start_time.size();
+  }
 
 private:
   PrefixedLogger log;
@@ -52,18 +57,34 @@ private:
   std::unordered_map<int, ListeningSocket> listening_sockets;
   std::unordered_map<struct bufferevent*, std::shared_ptr<Client>> bev_to_client;
 
+  // Clients that have complete commands in their input buffers that haven't
+  // been processed yet, in the order they'll get their next turn
+  std::deque<std::shared_ptr<Client>> clients_with_deferred_input;
+  std::unique_ptr<struct event, void(*)(struct event*)> process_deferred_input_event;
+
+  // Disconnected clients whose output buffers haven't drained yet, and when
+  // they were disconnected. These are freed if they haven't drained within the
+  // congestion timeout.
+  std::unordered_map<struct bufferevent*, uint64_t> draining_bev_to_start_time;
+  std::unique_ptr<struct event, void(*)(struct event*)> check_client_output_event;
+
   std::shared_ptr<ServerState> state;
 
   static void dispatch_on_listen_accept(struct evconnlistener* listener,
       evutil_socket_t fd, struct sockaddr *address, int socklen, void* ctx);
   static void dispatch_on_listen_error(struct evconnlistener* listener, void* ctx);
   static void dispatch_on_client_input(struct bufferevent* bev, void* ctx);
+  static void dispatch_on_client_output(struct bufferevent* bev, void* ctx);
   static void dispatch_on_client_error(struct bufferevent* bev, short events,
       void* ctx);
   static void dispatch_on_disconnecting_client_output(struct bufferevent* bev,
       void* ctx);
   static void dispatch_on_disconnecting_client_error(struct bufferevent* bev,
       short events, void* ctx);
+  static void dispatch_process_deferred_input(evutil_socket_t fd, short events,
+      void* ctx);
+  static void dispatch_check_client_output(evutil_socket_t fd, short events,
+      void* ctx);
 
   void disconnect_client(struct bufferevent* bev);
   void disconnect_client(std::shared_ptr<Client> c);
@@ -72,9 +93,17 @@ private:
       struct sockaddr *address, int socklen);
   void on_listen_error(struct evconnlistener* listener);
   void on_client_input(struct bufferevent* bev);
+  void on_client_output(struct bufferevent* bev);
   void on_client_error(struct bufferevent* bev, short events);
   void on_disconnecting_client_output(struct bufferevent* bev);
   void on_disconnecting_client_error(struct bufferevent* bev, short events);
 
-  void receive_and_process_commands(std::shared_ptr<Client> c);
+  void set_client_callbacks(struct bufferevent* bev);
+
+  // Returns true if there are more commands to process, but the client has
+  // used its budget for this turn
+  bool receive_and_process_commands(std::shared_ptr<Client> c);
+  void defer_client_input(std::shared_ptr<Client> c);
+  void process_deferred_input();
+  void check_client_output();
 };
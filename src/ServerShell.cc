@@ -1,11 +1,17 @@
 #include "ServerShell.hh"
 
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <thread>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
 
+#include "EventLoopThread.hh"
 #include "ServerState.hh"
 #include "SendCommands.hh"
 #include "StaticGameData.hh"
@@ -24,11 +30,12 @@ void ServerShell::print_prompt() {
   fflush(stdout);
 }
 
-shared_ptr<ProxyServer::LinkedSession> ServerShell::get_proxy_session() {
+void ServerShell::call_on_proxy_session(
+    const function<void(shared_ptr<ProxyServer::LinkedSession>)>& fn) {
   if (!this->state->proxy_server.get()) {
     throw runtime_error("the proxy server is disabled");
   }
-  return this->state->proxy_server->get_session();
+  this->state->proxy_server->call_on_session(fn);
 }
 
 static void set_boolean(bool* target, const string& args) {
@@ -61,9 +68,14 @@ Server commands:\n\
   exit (or ctrl+d)\n\
     Shut down the server.\n\
   reload <item> ...\n\
-    Reload data. <item> can be licenses, battle-params, level-table, or quests.\n\
+    Reload data. <item> can be licenses, battle-params, rare-items, level-table,\n\
+    quests, or functions. Only functions that have changed are recompiled;\n\
+    reloading functions also reloads DOL files.\n\
     Reloading will not affect items that are in use; for example, if a client\'s\n\
     license is deleted by reloading, they will not be disconnected immediately.\n\
+    Everything except licenses is loaded on a separate thread, so the server\n\
+    keeps running while it loads; a message is logged when the new data is in\n\
+    use.\n\
   add-license <parameters>\n\
     Add a license to the server. <parameters> is some subset of the following:\n\
       bb-username=<username> (BB username)\n\
@@ -89,6 +101,13 @@ Server commands:\n\
     Song IDs are 0 through 51; the default song is -1.\n\
   announce <message>\n\
     Send an announcement message to all players.\n\
+  show-loop-lag\n\
+    Show how late each event loop thread has been in running its timers, which\n\
+    is approximately how long it has been blocked. The maximum and percentiles\n\
+    are reset each time this command is run.\n\
+  show-client-output\n\
+    Show how much data is waiting to be sent to each client on the game server,\n\
+    and whether its connection is congested.\n\
 \n\
 Proxy commands (these will only work when exactly one client is connected):\n\
   sc <data>\n\
@@ -152,6 +171,10 @@ Proxy commands (these will only work when exactly one client is connected):\n\
     the return value.\n\
   close-idle-sessions\n\
     Closes all sessions that don\'t have a client and server connected.\n\
+  show-proxy-shards\n\
+    Show the number of sessions and commands handled by each proxy shard (each\n\
+    proxy worker thread, if ProxyWorkerThreads is set in config.json), and how\n\
+    long its connections to remote servers have taken to open.\n\
 ");
 
 
@@ -163,24 +186,105 @@ Proxy commands (these will only work when exactly one client is connected):\n\
     if (types.empty()) {
       throw invalid_argument("no data type given");
     }
+    bool reload_config = false;
     for (const string& type : types) {
       if (type == "licenses") {
-        shared_ptr<LicenseManager> lm(new LicenseManager("system/licenses.nsi"));
-        this->state->license_manager = lm;
-      } else if (type == "battle-params") {
-        shared_ptr<BattleParamTable> bpt(new BattleParamTable("system/blueburst/BattleParamEntry"));
-        this->state->battle_params = bpt;
-      } else if (type == "level-table") {
-        shared_ptr<LevelTable> lt(new LevelTable("system/blueburst/PlyLevelTbl.prs", true));
-        this->state->level_table = lt;
-      } else if (type == "quests") {
-        shared_ptr<QuestIndex> qi(new QuestIndex("system/quests"));
-        this->state->quest_index = qi;
+        // This is reloaded in place since the proxy server's worker threads
+        // may be using the license manager
+        this->state->license_manager->reload();
+      } else if ((type == "battle-params") || (type == "rare-items") ||
+                 (type == "level-table") || (type == "quests") ||
+                 (type == "functions")) {
+        reload_config = true;
       } else {
         throw invalid_argument("incorrect data type");
       }
     }
 
+    if (reload_config) {
+      // Everything else is loaded on a separate thread, then published as a
+      // new config snapshot, so the event loop isn't blocked while loading
+      auto state = this->state;
+      thread t([state, types]() {
+        try {
+          uint64_t start_time = now();
+          shared_ptr<const BattleParamTable> bpt;
+          shared_ptr<const RareItemTable> rit;
+          shared_ptr<const LevelTable> lt;
+          shared_ptr<const QuestIndex> qi;
+          shared_ptr<const FunctionCodeIndex> fci;
+          shared_ptr<const DOLFileIndex> dfi;
+          for (const string& type : types) {
+            if (type == "battle-params") {
+              bpt.reset(new BattleParamTable("system/blueburst/BattleParamEntry"));
+            } else if (type == "rare-items") {
+              rit.reset(new RareItemTable("system/blueburst/ItemRT.rel"));
+            } else if (type == "level-table") {
+              lt.reset(new LevelTable("system/blueburst/PlyLevelTbl.prs", true));
+            } else if (type == "quests") {
+              qi.reset(new QuestIndex("system/quests"));
+            } else if (type == "functions") {
+              // DOL files contain precompiled function calls, so they have to
+              // be reloaded when the functions change
+              fci.reset(new FunctionCodeIndex("system/ppc", "system/ppc/.cache"));
+              dfi.reset(new DOLFileIndex("system/dol", fci));
+            }
+          }
+          state->update_config([&](ServerConfigSnapshot& config) {
+            if (bpt) {
+              config.battle_params = bpt;
+            }
+            if (rit) {
+              config.rare_item_table = rit;
+            }
+            if (lt) {
+              config.level_table = lt;
+            }
+            if (qi) {
+              config.quest_index = qi;
+            }
+            if (fci) {
+              config.function_code_index = fci;
+              config.dol_file_index = dfi;
+            }
+          });
+          log(INFO, "Reload complete after %" PRIu64 "ms", (now() - start_time) / 1000);
+        } catch (const exception& e) {
+          log(WARNING, "Reload failed: %s", e.what());
+        }
+      });
+      t.detach();
+    }
+
+  } else if (command_name == "show-loop-lag") {
+    for (const auto& monitor : this->state->event_loop_lag_monitors) {
+      auto stats = monitor->get_stats(true);
+      uint64_t average = stats.sample_count ? (stats.total_lag_usecs / stats.sample_count) : 0;
+      fprintf(stderr, "%s: last %" PRIu64 "us, average %" PRIu64 "us, p50 <%" PRIu64 "us, p99 <%" PRIu64 "us, max %" PRIu64 "us (%" PRIu64 " samples)\n",
+          monitor->get_name().c_str(), stats.last_lag_usecs, average,
+          stats.p50_lag_usecs, stats.p99_lag_usecs, stats.max_lag_usecs,
+          stats.sample_count);
+    }
+
+  } else if (command_name == "show-client-output") {
+    if (!this->state->game_server) {
+      throw runtime_error("game server is not running");
+    }
+    uint64_t t = now();
+    for (const auto& c : this->state->game_server->get_all_clients()) {
+      string congestion_str = c->output_congested_since
+          ? string_printf("congested for %" PRIu64 "ms", (t - c->output_congested_since) / 1000)
+          : "not congested";
+      fprintf(stderr, "%010" PRIu32 ": %zu bytes buffered (max %zu), %zu commands queued, %zu commands coalesced, %zu commands dropped, %s\n",
+          c->license ? c->license->serial_number : 0,
+          c->bev ? evbuffer_get_length(bufferevent_get_output(c->bev)) : 0,
+          c->max_output_buffer_bytes, c->queued_commands.size(),
+          c->coalesced_commands.size(), c->dropped_command_count,
+          congestion_str.c_str());
+    }
+    fprintf(stderr, "%zu disconnected clients are still receiving data\n",
+        this->state->game_server->num_draining_clients());
+
   } else if (command_name == "add-license") {
     shared_ptr<License> l(new License());
 
@@ -292,16 +396,22 @@ Proxy commands (these will only work when exactly one client is connected):\n\
       throw invalid_argument("no data given");
     }
 
-    shared_ptr<ProxyServer::LinkedSession> proxy_session;
+    // If there's no proxy session, send the command to the game server's
+    // client instead
+    bool found_proxy_session = false;
     try {
-      proxy_session = this->get_proxy_session();
-    } catch (const exception&) { }
-
-    if (proxy_session.get()) {
-      bool to_server = (command_name[1] == 's');
-      proxy_session->send_to_end_with_header(to_server, data);
+      this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+        found_proxy_session = true;
+        bool to_server = (command_name[1] == 's');
+        session->send_to_end_with_header(to_server, data);
+      });
+    } catch (const exception&) {
+      if (found_proxy_session) {
+        throw;
+      }
+    }
 
-    } else {
+    if (!found_proxy_session) {
       if (command_name [1] == 's') {
         throw runtime_error("cannot send to server in non-proxy session");
       }
@@ -311,111 +421,139 @@ Proxy commands (these will only work when exactly one client is connected):\n\
     }
 
   } else if ((command_name == "chat") || (command_name == "dchat")) {
-    auto session = this->get_proxy_session();
-
-    string data(8, '\0');
-    data.push_back('\x09');
-    data.push_back('E');
-    if (command_name == "dchat") {
-      data += parse_data_string(command_args);
-    } else {
-      data += command_args;
-    }
-    data.push_back('\0');
-    data.resize((data.size() + 3) & (~3));
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      string data(8, '\0');
+      data.push_back('\x09');
+      data.push_back('E');
+      if (command_name == "dchat") {
+        data += parse_data_string(command_args);
+      } else {
+        data += command_args;
+      }
+      data.push_back('\0');
+      data.resize((data.size() + 3) & (~3));
 
-    session->send_to_end(true, 0x06, 0x00, data);
+      session->send_to_end(true, 0x06, 0x00, data);
+    });
 
   } else if (command_name == "marker") {
-    auto session = this->get_proxy_session();
-    session->send_to_end(true, 0x89, stoul(command_args));
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      session->send_to_end(true, 0x89, stoul(command_args));
+    });
 
   } else if (command_name == "warp") {
-    auto session = this->get_proxy_session();
-
-    PSOSubcommand cmds[2];
-    cmds[0].word[0] = 0x0294;
-    cmds[0].word[1] = session->lobby_client_id;
-    cmds[1].dword = stoul(command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      PSOSubcommand cmds[2];
+      cmds[0].word[0] = 0x0294;
+      cmds[0].word[1] = session->lobby_client_id;
+      cmds[1].dword = stoul(command_args);
 
-    session->send_to_end(false, 0x60, 0x00, &cmds, sizeof(cmds));
-    session->send_to_end(true, 0x60, 0x00, &cmds, sizeof(cmds));
+      session->send_to_end(false, 0x60, 0x00, &cmds, sizeof(cmds));
+      session->send_to_end(true, 0x60, 0x00, &cmds, sizeof(cmds));
+    });
 
   } else if ((command_name == "info-board") || (command_name == "info-board-data")) {
-    auto session = this->get_proxy_session();
-
-    string data;
-    if (command_name == "info-board-data") {
-      data += parse_data_string(command_args);
-    } else {
-      data += command_args;
-    }
-    data.push_back('\0');
-    data.resize((data.size() + 3) & (~3));
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      string data;
+      if (command_name == "info-board-data") {
+        data += parse_data_string(command_args);
+      } else {
+        data += command_args;
+      }
+      data.push_back('\0');
+      data.resize((data.size() + 3) & (~3));
 
-    session->send_to_end(true, 0xD9, 0x00, data);
+      session->send_to_end(true, 0xD9, 0x00, data);
+    });
 
   } else if (command_name == "set-override-section-id") {
-    auto session = this->get_proxy_session();
-    if (command_args.empty()) {
-      session->override_section_id = -1;
-    } else {
-      session->override_section_id = section_id_for_name(command_args);
-    }
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      if (command_args.empty()) {
+        session->override_section_id = -1;
+      } else {
+        session->override_section_id = section_id_for_name(command_args);
+      }
+    });
 
   } else if (command_name == "set-override-event") {
-    auto session = this->get_proxy_session();
-    if (command_args.empty()) {
-      session->override_lobby_event = -1;
-    } else {
-      session->override_lobby_event = event_for_name(command_args);
-      session->send_to_end(false, 0xDA, session->override_lobby_event);
-    }
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      if (command_args.empty()) {
+        session->override_lobby_event = -1;
+      } else {
+        session->override_lobby_event = event_for_name(command_args);
+        session->send_to_end(false, 0xDA, session->override_lobby_event);
+      }
+    });
 
   } else if (command_name == "set-override-lobby-number") {
-    auto session = this->get_proxy_session();
-    if (command_args.empty()) {
-      session->override_lobby_number = -1;
-    } else {
-      session->override_lobby_number = lobby_type_for_name(command_args);
-    }
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      if (command_args.empty()) {
+        session->override_lobby_number = -1;
+      } else {
+        session->override_lobby_number = lobby_type_for_name(command_args);
+      }
+    });
 
   } else if (command_name == "set-chat-filter") {
-    auto session = this->get_proxy_session();
-    set_boolean(&session->enable_chat_filter, command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      set_boolean(&session->enable_chat_filter, command_args);
+    });
 
   } else if (command_name == "set-chat-safety") {
-    auto session = this->get_proxy_session();
-    set_boolean(&session->suppress_newserv_commands, command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      set_boolean(&session->suppress_newserv_commands, command_args);
+    });
 
   } else if (command_name == "set-infinite-hp") {
-    auto session = this->get_proxy_session();
-    set_boolean(&session->infinite_hp, command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      set_boolean(&session->infinite_hp, command_args);
+    });
 
   } else if (command_name == "set-infinite-tp") {
-    auto session = this->get_proxy_session();
-    set_boolean(&session->infinite_tp, command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      set_boolean(&session->infinite_tp, command_args);
+    });
 
   } else if (command_name == "set-switch-assist") {
-    auto session = this->get_proxy_session();
-    set_boolean(&session->enable_switch_assist, command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      set_boolean(&session->enable_switch_assist, command_args);
+    });
 
   } else if (command_name == "set-save-files") {
-    auto session = this->get_proxy_session();
-    set_boolean(&session->save_files, command_args);
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      set_boolean(&session->save_files, command_args);
+    });
 
   } else if (command_name == "set-block-function-calls") {
-    auto session = this->get_proxy_session();
-    if (command_args.empty()) {
-      session->function_call_return_value = -1;
-    } else {
-      session->function_call_return_value = stoul(command_args);
-    }
+    this->call_on_proxy_session([&](shared_ptr<ProxyServer::LinkedSession> session) {
+      if (command_args.empty()) {
+        session->function_call_return_value = -1;
+      } else {
+        session->function_call_return_value = stoul(command_args);
+      }
+    });
 
   } else if (command_name == "close-idle-sessions") {
     size_t count = this->state->proxy_server->delete_disconnected_sessions();
     fprintf(stderr, "%zu sessions closed\n", count);
 
+  } else if (command_name == "show-proxy-shards") {
+    if (!this->state->proxy_server.get()) {
+      throw runtime_error("the proxy server is disabled");
+    }
+    for (const auto& stats : this->state->proxy_server->get_shard_stats()) {
+      fprintf(stderr, "shard %zu: %zu linked sessions, %zu unlinked sessions, %" PRIu64 " commands processed, %" PRIu64 " commands forwarded without decryption, %" PRIu64 " sessions moved in from other shards\n",
+          stats.index, stats.linked_session_count, stats.unlinked_session_count,
+          stats.commands_processed, stats.commands_forwarded,
+          stats.sessions_moved_in);
+      const auto& up = stats.upstream;
+      uint64_t average = up.connects_completed ? (up.total_connect_usecs / up.connects_completed) : 0;
+      fprintf(stderr, "  upstream: %" PRIu64 " connections started, %" PRIu64 " completed (average %" PRIu64 "us, max %" PRIu64 "us), %" PRIu64 " failed, %" PRIu64 " prewarmed connections used, %" PRIu64 " expired\n",
+          up.connects_started, up.connects_completed, average,
+          up.max_connect_usecs, up.connects_failed,
+          up.pooled_connections_used, up.pooled_connections_expired);
+    }
+
   } else {
     throw invalid_argument("unknown command; try \'help\'");
   }
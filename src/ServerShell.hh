@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -22,7 +23,9 @@ public:
   ServerShell& operator=(ServerShell&&) = delete;
 
 protected:
-  std::shared_ptr<ProxyServer::LinkedSession> get_proxy_session();
+  // Calls fn on the proxy session's thread; see ProxyServer::call_on_session
+  void call_on_proxy_session(
+      const std::function<void(std::shared_ptr<ProxyServer::LinkedSession>)>& fn);
 
   virtual void print_prompt();
   virtual void execute_command(const std::string& command);
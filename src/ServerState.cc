@@ -16,11 +16,22 @@ using namespace std;
 
 ServerState::ServerState()
   : dns_server_port(0),
+    dns_server_use_thread(false),
     ip_stack_debug(false),
+    ip_stack_capture_rotate_bytes(0),
+    ip_stack_capture_rotate_usecs(0),
     allow_unregistered_users(false),
+    proxy_fast_passthrough(false),
+    proxy_worker_threads(0),
+    proxy_prewarm_destinations(false),
+    client_output_high_watermark(0x100000),
+    client_output_low_watermark(0x40000),
+    client_output_congestion_timeout_usecs(30000000),
     run_shell_behavior(RunShellBehavior::DEFAULT), next_lobby_id(1),
     pre_lobby_event(0),
     ep3_menu_song(-1) {
+  this->set_config(make_shared<ServerConfigSnapshot>());
+
   vector<shared_ptr<Lobby>> ep3_only_lobbies;
 
   for (size_t x = 0; x < 20; x++) {
@@ -50,6 +61,32 @@ ServerState::ServerState()
       ep3_only_lobbies.end());
 }
 
+shared_ptr<const ServerConfigSnapshot> ServerState::config() const {
+  return atomic_load(&this->config_snapshot);
+}
+
+void ServerState::set_config(shared_ptr<const ServerConfigSnapshot> config) {
+  atomic_store(&this->config_snapshot, config);
+}
+
+void ServerState::update_config(
+    const function<void(ServerConfigSnapshot&)>& fn) {
+  auto prev_config = this->config();
+  for (;;) {
+    shared_ptr<ServerConfigSnapshot> new_config(
+        new ServerConfigSnapshot(*prev_config));
+    fn(*new_config);
+    shared_ptr<const ServerConfigSnapshot> new_const_config = new_config;
+    // On failure, this sets prev_config to the current snapshot
+    if (atomic_compare_exchange_strong(
+        &this->config_snapshot, &prev_config, new_const_config)) {
+      return;
+    }
+  }
+}
+
+
+
 void ServerState::add_client_to_available_lobby(shared_ptr<Client> c) {
   const auto& search_order = (c->flags & Client::Flag::EPISODE_3)
       ? this->public_lobby_search_order_ep3
@@ -68,6 +105,7 @@ void ServerState::add_client_to_available_lobby(shared_ptr<Client> c) {
     // TODO: Add the user to a dynamically-created private lobby instead
     throw out_of_range("all lobbies full");
   }
+  this->update_client_indexes(c);
 
   // Send a join message to the joining player, and notifications to all others
   this->send_lobby_join_notifications(added_to_lobby, c);
@@ -76,6 +114,8 @@ void ServerState::add_client_to_available_lobby(shared_ptr<Client> c) {
 void ServerState::remove_client_from_lobby(shared_ptr<Client> c) {
   auto l = this->id_to_lobby.at(c->lobby_id);
   l->remove_client(c);
+  this->invalidate_game_menu(l);
+  this->update_client_indexes(c);
   if (!(l->flags & Lobby::Flag::PERSISTENT) && (l->count_clients() == 0)) {
     this->remove_lobby(l->lobby_id);
   } else {
@@ -97,8 +137,11 @@ void ServerState::change_client_lobby(shared_ptr<Client> c, shared_ptr<Lobby> ne
     send_lobby_message_box(c, u"$C6Can't change lobby\n\n$C7The lobby is full.");
     return;
   }
+  this->update_client_indexes(c);
+  this->invalidate_game_menu(new_lobby);
 
   if (current_lobby) {
+    this->invalidate_game_menu(current_lobby);
     if (!(current_lobby->flags & Lobby::Flag::PERSISTENT) && (current_lobby->count_clients() == 0)) {
       this->remove_lobby(current_lobby->lobby_id);
     } else {
@@ -139,10 +182,52 @@ void ServerState::add_lobby(shared_ptr<Lobby> l) {
     throw logic_error("lobby already exists with the given id");
   }
   this->id_to_lobby.emplace(l->lobby_id, l);
+
+  if (l->is_game()) {
+    auto& partition = this->game_menu_partition(
+        l->version, !!(l->flags & Lobby::Flag::EPISODE_3_ONLY));
+    partition.id_to_game.emplace(l->lobby_id, l);
+    partition.menu_data.clear();
+  }
 }
 
 void ServerState::remove_lobby(uint32_t lobby_id) {
-  this->id_to_lobby.erase(lobby_id);
+  auto it = this->id_to_lobby.find(lobby_id);
+  if (it == this->id_to_lobby.end()) {
+    return;
+  }
+
+  auto l = it->second;
+  if (l->is_game()) {
+    auto& partition = this->game_menu_partition(
+        l->version, !!(l->flags & Lobby::Flag::EPISODE_3_ONLY));
+    partition.id_to_game.erase(lobby_id);
+    partition.menu_data.clear();
+  }
+  this->id_to_lobby.erase(it);
+}
+
+ServerState::GameMenuPartition& ServerState::game_menu_partition(
+    GameVersion version, bool is_ep3) {
+  return this->game_menu_partitions[make_pair(version, is_ep3)];
+}
+
+void ServerState::invalidate_game_menu(shared_ptr<Lobby> l) {
+  if (l->is_game()) {
+    this->game_menu_partition(
+        l->version, !!(l->flags & Lobby::Flag::EPISODE_3_ONLY)).menu_data.clear();
+  }
+}
+
+void ServerState::update_client_indexes(shared_ptr<Client> c) {
+  this->client_directory.update(c);
+  auto l = c->lobby_id ? this->find_lobby(c->lobby_id) : nullptr;
+  this->choice_search_index.update(c, l && l->is_game());
+}
+
+void ServerState::remove_client_from_indexes(shared_ptr<Client> c) {
+  this->client_directory.remove(c);
+  this->choice_search_index.remove(c);
 }
 
 shared_ptr<Client> ServerState::find_client(const std::u16string* identifier,
@@ -154,24 +239,12 @@ shared_ptr<Client> ServerState::find_client(const std::u16string* identifier,
     } catch (const exception&) { }
   }
 
-  // look in the current lobby first
-  if (l) {
-    try {
-      return l->find_client(identifier, serial_number);
-    } catch (const out_of_range&) { }
-  }
-
-  // look in all lobbies if not found
-  for (auto& other_l : this->all_lobbies()) {
-    if (l == other_l) {
-      continue; // don't bother looking again
-    }
-    try {
-      return other_l->find_client(identifier, serial_number);
-    } catch (const out_of_range&) { }
+  // Serial numbers are 32 bits, so a longer number can't match any client
+  if (serial_number > 0xFFFFFFFF) {
+    serial_number = 0;
   }
-
-  throw out_of_range("client not found");
+  return this->client_directory.find(
+      serial_number, identifier, l ? l->lobby_id : 0);
 }
 
 uint32_t ServerState::connect_address_for_client(std::shared_ptr<Client> c) {
@@ -337,11 +410,11 @@ void ServerState::create_menus(shared_ptr<const JSONObject> config_json) {
   }
   this->main_menu.emplace_back(MainMenuItemID::DOWNLOAD_QUESTS, u"Download quests",
       u"Download quests", MenuItem::Flag::INVISIBLE_ON_BB);
-  if (!this->dol_file_index->empty()) {
+  if (!this->config()->dol_file_index->empty()) {
     this->main_menu.emplace_back(MainMenuItemID::PATCHES, u"Patches",
         u"Change game\nbehaviors", MenuItem::Flag::GC_ONLY | MenuItem::Flag::REQUIRES_SEND_FUNCTION_CALL);
   }
-  if (!this->dol_file_index->empty()) {
+  if (!this->config()->dol_file_index->empty()) {
     this->main_menu.emplace_back(MainMenuItemID::PROGRAMS, u"Programs",
         u"Run GameCube\nprograms", MenuItem::Flag::GC_ONLY | MenuItem::Flag::REQUIRES_SEND_FUNCTION_CALL | MenuItem::Flag::REQUIRES_SAVE_DISABLED);
   }
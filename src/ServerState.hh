@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <phosg/JSON.hh>
@@ -9,7 +10,9 @@
 #include <unordered_map>
 #include <vector>
 
+#include "ChoiceSearch.hh"
 #include "Client.hh"
+#include "ClientDirectory.hh"
 #include "FunctionCompiler.hh"
 #include "Items.hh"
 #include "LevelTable.hh"
@@ -23,6 +26,7 @@
 // Forwawrd declarations due to reference cycles
 class ProxyServer;
 class Server;
+class EventLoopLagMonitor;
 
 struct PortConfiguration {
   std::string name;
@@ -31,6 +35,21 @@ struct PortConfiguration {
   ServerBehavior behavior;
 };
 
+// Read-mostly data that can be reloaded while the server is running. A
+// snapshot is never modified after it's published; reloading builds a new
+// snapshot and replaces the current one atomically, so handlers on any thread
+// see a consistent set of data and never wait for a reload to finish.
+struct ServerConfigSnapshot {
+  std::shared_ptr<const FunctionCodeIndex> function_code_index;
+  std::shared_ptr<const DOLFileIndex> dol_file_index;
+  std::shared_ptr<const Ep3DataIndex> ep3_data_index;
+  std::shared_ptr<const QuestIndex> quest_index;
+  std::shared_ptr<const LevelTable> level_table;
+  std::shared_ptr<const BattleParamTable> battle_params;
+  std::shared_ptr<const RareItemTable> rare_item_table;
+  std::shared_ptr<const CommonItemCreator> common_item_creator;
+};
+
 struct ServerState {
   enum class RunShellBehavior {
     DEFAULT = 0,
@@ -43,18 +62,23 @@ struct ServerState {
   std::unordered_map<uint16_t, std::shared_ptr<PortConfiguration>> number_to_port_config;
   std::string username;
   uint16_t dns_server_port;
+  bool dns_server_use_thread;
   std::vector<std::string> ip_stack_addresses;
   bool ip_stack_debug;
+  std::string ip_stack_capture_filename;
+  size_t ip_stack_capture_rotate_bytes;
+  uint64_t ip_stack_capture_rotate_usecs;
   bool allow_unregistered_users;
+  bool proxy_fast_passthrough;
+  size_t proxy_worker_threads;
+  bool proxy_prewarm_destinations;
+  size_t client_output_high_watermark;
+  size_t client_output_low_watermark;
+  uint64_t client_output_congestion_timeout_usecs;
   RunShellBehavior run_shell_behavior;
   std::vector<std::shared_ptr<const PSOBBEncryption::KeyFile>> bb_private_keys;
-  std::shared_ptr<const FunctionCodeIndex> function_code_index;
-  std::shared_ptr<const DOLFileIndex> dol_file_index;
-  std::shared_ptr<const Ep3DataIndex> ep3_data_index;
-  std::shared_ptr<const QuestIndex> quest_index;
-  std::shared_ptr<const LevelTable> level_table;
-  std::shared_ptr<const BattleParamTable> battle_params;
-  std::shared_ptr<const CommonItemCreator> common_item_creator;
+  // Don't access this directly; use config(), set_config(), or update_config()
+  std::shared_ptr<const ServerConfigSnapshot> config_snapshot;
 
   std::shared_ptr<LicenseManager> license_manager;
 
@@ -74,6 +98,16 @@ struct ServerState {
   std::vector<std::shared_ptr<Lobby>> public_lobby_search_order;
   std::vector<std::shared_ptr<Lobby>> public_lobby_search_order_ep3;
   std::atomic<int32_t> next_lobby_id;
+  // Games are also indexed by version and Episode 3 flag (the criteria used to
+  // build the game menu), and the encoded game menu (08) for each partition is
+  // cached until a game in that partition is created, destroyed, or changed
+  struct GameMenuPartition {
+    std::map<uint32_t, std::shared_ptr<Lobby>> id_to_game;
+    std::string menu_data; // Empty if it needs to be regenerated
+  };
+  std::map<std::pair<GameVersion, bool>, GameMenuPartition> game_menu_partitions;
+  ClientDirectory client_directory;
+  ChoiceSearchIndex choice_search_index;
   uint8_t pre_lobby_event;
   int32_t ep3_menu_song;
 
@@ -84,8 +118,17 @@ struct ServerState {
   std::shared_ptr<ProxyServer> proxy_server;
   std::shared_ptr<Server> game_server;
 
+  std::vector<std::shared_ptr<EventLoopLagMonitor>> event_loop_lag_monitors;
+
   ServerState();
 
+  std::shared_ptr<const ServerConfigSnapshot> config() const;
+  void set_config(std::shared_ptr<const ServerConfigSnapshot> config);
+  // Publishes a copy of the current snapshot modified by fn. If another thread
+  // publishes a snapshot at the same time, fn is called again on a copy of that
+  // snapshot, so fn should only assign fields (do any slow work beforehand).
+  void update_config(const std::function<void(ServerConfigSnapshot&)>& fn);
+
   void add_client_to_available_lobby(std::shared_ptr<Client> c);
   void remove_client_from_lobby(std::shared_ptr<Client> c);
   void change_client_lobby(std::shared_ptr<Client> c,
@@ -100,6 +143,16 @@ struct ServerState {
   void add_lobby(std::shared_ptr<Lobby> l);
   void remove_lobby(uint32_t lobby_id);
 
+  GameMenuPartition& game_menu_partition(GameVersion version, bool is_ep3);
+  // Must be called when a game's player count, name, or password changes
+  void invalidate_game_menu(std::shared_ptr<Lobby> l);
+
+  // Must be called when a client's license, player name, level, class,
+  // section ID, lobby, or Choice Search setting changes
+  void update_client_indexes(std::shared_ptr<Client> c);
+  void remove_client_from_indexes(std::shared_ptr<Client> c);
+
+  // Returns nullptr if there's no matching client in any lobby
   std::shared_ptr<Client> find_client(
     const std::u16string* identifier = nullptr,
     uint64_t serial_number = 0,
@@ -5,10 +5,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <vector>
-#include <phosg/Filesystem.hh>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <phosg/Strings.hh>
 
+#include "SJISTable.hh"
+
 using namespace std;
 
 
@@ -32,62 +36,120 @@ int char16ncmp(const char16_t* s1, const char16_t* s2, size_t count) {
 
 
 
-static vector<char16_t> unicode_to_sjis_table_data;
-static vector<char16_t> sjis_to_unicode_table_data;
-
-static void load_sjis_tables() {
-  unicode_to_sjis_table_data.resize(0x10000, 0);
-  sjis_to_unicode_table_data.resize(0x10000, 0);
+// Characters in this range (except 5C) are the same in ASCII, Shift-JIS, and
+// Unicode. In Shift-JIS, 5C is the yen sign and 7E is an overline, so those
+// have to go through the tables.
+static inline bool is_direct_char(uint16_t ch) {
+  return (ch >= 0x20) && (ch < 0x7E) && (ch != 0x5C);
+}
 
-  // TODO: this is inefficient; it makes multiple copies of the string
-  auto file_contents = load_file("system/sjis-table.ini");
-  auto lines = split(file_contents, '\n');
-  for (auto line : lines) {
-    auto tokens = split(line, '\t');
-    if (tokens.size() < 2) {
-      continue;
+// These convert the run of direct characters at the beginning of src (up to
+// count characters), and return the number of characters converted. Most text
+// the server handles (player names, chat, lobby names) is entirely or mostly
+// ASCII, so this avoids the table lookups and per-character branches for most
+// characters. On x86, 16 characters are checked and converted at a time.
+static size_t decode_direct_chars(char16_t* dest, const char* src, size_t count) {
+  size_t x = 0;
+#ifdef __SSE2__
+  const __m128i min_minus_1 = _mm_set1_epi8(0x1F);
+  const __m128i max_plus_1 = _mm_set1_epi8(0x7E);
+  const __m128i backslash = _mm_set1_epi8(0x5C);
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= count; x += 16) {
+    // Bytes 80-FF are negative here, so they fail the first comparison
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+    __m128i direct = _mm_andnot_si128(_mm_cmpeq_epi8(v, backslash),
+        _mm_and_si128(_mm_cmpgt_epi8(v, min_minus_1), _mm_cmplt_epi8(v, max_plus_1)));
+    if (_mm_movemask_epi8(direct) != 0xFFFF) {
+      break;
     }
-    char16_t sjis_char = stoul(tokens[0], nullptr, 0);
-    char16_t unicode_char = stoul(tokens[1], nullptr, 0);
-
-    unicode_to_sjis_table_data[unicode_char] = sjis_char;
-    sjis_to_unicode_table_data[sjis_char] = unicode_char;
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x + 8), _mm_unpackhi_epi8(v, zero));
+  }
+#endif
+  for (; (x < count) && is_direct_char(static_cast<uint8_t>(src[x])); x++) {
+    dest[x] = src[x];
   }
+  return x;
 }
 
-static const vector<char16_t>& sjis_to_unicode_table() {
-  if (sjis_to_unicode_table_data.empty()) {
-    load_sjis_tables();
+static size_t encode_direct_chars(char* dest, const char16_t* src, size_t count) {
+  size_t x = 0;
+#ifdef __SSE2__
+  const __m128i min_minus_1 = _mm_set1_epi16(0x1F);
+  const __m128i max_plus_1 = _mm_set1_epi16(0x7E);
+  const __m128i backslash = _mm_set1_epi16(0x5C);
+  for (; x + 16 <= count; x += 16) {
+    // Characters 8000-FFFF are negative here, so they fail the first
+    // comparison
+    __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+    __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 8));
+    __m128i direct1 = _mm_andnot_si128(_mm_cmpeq_epi16(v1, backslash),
+        _mm_and_si128(_mm_cmpgt_epi16(v1, min_minus_1), _mm_cmplt_epi16(v1, max_plus_1)));
+    __m128i direct2 = _mm_andnot_si128(_mm_cmpeq_epi16(v2, backslash),
+        _mm_and_si128(_mm_cmpgt_epi16(v2, min_minus_1), _mm_cmplt_epi16(v2, max_plus_1)));
+    if (_mm_movemask_epi8(_mm_and_si128(direct1, direct2)) != 0xFFFF) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), _mm_packus_epi16(v1, v2));
+  }
+#endif
+  for (; (x < count) && is_direct_char(src[x]); x++) {
+    dest[x] = src[x];
   }
-  return sjis_to_unicode_table_data;
+  return x;
 }
 
-static const vector<char16_t>& unicode_to_sjis_table() {
-  if (unicode_to_sjis_table_data.empty()) {
-    load_sjis_tables();
+// Returns the translated character, or zero if it should be skipped
+static char16_t handle_untranslatable_char(
+    TranscodeErrorMode error_mode, const char* what) {
+  switch (error_mode) {
+    case TranscodeErrorMode::THROW:
+      throw runtime_error(what);
+    case TranscodeErrorMode::REPLACE:
+      return '?';
+    case TranscodeErrorMode::SKIP:
+      return 0;
   }
-  return unicode_to_sjis_table_data;
+  throw logic_error("invalid transcode error mode");
 }
 
 
 
-std::string encode_sjis(const char16_t* src, size_t src_count) {
-  const auto& table = unicode_to_sjis_table();
+std::string encode_sjis(
+    const char16_t* src, size_t src_count, TranscodeErrorMode error_mode) {
+  const auto* table = sjis_tables.unicode_to_sjis;
 
-  const char16_t* src_end = src + src_count;
   string ret;
-  while ((src != src_end) && *src) {
-    uint16_t ch = *(src++);
-    uint16_t translated_c = table[ch];
+  ret.resize(src_count);
+  size_t dest_offset = 0;
+  const char16_t* src_end = src + src_count;
+  while (src != src_end) {
+    size_t direct_count = encode_direct_chars(
+        ret.data() + dest_offset, src, min<size_t>(src_end - src, ret.size() - dest_offset));
+    src += direct_count;
+    dest_offset += direct_count;
+    if ((src == src_end) || !*src) {
+      break;
+    }
+
+    uint16_t translated_c = table[*(src++)];
     if (translated_c == 0) {
-      throw runtime_error("untranslatable unicode character");
-    } else if (translated_c & 0xFF00) {
-      ret.push_back((translated_c >> 8) & 0xFF);
-      ret.push_back(translated_c & 0xFF);
-    } else {
-      ret.push_back(translated_c & 0xFF);
+      translated_c = handle_untranslatable_char(
+          error_mode, "untranslatable unicode character");
+      if (translated_c == 0) {
+        continue;
+      }
+    }
+    if (ret.size() < dest_offset + 2) {
+      ret.resize(ret.size() * 2 + 2);
+    }
+    if (translated_c & 0xFF00) {
+      ret[dest_offset++] = (translated_c >> 8) & 0xFF;
     }
-  };
+    ret[dest_offset++] = translated_c & 0xFF;
+  }
+  ret.resize(dest_offset);
   return ret;
 }
 
@@ -96,8 +158,9 @@ size_t encode_sjis(
     size_t dest_count,
     const char16_t* src,
     size_t src_count,
-    bool allow_skip_terminator) {
-  const auto& table = unicode_to_sjis_table();
+    bool allow_skip_terminator,
+    TranscodeErrorMode error_mode) {
+  const auto* table = sjis_tables.unicode_to_sjis;
 
   if (dest_count == 0) {
     throw logic_error("cannot encode into zero-length buffer");
@@ -106,12 +169,24 @@ size_t encode_sjis(
   const char* dest_start = dest;
   const char16_t* src_end = src + src_count;
   const char* dest_end = dest + (allow_skip_terminator ? dest_count : (dest_count - 1));
-  while ((dest != dest_end) && (src != src_end) && *src) {
-    uint16_t ch = *(src++);
-    uint16_t translated_c = table[ch];
+  while ((dest != dest_end) && (src != src_end)) {
+    size_t direct_count = encode_direct_chars(
+        dest, src, min<size_t>(src_end - src, dest_end - dest));
+    src += direct_count;
+    dest += direct_count;
+    if ((dest == dest_end) || (src == src_end) || !*src) {
+      break;
+    }
+
+    uint16_t translated_c = table[*(src++)];
     if (translated_c == 0) {
-      throw runtime_error("untranslatable unicode character");
-    } else if (translated_c & 0xFF00) {
+      translated_c = handle_untranslatable_char(
+          error_mode, "untranslatable unicode character");
+      if (translated_c == 0) {
+        continue;
+      }
+    }
+    if (translated_c & 0xFF00) {
       *(dest++) = (translated_c >> 8) & 0xFF;
       // If the second byte of this character would cause the null to overrun
       // the buffer, erase the first byte instead and return early
@@ -131,24 +206,47 @@ size_t encode_sjis(
   return dest - dest_start;
 }
 
-std::u16string decode_sjis(const char* src, size_t src_count) {
-  const auto& table = sjis_to_unicode_table();
+std::u16string decode_sjis(
+    const char* src, size_t src_count, TranscodeErrorMode error_mode) {
+  const auto* table = sjis_tables.sjis_to_unicode;
 
-  const char* src_end = src + src_count;
+  // The result can't have more characters than the input has bytes
   u16string ret;
-  while ((src != src_end) && *src) {
-    uint16_t src_char = *(src++);
+  ret.resize(src_count);
+  char16_t* dest = ret.data();
+  const char* src_end = src + src_count;
+  while (src != src_end) {
+    size_t direct_count = decode_direct_chars(dest, src, src_end - src);
+    src += direct_count;
+    dest += direct_count;
+    if ((src == src_end) || !*src) {
+      break;
+    }
+
+    uint16_t src_char = static_cast<uint8_t>(*(src++));
     if (src_char & 0x80) {
-      if (src == src_end) {
-        throw runtime_error("incomplete extended character");
+      if ((src == src_end) || !*src) {
+        char16_t replacement = handle_untranslatable_char(
+            error_mode, "incomplete extended character");
+        if (replacement) {
+          *(dest++) = replacement;
+        }
+        break;
       }
-      src_char = (src_char << 8) | *(src++);
-      if ((src_char & 0xFF) == 0) {
-        throw runtime_error("incomplete extended character");
+      src_char = (src_char << 8) | static_cast<uint8_t>(*(src++));
+    }
+    // Characters that aren't in the table decode to zero in THROW mode, which
+    // ends the string
+    char16_t translated_c = table[src_char];
+    if ((translated_c == 0) && (error_mode != TranscodeErrorMode::THROW)) {
+      translated_c = handle_untranslatable_char(error_mode, nullptr);
+      if (translated_c == 0) {
+        continue;
       }
     }
-    ret.push_back(table[src_char]);
-  };
+    *(dest++) = translated_c;
+  }
+  ret.resize(dest - ret.data());
   return ret;
 }
 
@@ -157,8 +255,9 @@ size_t decode_sjis(
     size_t dest_count,
     const char* src,
     size_t src_count,
-    bool allow_skip_terminator) {
-  const auto& table = sjis_to_unicode_table();
+    bool allow_skip_terminator,
+    TranscodeErrorMode error_mode) {
+  const auto* table = sjis_tables.sjis_to_unicode;
 
   if (dest_count == 0) {
     throw logic_error("cannot decode into zero-length buffer");
@@ -167,19 +266,36 @@ size_t decode_sjis(
   const char16_t* dest_start = dest;
   const char* src_end = src + src_count;
   const char16_t* dest_end = dest + (allow_skip_terminator ? dest_count : (dest_count - 1));
-  while ((dest != dest_end) && (src != src_end) && *src) {
-    uint16_t src_char = *(src++);
+  while ((dest != dest_end) && (src != src_end)) {
+    size_t direct_count = decode_direct_chars(
+        dest, src, min<size_t>(src_end - src, dest_end - dest));
+    src += direct_count;
+    dest += direct_count;
+    if ((dest == dest_end) || (src == src_end) || !*src) {
+      break;
+    }
+
+    uint16_t src_char = static_cast<uint8_t>(*(src++));
     if (src_char & 0x80) {
-      if (src == src_end) {
-        throw runtime_error("incomplete extended character");
+      if ((src == src_end) || !*src) {
+        char16_t replacement = handle_untranslatable_char(
+            error_mode, "incomplete extended character");
+        if (replacement) {
+          *(dest++) = replacement;
+        }
+        break;
       }
-      src_char = (src_char << 8) | *(src++);
-      if ((src_char & 0xFF) == 0) {
-        throw runtime_error("incomplete extended character");
+      src_char = (src_char << 8) | static_cast<uint8_t>(*(src++));
+    }
+    char16_t translated_c = table[src_char];
+    if ((translated_c == 0) && (error_mode != TranscodeErrorMode::THROW)) {
+      translated_c = handle_untranslatable_char(error_mode, nullptr);
+      if (translated_c == 0) {
+        continue;
       }
     }
-    *(dest++) = table[src_char];
-  };
+    *(dest++) = translated_c;
+  }
   if (!allow_skip_terminator || (dest != dest_end)) {
     *(dest++) = 0;
   }
@@ -19,6 +19,19 @@
 
 // (1a) Conversion functions
 
+// What to do when a character can't be translated. In THROW mode,
+// runtime_error is thrown; in REPLACE mode, a question mark is written instead
+// of the character; in SKIP mode, the character is omitted from the output.
+// This also applies to two-byte Shift-JIS characters that are cut off by the
+// end of the input. (For compatibility, decode_sjis doesn't throw for
+// Shift-JIS characters that aren't in the table, even in THROW mode; it writes
+// a zero character instead.)
+enum class TranscodeErrorMode {
+  THROW = 0,
+  REPLACE,
+  SKIP,
+};
+
 // These return the number of characters written, including the terminating null
 // character. In the case of encode_sjis, two-byte characters count as two
 // characters, so the returned number is the number of bytes written.
@@ -28,21 +41,27 @@
 size_t encode_sjis(
     char* dest, size_t dest_count,
     const char16_t* src, size_t src_count,
-    bool allow_skip_terminator = false);
+    bool allow_skip_terminator = false,
+    TranscodeErrorMode error_mode = TranscodeErrorMode::THROW);
 size_t decode_sjis(
     char16_t* dest, size_t dest_count,
     const char* src, size_t src_count,
-    bool allow_skip_terminator = false);
+    bool allow_skip_terminator = false,
+    TranscodeErrorMode error_mode = TranscodeErrorMode::THROW);
 
-std::string encode_sjis(const char16_t* source, size_t src_count);
-std::u16string decode_sjis(const char* source, size_t src_count);
+std::string encode_sjis(const char16_t* source, size_t src_count,
+    TranscodeErrorMode error_mode = TranscodeErrorMode::THROW);
+std::u16string decode_sjis(const char* source, size_t src_count,
+    TranscodeErrorMode error_mode = TranscodeErrorMode::THROW);
 
-inline std::string encode_sjis(const std::u16string& s) {
-  return encode_sjis(s.data(), s.size());
+inline std::string encode_sjis(const std::u16string& s,
+    TranscodeErrorMode error_mode = TranscodeErrorMode::THROW) {
+  return encode_sjis(s.data(), s.size(), error_mode);
 }
 
-inline std::u16string decode_sjis(const std::string& s) {
-  return decode_sjis(s.data(), s.size());
+inline std::u16string decode_sjis(const std::string& s,
+    TranscodeErrorMode error_mode = TranscodeErrorMode::THROW) {
+  return decode_sjis(s.data(), s.size(), error_mode);
 }
 
 // (1b) Type-independent utility functions
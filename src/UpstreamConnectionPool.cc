@@ -0,0 +1,181 @@
+#include "UpstreamConnectionPool.hh"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+using namespace std;
+
+
+
+// How often expired connections are closed and standing connections reopened.
+// Standing connections are only reopened here (rather than immediately when
+// they're closed) so that a remote server that refuses connections can't make
+// us retry in a tight loop.
+static const uint64_t SWEEP_INTERVAL_USECS = 1000000;
+
+
+
+UpstreamConnectionPool::PooledConnection::PooledConnection(
+    UpstreamConnectionPool* pool, uint64_t key)
+  : pool(pool),
+    key(key),
+    bev(nullptr, bufferevent_free),
+    start_time(now()),
+    connected_time(0) { }
+
+
+
+UpstreamConnectionPool::UpstreamConnectionPool(
+    shared_ptr<struct event_base> base, uint64_t max_idle_usecs)
+  : base(base),
+    max_idle_usecs(max_idle_usecs),
+    sweep_event(event_new(this->base.get(), -1, EV_PERSIST,
+        &UpstreamConnectionPool::dispatch_on_sweep, this), event_free) {
+  memset(&this->stats, 0, sizeof(this->stats));
+  struct timeval tv = usecs_to_timeval(SWEEP_INTERVAL_USECS);
+  event_add(this->sweep_event.get(), &tv);
+}
+
+uint64_t UpstreamConnectionPool::key_for_destination(
+    const struct sockaddr_storage& dest) {
+  if (dest.ss_family != AF_INET) {
+    throw invalid_argument("upstream destination is not AF_INET");
+  }
+  const auto* sin = reinterpret_cast<const struct sockaddr_in*>(&dest);
+  return (static_cast<uint64_t>(ntohl(sin->sin_addr.s_addr)) << 16) |
+      ntohs(sin->sin_port);
+}
+
+unique_ptr<struct bufferevent, void(*)(struct bufferevent*)>
+UpstreamConnectionPool::start_connection(uint64_t key) {
+  unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> bev(
+      bufferevent_socket_new(this->base.get(), -1,
+        BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS),
+      bufferevent_free);
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(key >> 16);
+  sin.sin_port = htons(key & 0xFFFF);
+  this->stats.connects_started++;
+  if (bufferevent_socket_connect(bev.get(),
+      reinterpret_cast<const sockaddr*>(&sin), sizeof(sin)) != 0) {
+    this->stats.connects_failed++;
+    throw runtime_error(string_printf("failed to connect (%d)", EVUTIL_SOCKET_ERROR()));
+  }
+  return bev;
+}
+
+void UpstreamConnectionPool::open_pooled_connection(uint64_t key) {
+  unique_ptr<PooledConnection> conn(new PooledConnection(this, key));
+  conn->bev = this->start_connection(key);
+  // There's no read callback; any data the server sends stays in the input
+  // buffer until a session takes the connection. Reading is still enabled so
+  // we'll find out if the server disconnects.
+  bufferevent_setcb(conn->bev.get(), nullptr, nullptr,
+      &UpstreamConnectionPool::dispatch_on_pooled_event, conn.get());
+  bufferevent_enable(conn->bev.get(), EV_READ);
+  this->key_to_connection[key] = move(conn);
+}
+
+void UpstreamConnectionPool::prewarm(const struct sockaddr_storage& dest) {
+  uint64_t key = this->key_for_destination(dest);
+  if (!this->key_to_connection.count(key)) {
+    try {
+      this->open_pooled_connection(key);
+    } catch (const exception& e) {
+      log(WARNING, "[UpstreamConnectionPool] Failed to prewarm connection: %s", e.what());
+    }
+  }
+}
+
+void UpstreamConnectionPool::add_standing_destination(
+    const struct sockaddr_storage& dest) {
+  this->standing_keys.emplace(this->key_for_destination(dest));
+  this->prewarm(dest);
+}
+
+unique_ptr<struct bufferevent, void(*)(struct bufferevent*)>
+UpstreamConnectionPool::connect(
+    const struct sockaddr_storage& dest, uint64_t* connect_start_time) {
+  uint64_t key = this->key_for_destination(dest);
+
+  auto it = this->key_to_connection.find(key);
+  if (it != this->key_to_connection.end()) {
+    auto conn = move(it->second);
+    this->key_to_connection.erase(it);
+    bufferevent_disable(conn->bev.get(), EV_READ | EV_WRITE);
+    bufferevent_setcb(conn->bev.get(), nullptr, nullptr, nullptr, nullptr);
+    this->stats.pooled_connections_used++;
+    *connect_start_time = conn->connected_time ? 0 : conn->start_time;
+    return move(conn->bev);
+  }
+
+  *connect_start_time = now();
+  return this->start_connection(key);
+}
+
+void UpstreamConnectionPool::record_connect_result(
+    uint64_t connect_start_time, bool success) {
+  if (!success) {
+    this->stats.connects_failed++;
+    return;
+  }
+  uint64_t usecs = now() - connect_start_time;
+  this->stats.connects_completed++;
+  this->stats.total_connect_usecs += usecs;
+  if (usecs > this->stats.max_connect_usecs) {
+    this->stats.max_connect_usecs = usecs;
+  }
+}
+
+void UpstreamConnectionPool::dispatch_on_pooled_event(
+    struct bufferevent*, short events, void* ctx) {
+  auto* conn = reinterpret_cast<PooledConnection*>(ctx);
+  conn->pool->on_pooled_event(conn, events);
+}
+
+void UpstreamConnectionPool::on_pooled_event(
+    PooledConnection* conn, short events) {
+  if (events & BEV_EVENT_CONNECTED) {
+    conn->connected_time = now();
+    this->record_connect_result(conn->start_time, true);
+  }
+  if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    if (!conn->connected_time) {
+      this->record_connect_result(conn->start_time, false);
+    }
+    this->key_to_connection.erase(conn->key);
+    // conn is destroyed here; don't touch it
+  }
+}
+
+void UpstreamConnectionPool::dispatch_on_sweep(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<UpstreamConnectionPool*>(ctx)->on_sweep();
+}
+
+void UpstreamConnectionPool::on_sweep() {
+  uint64_t t = now();
+  for (auto it = this->key_to_connection.begin(); it != this->key_to_connection.end();) {
+    if (t - it->second->start_time >= this->max_idle_usecs) {
+      this->stats.pooled_connections_expired++;
+      it = this->key_to_connection.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  for (uint64_t key : this->standing_keys) {
+    if (!this->key_to_connection.count(key)) {
+      try {
+        this->open_pooled_connection(key);
+      } catch (const exception& e) {
+        log(WARNING, "[UpstreamConnectionPool] Failed to reopen standing connection: %s", e.what());
+      }
+    }
+  }
+}
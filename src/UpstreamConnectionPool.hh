@@ -0,0 +1,95 @@
+#pragma once
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+
+
+// Opens TCP connections to remote servers ahead of time, so that a proxy
+// session can use an already-open connection instead of waiting for a new one
+// to be set up when its client moves to a different server. PSO servers start
+// every connection with a new encryption handshake, so a connection can't be
+// reused once a session has used it; only connections that no session has
+// taken yet are kept in the pool. Data that the remote server sends before a
+// connection is taken (usually the server init command) stays in the
+// bufferevent's input buffer for the session to process. Unused connections
+// are closed after max_idle_usecs.
+//
+// Only IPv4 destinations are supported. All functions must be called on the
+// thread that runs base.
+class UpstreamConnectionPool {
+public:
+  struct Stats {
+    uint64_t connects_started;
+    uint64_t connects_completed;
+    uint64_t connects_failed;
+    uint64_t total_connect_usecs;
+    uint64_t max_connect_usecs;
+    uint64_t pooled_connections_used;
+    uint64_t pooled_connections_expired;
+  };
+
+  explicit UpstreamConnectionPool(
+      std::shared_ptr<struct event_base> base,
+      uint64_t max_idle_usecs = 30000000);
+  UpstreamConnectionPool(const UpstreamConnectionPool&) = delete;
+  UpstreamConnectionPool(UpstreamConnectionPool&&) = delete;
+  UpstreamConnectionPool& operator=(const UpstreamConnectionPool&) = delete;
+  UpstreamConnectionPool& operator=(UpstreamConnectionPool&&) = delete;
+  ~UpstreamConnectionPool() = default;
+
+  // Opens a connection to dest, unless there's already an unused one
+  void prewarm(const struct sockaddr_storage& dest);
+  // Keeps an unused connection to dest open at all times, reopening it shortly
+  // after it's taken, expires, or is closed by the remote server
+  void add_standing_destination(const struct sockaddr_storage& dest);
+
+  // Returns a connection to dest. If there's an unused connection in the pool,
+  // it's returned and connect_start_time is set to zero if it has already
+  // finished connecting; otherwise, connect_start_time is set to the time at
+  // which the connection was started, and the caller should call
+  // record_connect_result when the bufferevent's connected or error event
+  // occurs. The returned bufferevent has no callbacks set and is not enabled.
+  std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> connect(
+      const struct sockaddr_storage& dest, uint64_t* connect_start_time);
+  void record_connect_result(uint64_t connect_start_time, bool success);
+
+  inline const Stats& get_stats() const {
+    return this->stats;
+  }
+
+private:
+  struct PooledConnection {
+    UpstreamConnectionPool* pool;
+    uint64_t key;
+    std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> bev;
+    uint64_t start_time;
+    uint64_t connected_time; // 0 if not connected yet
+
+    PooledConnection(UpstreamConnectionPool* pool, uint64_t key);
+  };
+
+  std::shared_ptr<struct event_base> base;
+  uint64_t max_idle_usecs;
+  std::unordered_map<uint64_t, std::unique_ptr<PooledConnection>> key_to_connection;
+  std::unordered_set<uint64_t> standing_keys;
+  std::unique_ptr<struct event, void(*)(struct event*)> sweep_event;
+  Stats stats;
+
+  static uint64_t key_for_destination(const struct sockaddr_storage& dest);
+  std::unique_ptr<struct bufferevent, void(*)(struct bufferevent*)> start_connection(
+      uint64_t key);
+  void open_pooled_connection(uint64_t key);
+
+  static void dispatch_on_pooled_event(struct bufferevent* bev, short events,
+      void* ctx);
+  void on_pooled_event(PooledConnection* conn, short events);
+  static void dispatch_on_sweep(evutil_socket_t fd, short events, void* ctx);
+  void on_sweep();
+};
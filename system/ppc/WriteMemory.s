@@ -25,7 +25,7 @@
 # when sending the B2 command. This is needed if the server needs to do
 # something when the B3 response is received. For GameCube functions, if
 # specified, the index must be in the range 01-FF. The DOL loading
-# functionality, which this function is a part of, uses indexes E0, E1, and E2,
+# functionality, which this function is a part of, uses indexes E0 through E3,
 # but this function can also be used for other purposes.
 newserv_index_E1:
 
@@ -0,0 +1,132 @@
+# This function is used for loading DOLs. If it's present, newserv sends DOL
+# files in PRS-compressed chunks, which this function decompresses directly to
+# their destination in the client's memory. If it's not present, newserv sends
+# DOL files uncompressed with WriteMemory instead.
+
+# Like WriteMemory, the destination address is given in the dest_addr label and
+# the data follows the code (the suffix argument to send_function_call). The
+# data must be a complete PRS stream, and must not refer to any data before the
+# destination address. The function returns the address after the last byte
+# written.
+
+newserv_index_E3:
+
+entry_ptr:
+reloc0:
+  .offsetof start
+
+start:
+  .include InitClearCaches
+
+  bl      get_block_ptr
+  mr      r6, r3        # r6 = address of dest_addr label
+  lwz     r4, [r6]      # r4 = dest ptr
+  subi    r4, r4, 1     # subtract 1 so we can use stbu
+  addi    r3, r6, 3     # r3 = src ptr (starting at -1 so we can use lbzu)
+  li      r7, 0         # r7 = number of control bits remaining in r5
+
+  # PRS data is a sequence of commands, each of which is preceded by one or
+  # more control bits. The control bits are read from control bytes in the
+  # data stream, starting from the low bit of each byte. A control byte is read
+  # only when a control bit is needed and all bits of the previous control
+  # byte have been used.
+decompress__next:
+  bl      get_control_bit
+  cmplwi  r0, 0
+  beq     decompress__copy
+
+  # Control bit 1: copy one byte from the data stream to the output
+  lbzu    r0, [r3 + 1]
+  stbu    [r4 + 1], r0
+  b       decompress__next
+
+decompress__copy:
+  bl      get_control_bit
+  cmplwi  r0, 0
+  bne     decompress__long_copy
+
+  # Control bits 0, 0: short copy. The next two control bits are the size minus
+  # 2, and the next data byte is the offset (from -0x100 to -1)
+  bl      get_control_bit
+  mr      r8, r0
+  bl      get_control_bit
+  rlwinm  r8, r8, 1, 0, 30
+  or      r8, r8, r0
+  addi    r8, r8, 2     # r8 = number of bytes to copy
+  lbzu    r9, [r3 + 1]
+  subi    r9, r9, 0x100 # r9 = offset (negative)
+  b       decompress__copy_bytes
+
+  # Control bits 0, 1: long copy. The next two data bytes (little-endian) are
+  # the offset (high 13 bits) and size minus 2 (low 3 bits). If the size field
+  # is zero, the size minus 1 is in the following data byte instead. If both
+  # data bytes are zero, the end of the data has been reached.
+decompress__long_copy:
+  lbzu    r9, [r3 + 1]
+  lbzu    r0, [r3 + 1]
+  rlwinm  r0, r0, 8, 16, 23
+  or      r9, r9, r0    # r9 = both bytes
+  cmplwi  r9, 0
+  beq     decompress__done
+  rlwinm  r8, r9, 0, 29, 31     # r8 = size field
+  rlwinm  r9, r9, 29, 19, 31
+  subi    r9, r9, 0x2000        # r9 = offset (negative)
+  cmplwi  r8, 0
+  beq     decompress__long_copy_extended_size
+  addi    r8, r8, 2     # r8 = number of bytes to copy
+  b       decompress__copy_bytes
+decompress__long_copy_extended_size:
+  lbzu    r8, [r3 + 1]
+  addi    r8, r8, 1     # r8 = number of bytes to copy
+
+  # Copy r8 bytes from earlier in the output. This must be done one byte at a
+  # time, since the source and destination regions may overlap.
+decompress__copy_bytes:
+  add     r10, r4, r9   # r10 = copy src ptr (starting at -1 so we can use lbzu)
+decompress__copy_bytes__again:
+  lbzu    r0, [r10 + 1]
+  stbu    [r4 + 1], r0
+  subic.  r8, r8, 1
+  bne     decompress__copy_bytes__again
+  b       decompress__next
+
+decompress__done:
+  # Flush the data cache and clear the instruction cache at the written region
+  lwz     r3, [r6]      # r3 = dest ptr
+  addi    r4, r4, 1
+  sub     r4, r4, r3    # r4 = number of bytes written
+  mr      r7, r4
+  .include FlushCachedCode
+
+  # Return the address after the last byte written
+  lwz     r3, [r6]      # r3 = dest ptr
+  add     r3, r3, r7
+  mtlr    r12
+  blr
+
+  # Returns the next control bit in r0, reading a new control byte into r5 if
+  # needed
+get_control_bit:
+  cmplwi  r7, 0
+  bne     get_control_bit__have_bits
+  lbzu    r5, [r3 + 1]
+  li      r7, 8
+get_control_bit__have_bits:
+  subi    r7, r7, 1
+  rlwinm  r0, r5, 0, 31, 31
+  rlwinm  r5, r5, 31, 1, 31
+  blr
+
+get_block_ptr__ret:
+  mflr    r3
+  mtlr    r10
+  blr
+get_block_ptr:
+  # See WriteMemory.s for how this works
+  mflr    r10
+  bl      get_block_ptr__ret
+
+dest_addr:
+  .zero
+
+compressed_data: